@@ -0,0 +1,116 @@
+/*! Compiles the built-in layouts, to be embedded in the executable.
+ *
+ * The layouts get parsed, validated, and turned into the format
+ * from the `compiled` module.
+ * The modules needed for that are shared with the library.
+ */
+
+// Only parts of the shared modules are used here
+#![allow(dead_code)]
+
+#[macro_use]
+extern crate bitflags;
+extern crate serde;
+extern crate serde_yaml;
+extern crate xkbcommon;
+
+#[macro_use]
+#[path = "src/logging.rs"]
+mod logging;
+
+#[path = "src/action.rs"]
+mod action;
+#[path = "src/compiled.rs"]
+mod compiled;
+#[path = "src/keyboard.rs"]
+mod keyboard;
+#[path = "src/parsing.rs"]
+mod parsing;
+
+use std::env;
+use std::fs;
+use std::path::{ Path, PathBuf };
+
+/// Passes problems on to cargo, which shows them as warnings
+struct CargoWarn {
+    name: String,
+}
+
+impl logging::Handler for CargoWarn {
+    fn handle(&mut self, level: logging::Level, message: &str) {
+        match level {
+            logging::Level::Info | logging::Level::Debug => {},
+            level => println!(
+                "cargo:warning={}: {}: {}",
+                self.name, level.as_str(), message,
+            ),
+        }
+    }
+}
+
+fn push_bytes(out: &mut Vec<u8>, data: &[u8]) {
+    let len = data.len() as u32;
+    for i in 0..4 {
+        out.push((len >> (i * 8)) as u8);
+    }
+    out.extend_from_slice(data);
+}
+
+/// Packs named layouts together,
+/// in the format read by `compiled::find_in_bundle`
+fn write_bundle<'a, I>(layouts: I) -> Vec<u8>
+    where I: Iterator<Item=(&'a str, &'a compiled::Layout)>
+{
+    let mut bundle = Vec::new();
+    for (name, layout) in layouts {
+        push_bytes(&mut bundle, name.as_bytes());
+        push_bytes(&mut bundle, &layout.to_bytes());
+    }
+    bundle
+}
+
+fn main() {
+    let root = PathBuf::from(env::var_os("CARGO_MANIFEST_DIR").unwrap())
+        .join(Path::new(file!()).parent().unwrap());
+    let keyboards_dir = root.join("data").join("keyboards");
+    println!("cargo:rerun-if-changed={}", keyboards_dir.display());
+    for module in &["logging", "action", "compiled", "keyboard", "parsing"] {
+        println!(
+            "cargo:rerun-if-changed={}",
+            root.join("src").join(module).with_extension("rs").display(),
+        );
+    }
+
+    let mut names: Vec<String> = fs::read_dir(&keyboards_dir)
+        .expect("No keyboards directory")
+        .map(|entry| entry.expect("Can't list keyboards").path())
+        .filter(|path| path.extension().map_or(false, |ext| ext == "yaml"))
+        .map(|path| {
+            println!("cargo:rerun-if-changed={}", path.display());
+            path.file_stem().unwrap().to_str()
+                .expect("Keyboard name is not UTF-8")
+                .to_owned()
+        })
+        .collect();
+    // Same input, same output
+    names.sort();
+
+    let layouts: Vec<(String, compiled::Layout)> = names.into_iter()
+        .map(|name| {
+            let path = keyboards_dir.join(&name).with_extension("yaml");
+            let layout = parsing::Layout::from_file(path)
+                .unwrap_or_else(|e| panic!("Bad layout {}: {}", name, e));
+            let handler = CargoWarn { name: name.clone() };
+            let layout = layout.compile(handler).0
+                .unwrap_or_else(|e| panic!("Bad keymap in {}: {}", name, e));
+            (name, layout)
+        })
+        .collect();
+
+    let bundle = write_bundle(
+        layouts.iter().map(|(name, layout)| (name.as_str(), layout))
+    );
+    let out_dir = PathBuf::from(env::var_os("OUT_DIR").unwrap());
+    fs::write(out_dir.join("keyboards.bin"), bundle)
+        .expect("Failed to write compiled keyboards");
+}
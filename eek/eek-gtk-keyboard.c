@@ -28,6 +28,8 @@
 #include <math.h>
 #include <string.h>
 
+#include <gdk/gdkwayland.h>
+
 #include "eek-renderer.h"
 #include "eek-keyboard.h"
 
@@ -53,10 +55,22 @@ typedef struct _EekGtkKeyboardPrivate
 
     GdkEventSequence *sequence; // unowned reference
     LfbEvent *event;
+
+    GSettings *repeat_settings; // owned, nullable
+    guint repeat_tick_id; // 0 when not repeating
+    guint repeat_delay; // ms
+    guint repeat_interval; // ms
+    guint flush_id; // 0 when nothing waits to be sent
+    guint save_id; // 0 when not waiting to save what was learned
+    gint64 last_release; // monotonic, us
+    GdkFrameClock *frame_clock; // unowned, NULL when not realized
+    gulong before_paint_id;
 } EekGtkKeyboardPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (EekGtkKeyboard, eek_gtk_keyboard, GTK_TYPE_DRAWING_AREA)
 
+static void on_before_paint (GdkFrameClock *frame_clock, gpointer user_data);
+
 static void
 eek_gtk_keyboard_real_realize (GtkWidget      *self)
 {
@@ -70,6 +84,30 @@ eek_gtk_keyboard_real_realize (GtkWidget      *self)
                            GDK_TOUCH_MASK);
 
     GTK_WIDGET_CLASS (eek_gtk_keyboard_parent_class)->realize (self);
+
+    EekGtkKeyboardPrivate *priv =
+        eek_gtk_keyboard_get_instance_private (EEK_GTK_KEYBOARD (self));
+    priv->frame_clock = gtk_widget_get_frame_clock (self);
+    if (priv->frame_clock) {
+        priv->before_paint_id = g_signal_connect (priv->frame_clock,
+                                                  "before-paint",
+                                                  G_CALLBACK (on_before_paint),
+                                                  self);
+    }
+}
+
+static void
+eek_gtk_keyboard_real_unrealize (GtkWidget *self)
+{
+    EekGtkKeyboardPrivate *priv =
+        eek_gtk_keyboard_get_instance_private (EEK_GTK_KEYBOARD (self));
+    if (priv->frame_clock) {
+        g_signal_handler_disconnect (priv->frame_clock, priv->before_paint_id);
+        priv->frame_clock = NULL;
+        priv->before_paint_id = 0;
+    }
+
+    GTK_WIDGET_CLASS (eek_gtk_keyboard_parent_class)->unrealize (self);
 }
 
 static gboolean
@@ -153,6 +191,115 @@ on_event_triggered (LfbEvent      *event,
     }
 }
 
+static gboolean
+on_flush (gpointer user_data)
+{
+    EekGtkKeyboard *self = EEK_GTK_KEYBOARD (user_data);
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    priv->flush_id = 0;
+    submission_flush (priv->submission);
+    GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (self));
+    if (GDK_IS_WAYLAND_DISPLAY (display)) {
+        wl_display_flush (gdk_wayland_display_get_wl_display (display));
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Input events which arrive together get handled
+ * before anything they submitted is sent,
+ * so that it goes out in one batch.
+ * That still happens before redrawing, which has a lower priority. */
+static void schedule_flush(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (!priv->flush_id) {
+        priv->flush_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE, on_flush,
+                                          self, NULL);
+    }
+}
+
+static void flush_now(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (priv->flush_id) {
+        g_source_remove (priv->flush_id);
+    }
+    on_flush (self);
+}
+
+/* While frames are drawn, GDK holds input events back,
+ * and delivers them at the start of the next frame.
+ * The idle flush would only come after painting that frame,
+ * so the frame itself sends the input before it starts painting. */
+static void
+on_before_paint (GdkFrameClock *frame_clock,
+                 gpointer       user_data)
+{
+    (void)frame_clock;
+    EekGtkKeyboard *self = EEK_GTK_KEYBOARD (user_data);
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (priv->flush_id) {
+        flush_now (self);
+    }
+}
+
+static gboolean
+on_repeat_tick (GtkWidget     *widget,
+                GdkFrameClock *frame_clock,
+                gpointer       user_data)
+{
+    (void)user_data;
+    EekGtkKeyboardPrivate *priv =
+        eek_gtk_keyboard_get_instance_private (EEK_GTK_KEYBOARD (widget));
+    // Frame time is monotonic, like event time
+    uint32_t time = (uint32_t)(gdk_frame_clock_get_frame_time (frame_clock) / 1000);
+    // All repeats due within this frame get submitted together
+    if (priv->keyboard
+            && squeek_layout_repeat(priv->keyboard->layout, priv->submission,
+                                    priv->repeat_delay, priv->repeat_interval,
+                                    time)) {
+        // Ticks come after the start of the frame, but before painting
+        flush_now (EEK_GTK_KEYBOARD (widget));
+        return G_SOURCE_CONTINUE;
+    }
+    priv->repeat_tick_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+// Starts watching the held key, if it repeats on this side, for repeating
+static void start_repeat(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (priv->repeat_tick_id) {
+        return;
+    }
+    // The compositor repeats plain keys, no need to wake up every frame
+    if (!priv->keyboard || !squeek_layout_is_repeating(priv->keyboard->layout)) {
+        return;
+    }
+    priv->repeat_delay = 500;
+    priv->repeat_interval = 30;
+    if (priv->repeat_settings) {
+        if (!g_settings_get_boolean (priv->repeat_settings, "repeat")) {
+            return;
+        }
+        priv->repeat_delay = g_settings_get_uint (priv->repeat_settings, "delay");
+        priv->repeat_interval = g_settings_get_uint (priv->repeat_settings, "repeat-interval");
+    }
+    priv->repeat_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self),
+                                                         on_repeat_tick,
+                                                         NULL, NULL);
+}
+
+static void stop_repeat(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (priv->repeat_tick_id) {
+        gtk_widget_remove_tick_callback (GTK_WIDGET (self), priv->repeat_tick_id);
+        priv->repeat_tick_id = 0;
+    }
+}
+
 static void depress(EekGtkKeyboard *self,
                     gdouble x, gdouble y, guint32 time)
 {
@@ -163,6 +310,8 @@ static void depress(EekGtkKeyboard *self,
     squeek_layout_depress(priv->keyboard->layout,
                           priv->submission,
                           x, y, eek_renderer_get_transformation(priv->renderer), time, self);
+    schedule_flush(self);
+    start_repeat(self);
 }
 
 static void drag(EekGtkKeyboard *self,
@@ -176,6 +325,41 @@ static void drag(EekGtkKeyboard *self,
                        priv->submission,
                        x, y, eek_renderer_get_transformation(priv->renderer), time,
                        priv->eekboard_context, self);
+    schedule_flush(self);
+    // Dragging may have pressed another key
+    start_repeat(self);
+}
+
+/* Learning touches is cheap, but saving them takes a file write,
+ * so that waits until typing stops for a while. */
+#define SAVE_DELAY_S 5
+
+static gboolean
+on_save (gpointer user_data)
+{
+    EekGtkKeyboard *self = EEK_GTK_KEYBOARD (user_data);
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    if (g_get_monotonic_time () - priv->last_release
+            < SAVE_DELAY_S * G_USEC_PER_SEC) {
+        // Still typing
+        return G_SOURCE_CONTINUE;
+    }
+    priv->save_id = 0;
+    if (priv->keyboard) {
+        squeek_layout_save_learned (priv->keyboard->layout);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_save(EekGtkKeyboard *self)
+{
+    EekGtkKeyboardPrivate *priv = eek_gtk_keyboard_get_instance_private (self);
+    priv->last_release = g_get_monotonic_time ();
+    if (!priv->save_id) {
+        priv->save_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                                    SAVE_DELAY_S, on_save,
+                                                    self, NULL);
+    }
 }
 
 static void release(EekGtkKeyboard *self, guint32 time)
@@ -188,6 +372,8 @@ static void release(EekGtkKeyboard *self, guint32 time)
                           priv->submission,
                           eek_renderer_get_transformation(priv->renderer), time,
                           priv->eekboard_context, self);
+    schedule_flush(self);
+    schedule_save(self);
 }
 
 static gboolean
@@ -278,7 +464,15 @@ eek_gtk_keyboard_real_unmap (GtkWidget *self)
             priv->keyboard->layout,
             priv->submission,
             gdk_event_get_time(NULL));
+        schedule_flush(EEK_GTK_KEYBOARD (self));
+        // Nobody types on a hidden keyboard, so it's a good time to save
+        squeek_layout_suspend(priv->keyboard->layout);
+    }
+    if (priv->save_id) {
+        g_source_remove (priv->save_id);
+        priv->save_id = 0;
     }
+    stop_repeat(EEK_GTK_KEYBOARD (self));
 
     GTK_WIDGET_CLASS (eek_gtk_keyboard_parent_class)->unmap (self);
 }
@@ -317,6 +511,20 @@ eek_gtk_keyboard_dispose (GObject *object)
         priv->keyboard = NULL;
     }
 
+    // Nothing submitted gets left behind
+    if (priv->flush_id) {
+        flush_now (self);
+    }
+
+    // The layout saves what it learned when it's freed
+    if (priv->save_id) {
+        g_source_remove (priv->save_id);
+        priv->save_id = 0;
+    }
+
+    stop_repeat(self);
+    g_clear_object (&priv->repeat_settings);
+
     if (priv->event) {
         g_clear_object (&priv->event);
         lfb_uninit ();
@@ -332,6 +540,7 @@ eek_gtk_keyboard_class_init (EekGtkKeyboardClass *klass)
     GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
     widget_class->realize = eek_gtk_keyboard_real_realize;
+    widget_class->unrealize = eek_gtk_keyboard_real_unrealize;
     widget_class->unmap = eek_gtk_keyboard_real_unmap;
     widget_class->draw = eek_gtk_keyboard_real_draw;
     widget_class->size_allocate = eek_gtk_keyboard_real_size_allocate;
@@ -360,6 +569,19 @@ eek_gtk_keyboard_init (EekGtkKeyboard *self)
         priv->event = lfb_event_new ("button-pressed");
     else
         g_warning ("Failed to init libfeedback: %s", err->message);
+
+    const char *schema_name = "org.gnome.desktop.peripherals.keyboard";
+    GSettingsSchemaSource *ssrc = g_settings_schema_source_get_default();
+    GSettingsSchema *schema = ssrc
+        ? g_settings_schema_source_lookup(ssrc, schema_name, TRUE)
+        : NULL;
+    if (schema) {
+        priv->repeat_settings = g_settings_new (schema_name);
+        g_settings_schema_unref (schema);
+    } else {
+        g_warning("Gsettings schema %s is not installed on the system. "
+                  "Using default key repeat settings.", schema_name);
+    }
 }
 
 static void
@@ -20,74 +20,141 @@
 
 #include "config.h"
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/random.h> // TODO: this is Linux-specific
-#include <xkbcommon/xkbcommon.h>
+#include <unistd.h>
 
 
 #include "eek-keyboard.h"
 
+/// Keymaps which are not used by any keyboard, but are kept for reuse
+#define KEYMAP_IDLE_MAX 4
+
+/// A keymap file, shared by all keyboards with the same keymap text
+struct eek_keymap {
+    char *source; // owned, the key in the table
+    int fd; // owned, sealed, keymap formatted as XKB string
+    size_t len; // length of the data inside fd
+    guint refcount; // keyboards using it
+};
+
+/* Keyboards are built on worker threads, and freed on the main thread,
+ * so everything about keymaps happens under one lock. */
+G_LOCK_DEFINE_STATIC(keymaps);
+/// Source text -> struct eek_keymap
+static GHashTable *keymaps_table = NULL;
+/// Unused keymaps, least recently used first
+static GQueue keymaps_idle = G_QUEUE_INIT;
+
+static void eek_keymap_free(struct eek_keymap *self) {
+    close(self->fd);
+    g_free(self->source);
+    g_free(self);
+}
+
+/// Stores the serialized keymap in a sealed memory file,
+/// which the compositor can map, but nobody can change.
+int eek_keymap_fd_new(const char *data, size_t len) {
+    int fd = memfd_create("squeekboard-keymap",
+        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        g_error("Failed to create keymap fd: %s", g_strerror(errno));
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = write(fd, data + written, len - written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_error("Failed to write keymap: %s", g_strerror(errno));
+        }
+        written += (size_t)ret;
+    }
+    if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        g_error("Failed to seal keymap fd: %s", g_strerror(errno));
+    }
+    return fd;
+}
+
+/// The keymap text was checked when the layout got compiled,
+/// so it goes to the compositor as it is.
+static struct eek_keymap *eek_keymap_new(const char *keymap_str) {
+    struct eek_keymap *self = g_new0(struct eek_keymap, 1);
+    self->source = g_strdup(keymap_str);
+    self->len = strlen(keymap_str) + 1;
+    self->fd = eek_keymap_fd_new(keymap_str, self->len);
+    return self;
+}
+
+/// Returns a keymap for the text, creating it only if it's new
+static struct eek_keymap *eek_keymap_get(const char *keymap_str) {
+    G_LOCK(keymaps);
+    if (!keymaps_table) {
+        keymaps_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    struct eek_keymap *self = g_hash_table_lookup(keymaps_table, keymap_str);
+    if (!self) {
+        self = eek_keymap_new(keymap_str);
+        g_hash_table_insert(keymaps_table, self->source, self);
+    } else if (self->refcount == 0) {
+        g_queue_remove(&keymaps_idle, self);
+    }
+    self->refcount++;
+    G_UNLOCK(keymaps);
+    return self;
+}
+
+static void eek_keymap_release(struct eek_keymap *self) {
+    G_LOCK(keymaps);
+    self->refcount--;
+    if (self->refcount == 0) {
+        g_queue_push_tail(&keymaps_idle, self);
+        if (g_queue_get_length(&keymaps_idle) > KEYMAP_IDLE_MAX) {
+            struct eek_keymap *oldest = g_queue_pop_head(&keymaps_idle);
+            g_hash_table_remove(keymaps_table, oldest->source);
+            eek_keymap_free(oldest);
+        }
+    }
+    G_UNLOCK(keymaps);
+}
+
 void level_keyboard_free(LevelKeyboard *self) {
-    xkb_keymap_unref(self->keymap);
-    close(self->keymap_fd);
-    squeek_layout_free(self->layout);
+    eek_keymap_release(self->keymap);
+    if (self->layout) {
+        squeek_layout_free(self->layout);
+    }
     g_free(self);
 }
 
 LevelKeyboard*
 level_keyboard_new (struct squeek_layout *layout)
+{
+    LevelKeyboard *keyboard = level_keyboard_new_from_keymap(
+        squeek_layout_get_keymap(layout));
+    keyboard->layout = layout;
+    return keyboard;
+}
+
+/// Creates a keyboard without a layout.
+/// Can be used on any thread.
+/// Keyboards with the same keymap text share the file
+/// sent to the compositor.
+LevelKeyboard*
+level_keyboard_new_from_keymap (const char *keymap_str)
 {
     LevelKeyboard *keyboard = g_new0(LevelKeyboard, 1);
 
     if (!keyboard) {
         g_error("Failed to create a keyboard");
     }
-    keyboard->layout = layout;
-
-    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-    if (!context) {
-        g_error("No context created");
-    }
 
-    const gchar *keymap_str = squeek_layout_get_keymap(keyboard->layout);
-
-    struct xkb_keymap *keymap = xkb_keymap_new_from_string(context, keymap_str,
-        XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
-
-    if (!keymap)
-        g_error("Bad keymap:\n%s", keymap_str);
-
-    xkb_context_unref(context);
-    keyboard->keymap = keymap;
-
-    keymap_str = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
-    keyboard->keymap_len = strlen(keymap_str) + 1;
-
-    g_autofree char *path = strdup("/eek_keymap-XXXXXX");
-    char *r = &path[strlen(path) - 6];
-    getrandom(r, 6, GRND_NONBLOCK);
-    for (unsigned i = 0; i < 6; i++) {
-        r[i] = (r[i] & 0b1111111) | 0b1000000; // A-z
-        r[i] = r[i] > 'z' ? '?' : r[i]; // The randomizer doesn't need to be good...
-    }
-    int keymap_fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
-    if (keymap_fd < 0) {
-        g_error("Failed to set up keymap fd");
-    }
-    keyboard->keymap_fd = keymap_fd;
-    shm_unlink(path);
-    if (ftruncate(keymap_fd, (off_t)keyboard->keymap_len)) {
-        g_error("Failed to increase keymap fd size");
-    }
-    char *ptr = mmap(NULL, keyboard->keymap_len, PROT_WRITE, MAP_SHARED,
-        keymap_fd, 0);
-    if ((void*)ptr == (void*)-1) {
-        g_error("Failed to set up mmap");
-    }
-    strncpy(ptr, keymap_str, keyboard->keymap_len);
-    munmap(ptr, keyboard->keymap_len);
+    keyboard->keymap = eek_keymap_get(keymap_str);
+    keyboard->keymap_fd = keyboard->keymap->fd;
+    keyboard->keymap_len = keyboard->keymap->len;
     return keyboard;
 }
@@ -32,11 +32,13 @@
 
 G_BEGIN_DECLS
 
+struct eek_keymap;
+
 /// Keyboard state holder
 struct _LevelKeyboard {
-    struct squeek_layout *layout; // owned
-    struct xkb_keymap *keymap; // owned
-    int keymap_fd; // keymap formatted as XKB string
+    struct squeek_layout *layout; // owned, NULL until set by the main thread
+    struct eek_keymap *keymap; // shared between keyboards with the same keymap
+    int keymap_fd; // sealed, keymap formatted as XKB string, owned by keymap
     size_t keymap_len; // length of the data inside keymap_fd
 
     guint id; // as a key to layout choices
@@ -48,7 +50,11 @@ gchar *             eek_keyboard_get_keymap
 
 LevelKeyboard*
 level_keyboard_new (struct squeek_layout *layout);
+LevelKeyboard*
+level_keyboard_new_from_keymap (const char *keymap_str);
 void level_keyboard_free(LevelKeyboard *self);
 
+int eek_keymap_fd_new(const char *data, size_t len);
+
 G_END_DECLS
 #endif  /* EEK_KEYBOARD_H */
@@ -19,8 +19,10 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #include <gio/gio.h>
+#include <glib-unix.h>
 
 #include "wayland.h"
 
@@ -42,11 +44,47 @@ enum {
 
 static guint signals[LAST_SIGNAL] = { 0, };
 
+/// Keyboards kept around besides the current one.
+/// This is also the budget for keyboards built ahead of time.
+#define KEYBOARD_CACHE_SIZE 6
+
+/// A keyboard which is not in use, ready to be reused
+struct keyboard_cache_entry {
+    gchar *layout_name; // owned, NULL if the entry is empty
+    enum squeek_arrangement_kind arrangement;
+    LevelKeyboard *keyboard; // owned
+};
+
+/// A keyboard being built on a worker thread
+struct keyboard_build {
+    gchar *layout_name; // owned
+    const struct squeek_layout_watcher *watcher; // unowned, may be NULL
+    const struct squeek_keymap_superset *superset; // unowned
+    enum squeek_arrangement_kind arrangement;
+    uint32_t timestamp;
+    // Filled in by the worker
+    struct squeek_prepared_layout *prepared; // owned
+    LevelKeyboard *keyboard; // owned, without a layout
+};
+
 #define EEKBOARD_CONTEXT_SERVICE_GET_PRIVATE(obj)                       \
     (G_TYPE_INSTANCE_GET_PRIVATE ((obj), EEKBOARD_TYPE_CONTEXT_SERVICE, EekboardContextServicePrivate))
 
 struct _EekboardContextServicePrivate {
     LevelKeyboard *keyboard; // currently used keyboard
+    /// What the current keyboard was loaded for
+    gchar *layout_name; // owned
+    enum squeek_arrangement_kind arrangement;
+    /// Most recently used first
+    struct keyboard_cache_entry cache[KEYBOARD_CACHE_SIZE];
+    /// The build whose result is wanted, NULL if none
+    struct keyboard_build *build; // unowned, belongs to its task
+    /// The build of a keyboard which may be needed soon, NULL if none
+    struct keyboard_build *prefetch; // unowned, belongs to its task
+    guint prefetch_source; // 0 if prefetching is not scheduled
+    struct squeek_layout_watcher *watcher; // owned
+    guint watcher_source; // 0 if not watching
+    struct squeek_keymap_superset *superset; // owned
     GSettings *settings; // Owned reference
 
     // Maybe TODO: it's used only for fetching layout type.
@@ -90,9 +128,148 @@ eekboard_context_service_get_property (GObject    *object,
     }
 }
 
+static void
+keyboard_cache_entry_clear(struct keyboard_cache_entry *entry)
+{
+    if (entry->keyboard) {
+        level_keyboard_free(entry->keyboard);
+    }
+    g_free(entry->layout_name);
+    *entry = (struct keyboard_cache_entry){0};
+}
+
+/// Returns the index of the keyboard in the cache, or -1 if missing.
+static int
+keyboard_cache_find(EekboardContextServicePrivate *priv,
+                    const char *layout_name,
+                    enum squeek_arrangement_kind arrangement)
+{
+    struct keyboard_cache_entry *cache = priv->cache;
+    for (unsigned i = 0; i < KEYBOARD_CACHE_SIZE; i++) {
+        if (cache[i].layout_name
+                && g_strcmp0(cache[i].layout_name, layout_name) == 0
+                && cache[i].arrangement == arrangement) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/// Removes the keyboard from the cache and returns it, or NULL if missing.
+static LevelKeyboard *
+keyboard_cache_take(EekboardContextServicePrivate *priv,
+                    const char *layout_name,
+                    enum squeek_arrangement_kind arrangement)
+{
+    struct keyboard_cache_entry *cache = priv->cache;
+    int i = keyboard_cache_find(priv, layout_name, arrangement);
+    if (i < 0) {
+        return NULL;
+    }
+    LevelKeyboard *keyboard = cache[i].keyboard;
+    g_free(cache[i].layout_name);
+    memmove(&cache[i], &cache[i + 1],
+            (KEYBOARD_CACHE_SIZE - i - 1) * sizeof(cache[0]));
+    cache[KEYBOARD_CACHE_SIZE - 1] = (struct keyboard_cache_entry){0};
+    return keyboard;
+}
+
+static gboolean
+keyboard_cache_is_full(EekboardContextServicePrivate *priv)
+{
+    return priv->cache[KEYBOARD_CACHE_SIZE - 1].layout_name != NULL;
+}
+
+/// Adds the keyboard as the least recently used one.
+/// Takes ownership of the keyboard and the name.
+/// The cache must not be full.
+static void
+keyboard_cache_append(EekboardContextServicePrivate *priv,
+                      gchar *layout_name,
+                      enum squeek_arrangement_kind arrangement,
+                      LevelKeyboard *keyboard)
+{
+    struct keyboard_cache_entry *cache = priv->cache;
+    unsigned i = 0;
+    while (cache[i].layout_name) {
+        i++;
+    }
+    cache[i] = (struct keyboard_cache_entry){
+        .layout_name = layout_name,
+        .arrangement = arrangement,
+        .keyboard = keyboard,
+    };
+}
+
+/// Takes ownership of the keyboard and the name.
+/// Drops the least recently used keyboard if the cache is full.
+static void
+keyboard_cache_put(EekboardContextServicePrivate *priv,
+                   gchar *layout_name,
+                   enum squeek_arrangement_kind arrangement,
+                   LevelKeyboard *keyboard)
+{
+    struct keyboard_cache_entry *cache = priv->cache;
+    keyboard_cache_entry_clear(&cache[KEYBOARD_CACHE_SIZE - 1]);
+    memmove(&cache[1], &cache[0],
+            (KEYBOARD_CACHE_SIZE - 1) * sizeof(cache[0]));
+    cache[0] = (struct keyboard_cache_entry){
+        .layout_name = layout_name,
+        .arrangement = arrangement,
+        .keyboard = keyboard,
+    };
+}
+
+static void
+keyboard_build_free(gpointer data)
+{
+    struct keyboard_build *build = data;
+    if (build->keyboard) {
+        level_keyboard_free(build->keyboard);
+    }
+    if (build->prepared) {
+        squeek_prepared_layout_free(build->prepared);
+    }
+    g_free(build->layout_name);
+    g_free(build);
+}
+
+/// Runs on a worker thread, so must not touch the context service
+static void
+keyboard_build_run(GTask *task, gpointer source_object,
+                   gpointer task_data, GCancellable *cancellable)
+{
+    (void)source_object;
+    (void)cancellable;
+    struct keyboard_build *build = task_data;
+    build->prepared = squeek_prepare_layout(build->layout_name,
+                                            build->arrangement,
+                                            build->watcher,
+                                            build->superset);
+    build->keyboard = level_keyboard_new_from_keymap(
+        squeek_prepared_layout_get_keymap(build->prepared));
+    g_task_return_boolean(task, TRUE);
+}
+
 static void
 eekboard_context_service_dispose (GObject *object)
 {
+    EekboardContextService *context = EEKBOARD_CONTEXT_SERVICE(object);
+    if (context->priv->prefetch_source) {
+        g_source_remove(context->priv->prefetch_source);
+        context->priv->prefetch_source = 0;
+    }
+    if (context->priv->watcher_source) {
+        g_source_remove(context->priv->watcher_source);
+        context->priv->watcher_source = 0;
+    }
+    g_clear_pointer(&context->priv->watcher, squeek_layout_watcher_free);
+    g_clear_pointer(&context->priv->superset, squeek_keymap_superset_free);
+    for (unsigned i = 0; i < KEYBOARD_CACHE_SIZE; i++) {
+        keyboard_cache_entry_clear(&context->priv->cache[i]);
+    }
+    g_clear_pointer(&context->priv->layout_name, g_free);
+
     G_OBJECT_CLASS (eekboard_context_service_parent_class)->
         dispose (object);
 }
@@ -115,6 +292,228 @@ settings_get_layout(GSettings *settings, char **type, char **layout)
     g_variant_unref(inputs);
 }
 
+static void prefetch_schedule(EekboardContextService *context);
+
+/// Makes the keyboard current, and sets the previous one aside
+static void
+use_keyboard(EekboardContextService *context, LevelKeyboard *keyboard,
+             const char *layout_name,
+             enum squeek_arrangement_kind arrangement, uint32_t timestamp)
+{
+    EekboardContextServicePrivate *priv = context->priv;
+    // set as current
+    LevelKeyboard *previous_keyboard = priv->keyboard;
+    gchar *previous_layout_name = priv->layout_name;
+    enum squeek_arrangement_kind previous_arrangement = priv->arrangement;
+    priv->keyboard = keyboard;
+    priv->layout_name = g_strdup(layout_name);
+    priv->arrangement = arrangement;
+    // Update the keymap if necessary.
+    // TODO: Update submission on change event
+    if (context->priv->submission) {
+        submission_set_keyboard(context->priv->submission, keyboard,
+                                keyboard->layout, timestamp);
+    }
+
+    // Update UI
+    g_object_notify (G_OBJECT(context), "keyboard");
+
+    // replacing the keyboard above will cause the previous keyboard to get destroyed from the UI side (eek_gtk_keyboard_dispose)
+    if (previous_keyboard) {
+        squeek_layout_suspend(previous_keyboard->layout);
+        if (g_strcmp0(previous_layout_name, layout_name) == 0
+                && previous_arrangement == arrangement) {
+            // Replaced by a reloaded version
+            level_keyboard_free(previous_keyboard);
+            g_free(previous_layout_name);
+        } else {
+            keyboard_cache_put(priv, previous_layout_name,
+                               previous_arrangement, previous_keyboard);
+        }
+    }
+    prefetch_schedule(context);
+}
+
+/// Runs on the main thread once the worker is done
+static void
+keyboard_build_done(GObject *source_object, GAsyncResult *result,
+                    gpointer user_data)
+{
+    (void)user_data;
+    EekboardContextService *context = EEKBOARD_CONTEXT_SERVICE(source_object);
+    EekboardContextServicePrivate *priv = context->priv;
+    struct keyboard_build *build = g_task_get_task_data(G_TASK(result));
+    if (build != priv->build && build != priv->prefetch) {
+        // Another layout got requested in the meantime
+        prefetch_schedule(context);
+        return;
+    }
+
+    LevelKeyboard *keyboard = build->keyboard;
+    keyboard->layout = squeek_layout_from_prepared(build->prepared);
+    build->keyboard = NULL;
+    build->prepared = NULL;
+
+    if (build == priv->build) {
+        priv->build = NULL;
+        use_keyboard(context, keyboard, build->layout_name,
+                     build->arrangement, build->timestamp);
+    } else {
+        priv->prefetch = NULL;
+        // Used keyboards may have filled the cache in the meantime
+        if (keyboard_cache_is_full(priv)
+                || keyboard_cache_find(priv, build->layout_name,
+                                       build->arrangement) >= 0) {
+            level_keyboard_free(keyboard);
+        } else {
+            keyboard_cache_append(priv, g_strdup(build->layout_name),
+                                  build->arrangement, keyboard);
+        }
+        prefetch_schedule(context);
+    }
+}
+
+static struct keyboard_build *
+keyboard_build_start(EekboardContextService *context,
+                     const char *layout_name,
+                     enum squeek_arrangement_kind arrangement,
+                     uint32_t timestamp, int priority)
+{
+    struct keyboard_build *build = g_new0(struct keyboard_build, 1);
+    build->layout_name = g_strdup(layout_name);
+    build->arrangement = arrangement;
+    build->timestamp = timestamp;
+    build->watcher = context->priv->watcher;
+    build->superset = context->priv->superset;
+
+    GTask *task = g_task_new(context, NULL, keyboard_build_done, NULL);
+    g_task_set_task_data(task, build, keyboard_build_free);
+    g_task_set_priority(task, priority);
+    g_task_run_in_thread(task, keyboard_build_run);
+    g_object_unref(task);
+    return build;
+}
+
+/// Starts building the keyboard ahead of time,
+/// unless it's already available.
+/// Returns whether the build started.
+static gboolean
+prefetch_start(EekboardContextService *context,
+               const char *layout_name,
+               enum squeek_arrangement_kind arrangement)
+{
+    EekboardContextServicePrivate *priv = context->priv;
+    if (!layout_name
+            || (g_strcmp0(priv->layout_name, layout_name) == 0
+                && priv->arrangement == arrangement)
+            || keyboard_cache_find(priv, layout_name, arrangement) >= 0) {
+        return FALSE;
+    }
+    priv->prefetch = keyboard_build_start(context, layout_name, arrangement,
+                                          0, G_PRIORITY_LOW);
+    return TRUE;
+}
+
+/// Builds one of the keyboards likely to be needed next,
+/// the most likely first.
+/// Called again when the build is done.
+static gboolean
+prefetch_step(gpointer user_data)
+{
+    EekboardContextService *context = user_data;
+    EekboardContextServicePrivate *priv = context->priv;
+    priv->prefetch_source = 0;
+    // Don't compete with the keyboard the user is waiting for
+    if (!priv->keyboard || priv->build || priv->prefetch
+            || keyboard_cache_is_full(priv)) {
+        return G_SOURCE_REMOVE;
+    }
+
+    enum squeek_arrangement_kind arrangement = priv->arrangement;
+    // Content purposes
+    if (prefetch_start(context, "number", arrangement)
+            || prefetch_start(context, "terminal", arrangement)) {
+        return G_SOURCE_REMOVE;
+    }
+    // Rotation
+    enum squeek_arrangement_kind rotated =
+        arrangement == ARRANGEMENT_KIND_BASE ? ARRANGEMENT_KIND_WIDE
+                                             : ARRANGEMENT_KIND_BASE;
+    if (prefetch_start(context, priv->layout_name, rotated)) {
+        return G_SOURCE_REMOVE;
+    }
+    // Switching to other configured layouts
+    if (priv->settings) {
+        GVariant *inputs = g_settings_get_value(priv->settings, "sources");
+        gsize count = g_variant_n_children(inputs);
+        gboolean started = FALSE;
+        for (gsize i = 0; i < count && !started; i++) {
+            g_autofree gchar *type = NULL;
+            g_autofree gchar *layout = NULL;
+            g_variant_get_child(inputs, i, "(ss)", &type, &layout);
+            started = prefetch_start(context, layout, arrangement);
+        }
+        g_variant_unref(inputs);
+        if (started) {
+            return G_SOURCE_REMOVE;
+        }
+    }
+    // Overlays
+    prefetch_start(context, "emoji", arrangement);
+    return G_SOURCE_REMOVE;
+}
+
+/// Builds likely keyboards while the main loop has nothing better to do
+static void
+prefetch_schedule(EekboardContextService *context)
+{
+    if (!context->priv->prefetch_source) {
+        context->priv->prefetch_source = g_idle_add_full(
+            G_PRIORITY_LOW, prefetch_step, context, NULL);
+    }
+}
+
+/// Rebuilds keyboards after the layout files changed
+static void
+keyboards_reload(EekboardContextService *context)
+{
+    EekboardContextServicePrivate *priv = context->priv;
+    for (unsigned i = 0; i < KEYBOARD_CACHE_SIZE; i++) {
+        keyboard_cache_entry_clear(&priv->cache[i]);
+    }
+    // Results of running builds may be outdated
+    priv->prefetch = NULL;
+    g_autofree gchar *layout_name = NULL;
+    enum squeek_arrangement_kind arrangement;
+    if (priv->build) {
+        layout_name = g_strdup(priv->build->layout_name);
+        arrangement = priv->build->arrangement;
+    } else if (priv->keyboard) {
+        layout_name = g_strdup(priv->layout_name);
+        arrangement = priv->arrangement;
+    } else {
+        return;
+    }
+    // The current keyboard stays usable until the new one is built
+    uint32_t time = gdk_event_get_time(NULL);
+    priv->build = keyboard_build_start(context, layout_name, arrangement,
+                                       time, G_PRIORITY_DEFAULT);
+}
+
+static gboolean
+handle_layout_files_changed(gint fd, GIOCondition condition,
+                            gpointer user_data)
+{
+    (void)fd;
+    (void)condition;
+    EekboardContextService *context = user_data;
+    if (squeek_layout_watcher_dispatch(context->priv->watcher)) {
+        g_debug("Layout files changed, reloading");
+        keyboards_reload(context);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
 void
 eekboard_context_service_use_layout(EekboardContextService *context, struct squeek_layout_state *state, uint32_t timestamp) {
     gchar *layout_name = state->overlay_name;
@@ -140,23 +539,49 @@ eekboard_context_service_use_layout(EekboardContextService *context, struct sque
     }
 
     // generic part follows
-    struct squeek_layout *layout = squeek_load_layout(layout_name, state->arrangement);
-    LevelKeyboard *keyboard = level_keyboard_new(layout);
-    // set as current
-    LevelKeyboard *previous_keyboard = context->priv->keyboard;
-    context->priv->keyboard = keyboard;
-    // Update the keymap if necessary.
-    // TODO: Update submission on change event
-    if (context->priv->submission) {
-        submission_set_keyboard(context->priv->submission, keyboard, timestamp);
+    EekboardContextServicePrivate *priv = context->priv;
+    if (priv->build
+            && g_strcmp0(priv->build->layout_name, layout_name) == 0
+            && priv->build->arrangement == state->arrangement) {
+        // Already on the way
+        return;
+    }
+    // Whatever is being built is not wanted any more.
+    // It will get dropped when it's done.
+    priv->build = NULL;
+
+    if (priv->keyboard
+            && g_strcmp0(priv->layout_name, layout_name) == 0
+            && priv->arrangement == state->arrangement) {
+        // Hint changes often resolve to the same layout
+        return;
     }
 
-    // Update UI
-    g_object_notify (G_OBJECT(context), "keyboard");
-
-    // replacing the keyboard above will cause the previous keyboard to get destroyed from the UI side (eek_gtk_keyboard_dispose)
-    if (previous_keyboard) {
-        level_keyboard_free(previous_keyboard);
+    LevelKeyboard *keyboard = keyboard_cache_take(priv, layout_name,
+                                                  state->arrangement);
+    if (keyboard) {
+        squeek_layout_reset(keyboard->layout);
+        use_keyboard(context, keyboard, layout_name, state->arrangement,
+                     timestamp);
+    } else if (!priv->keyboard) {
+        // Nothing to show while waiting, so don't wait
+        struct squeek_layout *layout = squeek_load_layout(layout_name, state->arrangement,
+                                                          priv->watcher,
+                                                          priv->superset);
+        use_keyboard(context, level_keyboard_new(layout), layout_name,
+                     state->arrangement, timestamp);
+    } else if (priv->prefetch
+            && g_strcmp0(priv->prefetch->layout_name, layout_name) == 0
+            && priv->prefetch->arrangement == state->arrangement) {
+        // Guessed right, and it's on the way
+        priv->build = priv->prefetch;
+        priv->build->timestamp = timestamp;
+        priv->prefetch = NULL;
+    } else {
+        // The current keyboard stays usable until the new one is built
+        priv->build = keyboard_build_start(context, layout_name,
+                                           state->arrangement, timestamp,
+                                           G_PRIORITY_DEFAULT);
     }
 }
 
@@ -242,6 +667,14 @@ static void
 eekboard_context_service_init (EekboardContextService *self)
 {
     self->priv = EEKBOARD_CONTEXT_SERVICE_GET_PRIVATE(self);
+    self->priv->watcher = squeek_layout_watcher_new();
+    self->priv->superset = squeek_keymap_superset_new();
+    int watcher_fd = squeek_layout_watcher_get_fd(self->priv->watcher);
+    if (watcher_fd >= 0) {
+        self->priv->watcher_source = g_unix_fd_add(watcher_fd, G_IO_IN,
+                                                   handle_layout_files_changed,
+                                                   self);
+    }
     const char *schema_name = "org.gnome.desktop.input-sources";
     GSettingsSchemaSource *ssrc = g_settings_schema_source_get_default();
     if (ssrc) {
@@ -334,7 +767,8 @@ void eekboard_context_service_set_submission(EekboardContextService *context, st
     context->priv->submission = submission;
     if (context->priv->submission) {
         uint32_t time = gdk_event_get_time(NULL);
-        submission_set_keyboard(context->priv->submission, context->priv->keyboard, time);
+        submission_set_keyboard(context->priv->submission, context->priv->keyboard,
+                                context->priv->keyboard->layout, time);
     }
 }
 
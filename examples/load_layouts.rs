@@ -0,0 +1,42 @@
+/*! Times the stages of loading built-in layouts.
+ *
+ * Usage: load_layouts [ITERATIONS [LAYOUT...]]
+ *
+ * Without layouts, all built-in ones are timed.
+ * The output is tab-separated, one line per layout and stage,
+ * to be compared across commits.
+ */
+
+extern crate rs;
+
+#[path = "../src/c_stubs.rs"]
+mod c_stubs;
+
+use rs::timing;
+use std::env;
+
+fn main() -> () {
+    let mut args = env::args().skip(1);
+    let iterations = args.next()
+        .map(|s| s.parse().expect("Bad iteration count"))
+        .unwrap_or(50);
+    let names: Vec<String> = args.collect();
+    let names = match names.len() {
+        0 => timing::get_builtin_names().into_iter()
+            .map(String::from)
+            .collect(),
+        _ => names,
+    };
+
+    println!("layout\tstage\titerations\tmin_ns\tmedian_ns");
+    for name in names {
+        let timings = timing::time_stages(&name, iterations)
+            .expect("Can't load layout");
+        for t in timings {
+            println!(
+                "{}\t{}\t{}\t{}\t{}",
+                name, t.stage, t.iterations, t.min_ns, t.median_ns,
+            );
+        }
+    }
+}
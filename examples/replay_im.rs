@@ -0,0 +1,61 @@
+/*! Replays input method recordings, and times the handling of events.
+ *
+ * Usage: replay_im [ITERATIONS [RECORDING...]]
+ *
+ * Recordings are made by running squeekboard
+ * with SQUEEKBOARD_RECORD_IM set to a file name.
+ * What squeekboard sends in response gets printed as comments.
+ *
+ * Without recordings, generated ones get timed,
+ * typing into text fields of growing size.
+ * The output is tab-separated, one line per recording,
+ * to be compared across commits.
+ */
+
+extern crate rs;
+
+#[path = "../src/c_stubs.rs"]
+mod c_stubs;
+
+use rs::imrecord;
+use rs::imreplay;
+use std::env;
+use std::fs;
+
+fn main() -> () {
+    let mut args = env::args().skip(1);
+    let iterations = args.next()
+        .map(|s| s.parse().expect("Bad iteration count"))
+        .unwrap_or(20);
+    let paths: Vec<String> = args.collect();
+
+    let recordings = match paths.len() {
+        0 => [0, 1000, 10000, 100000].iter()
+            .map(|length| (
+                format!("typing_{}", length),
+                imrecord::generate_typing(*length, 100),
+            ))
+            .collect(),
+        _ => paths.into_iter()
+            .map(|path| {
+                let source = fs::read_to_string(&path)
+                    .expect("Can't read recording");
+                let records = imrecord::parse(&source)
+                    .unwrap_or_else(|e| panic!("Bad recording: {}", e));
+                for output in imreplay::replay(&records) {
+                    println!("# {:?}", output);
+                }
+                (path, records)
+            })
+            .collect::<Vec<_>>(),
+    };
+
+    println!("recording\tevents\titerations\tmin_ns\tmedian_ns");
+    for (name, records) in recordings {
+        let t = imreplay::time_replay(&records, iterations);
+        println!(
+            "{}\t{}\t{}\t{}\t{}",
+            name, records.len(), t.iterations, t.min_ns, t.median_ns,
+        );
+    }
+}
@@ -0,0 +1,45 @@
+/*! Times synthetic layouts of growing size.
+ *
+ * Usage: scaling [ITERATIONS [VIEWS [BUTTONS...]]]
+ *
+ * Each layout has VIEWS views, each holding BUTTONS buttons.
+ * The output is tab-separated, one line per size and stage,
+ * to be compared across commits.
+ */
+
+extern crate rs;
+
+#[path = "../src/c_stubs.rs"]
+mod c_stubs;
+
+use rs::timing;
+use std::env;
+
+fn main() -> () {
+    let mut args = env::args().skip(1);
+    let iterations = args.next()
+        .map(|s| s.parse().expect("Bad iteration count"))
+        .unwrap_or(10);
+    let views = args.next()
+        .map(|s| s.parse().expect("Bad view count"))
+        .unwrap_or(4);
+    let sizes: Vec<usize> = args
+        .map(|s| s.parse().expect("Bad button count"))
+        .collect();
+    let sizes = match sizes.len() {
+        0 => vec![50, 100, 200, 500, 1000, 2000],
+        _ => sizes,
+    };
+
+    println!("views\tbuttons\tstage\titerations\tmin_ns\tmedian_ns");
+    for buttons in sizes {
+        let timings = timing::time_scaling(views, buttons, iterations)
+            .expect("Can't load layout");
+        for t in timings {
+            println!(
+                "{}\t{}\t{}\t{}\t{}\t{}",
+                views, buttons, t.stage, t.iterations, t.min_ns, t.median_ns,
+            );
+        }
+    }
+}
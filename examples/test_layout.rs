@@ -1,10 +1,26 @@
+/*! Checks built-in layouts.
+ *
+ * Usage: test_layout LAYOUT...
+ *
+ * Layouts are checked in parallel.
+ * Exits with an error if any of them fails.
+ */
+
 extern crate rs;
 
-use rs::tests::check_builtin_layout;
+use rs::tests::{ check_layouts, get_processor_count, print_reports, Input };
 use std::env;
+use std::process;
 
 fn main() -> () {
-    check_builtin_layout(
-        env::args().nth(1).expect("No argument given").as_str()
-    );
+    let inputs: Vec<Input> = env::args().skip(1)
+        .map(Input::Builtin)
+        .collect();
+    if inputs.is_empty() {
+        panic!("No argument given");
+    }
+    let reports = check_layouts(inputs, get_processor_count());
+    if !print_reports(&reports) {
+        process::exit(1);
+    }
 }
@@ -0,0 +1,40 @@
+/*! Types out a text corpus on a layout, and reports the throughput.
+ *
+ * Usage: typist LAYOUT CORPUS [SCATTER [SEED]]
+ *
+ * SCATTER is the standard deviation of touches around key centres,
+ * as a fraction of the key size.
+ */
+
+extern crate rs;
+
+#[path = "../src/c_stubs.rs"]
+mod c_stubs;
+
+use rs::typist::Typist;
+use std::env;
+use std::fs;
+
+fn main() -> () {
+    let mut args = env::args().skip(1);
+    let layout = args.next().expect("No layout given");
+    let corpus = args.next().expect("No corpus given");
+    let scatter = args.next()
+        .map(|s| s.parse().expect("Bad scatter"))
+        .unwrap_or(0.2);
+    let seed = args.next()
+        .map(|s| s.parse().expect("Bad seed"))
+        .unwrap_or(0);
+
+    let text = fs::read_to_string(&corpus).expect("Can't read corpus");
+    let mut typist = Typist::new(&layout, scatter, seed)
+        .expect("Can't load layout");
+    let report = typist.type_text(&text);
+
+    println!("layout: {}", layout);
+    println!("scatter: {}", scatter);
+    println!("keystrokes: {}", report.keystrokes);
+    println!("unreachable characters: {}", report.unreachable);
+    println!("keystrokes per second: {:.0}", report.keystrokes_per_second());
+    println!("mis-hit rate: {:.4}", report.mishit_rate());
+}
@@ -2,15 +2,24 @@
 extern crate clap;
 extern crate rs;
 
-use rs::tests::check_layout_file;
+use rs::tests::{ check_layouts, get_processor_count, print_reports, Input };
+use std::process;
 
 fn main() -> () {
     let matches = clap_app!(test_layout =>
         (name: "squeekboard-test-layout")
-        (about: "Test keyboard layout for errors. Returns OK or an error message containing further information.")
-        (@arg INPUT: +required "Yaml keyboard layout file to test")
+        (about: "Test keyboard layouts for errors. Reports OK or an error message containing further information for each layout, together with timings.")
+        (@arg JOBS: -j --jobs +takes_value "Number of layouts to test at the same time [default: number of processors]")
+        (@arg INPUT: +required +multiple "Yaml keyboard layout files to test")
     ).get_matches();
-    if check_layout_file(matches.value_of("INPUT").unwrap()) == () {
-        println!("Test result: OK");
+    let jobs = matches.value_of("JOBS")
+        .map(|jobs| jobs.parse().expect("Bad number of jobs"))
+        .unwrap_or_else(get_processor_count);
+    let inputs = matches.values_of("INPUT").unwrap()
+        .map(|path| Input::File(path.into()))
+        .collect();
+    let reports = check_layouts(inputs, jobs);
+    if !print_reports(&reports) {
+        process::exit(1);
     }
 }
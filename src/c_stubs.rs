@@ -0,0 +1,139 @@
+/*! Stand-ins for the functions implemented in C.
+ *
+ * Rust-only programs, like unit tests and benchmarks,
+ * don't link against the C part of squeekboard.
+ * They still reach the code calling into C,
+ * so those calls must go somewhere.
+ *
+ * The stand-ins do nothing,
+ * which is equivalent to talking to a compositor that ignores everything.
+ * The input method ones also tell ::imreplay what got sent,
+ * in case a recording is being replayed.
+ *
+ * Outside the crate, include with `#[path]`.
+ */
+
+#![allow(dead_code)]
+
+use std::os::raw::{ c_char, c_void };
+use std::ptr;
+
+// vkeyboard
+
+#[no_mangle]
+pub extern "C"
+fn eek_virtual_keyboard_v1_key(
+    _virtual_keyboard: *const c_void,
+    _timestamp: u32,
+    _keycode: u32,
+    _press: u32,
+) {}
+
+#[no_mangle]
+pub extern "C"
+fn eek_virtual_keyboard_update_keymap(
+    _virtual_keyboard: *const c_void,
+    _keyboard: *const c_void,
+) {}
+
+#[no_mangle]
+pub extern "C"
+fn eek_virtual_keyboard_send_keymap(
+    _virtual_keyboard: *const c_void,
+    _keymap: *const c_char,
+    _len: usize,
+) {}
+
+#[no_mangle]
+pub extern "C"
+fn eek_virtual_keyboard_set_modifiers(
+    _virtual_keyboard: *const c_void,
+    _modifiers: u32,
+) {}
+
+// imservice
+
+// Stand-ins call these, to let a replay see what gets sent.
+// Defined in ::imreplay
+#[cfg(any(test, feature = "replay"))]
+extern "C" {
+    fn squeek_replay_commit_string(text: *const c_char);
+    fn squeek_replay_delete_surrounding_text(before: u32, after: u32);
+    fn squeek_replay_commit(serial: u32);
+    fn squeek_replay_set_hint_purpose(hint: u32, purpose: u32);
+}
+
+// Without replays, nobody is listening
+#[cfg(not(any(test, feature = "replay")))]
+unsafe fn squeek_replay_commit_string(_text: *const c_char) {}
+#[cfg(not(any(test, feature = "replay")))]
+unsafe fn squeek_replay_delete_surrounding_text(_before: u32, _after: u32) {}
+#[cfg(not(any(test, feature = "replay")))]
+unsafe fn squeek_replay_commit(_serial: u32) {}
+#[cfg(not(any(test, feature = "replay")))]
+unsafe fn squeek_replay_set_hint_purpose(_hint: u32, _purpose: u32) {}
+
+#[no_mangle]
+pub extern "C"
+fn eek_input_method_commit_string(_im: *mut c_void, text: *const c_char) {
+    unsafe { squeek_replay_commit_string(text) }
+}
+
+#[no_mangle]
+pub extern "C"
+fn eek_input_method_delete_surrounding_text(
+    _im: *mut c_void,
+    before: u32,
+    after: u32,
+) {
+    unsafe { squeek_replay_delete_surrounding_text(before, after) }
+}
+
+#[no_mangle]
+pub extern "C"
+fn eek_input_method_commit(_im: *mut c_void, serial: u32) {
+    unsafe { squeek_replay_commit(serial) }
+}
+
+#[no_mangle]
+pub extern "C"
+fn imservice_connect_listeners(_im: *mut c_void, _imservice: *const c_void) {}
+
+#[no_mangle]
+pub extern "C"
+fn imservice_destroy_im(_im: *mut c_void) {}
+
+#[no_mangle]
+pub extern "C"
+fn eekboard_context_service_set_hint_purpose(
+    _state_manager: *const c_void,
+    hint: u32,
+    purpose: u32,
+) {
+    unsafe { squeek_replay_set_hint_purpose(hint, purpose) }
+}
+
+#[no_mangle]
+pub extern "C"
+fn server_context_service_show_keyboard(_ui_manager: *const c_void) {}
+
+#[no_mangle]
+pub extern "C"
+fn server_context_service_hide_keyboard(_ui_manager: *const c_void) {}
+
+// manager
+
+#[no_mangle]
+pub extern "C"
+fn eekboard_context_service_set_overlay(
+    _manager: *const c_void,
+    _name: *const c_char,
+) {}
+
+#[no_mangle]
+pub extern "C"
+fn eekboard_context_service_get_overlay(
+    _manager: *const c_void,
+) -> *const c_char {
+    ptr::null()
+}
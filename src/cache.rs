@@ -0,0 +1,234 @@
+/*! Compiled user layouts, cached on disk.
+ *
+ * Parsing a large layout file and generating its keymap takes a while,
+ * and user layouts don't change often.
+ * The compiled form of each user layout gets stored
+ * in `$XDG_CACHE_HOME/squeekboard/layouts`,
+ * named after a hash of the file path,
+ * and a hash of the file contents, of the squeekboard version
+ * and of the format version.
+ * An edited file gets a new name, so entries never need to be invalidated.
+ * Instead, storing an entry removes the other ones of the same file.
+ *
+ * Cached entries are memory-mapped for reading.
+ * Any problem with the cache only means that the layout gets compiled again.
+ */
+
+use std::ffi::OsStr;
+use std::fs;
+use std::io;
+use std::path::{ Path, PathBuf };
+use std::process;
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{ AtomicUsize, Ordering };
+
+use ::compiled;
+use ::logging;
+use ::xdg;
+
+// traits
+use ::logging::Warn;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::AsRawFd;
+
+mod c {
+    use std::os::raw::{ c_int, c_long, c_void };
+
+    extern "C" {
+        // from libc
+        pub fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: c_long,
+        ) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    }
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_PRIVATE: c_int = 2;
+}
+
+/// Read-only contents of a file
+struct Mapped {
+    data: *const u8,
+    len: usize,
+}
+
+impl Mapped {
+    fn open(path: &Path) -> io::Result<Mapped> {
+        let file = fs::File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "Empty"));
+        }
+        let data = unsafe {
+            c::mmap(
+                ptr::null_mut(), len,
+                c::PROT_READ, c::MAP_PRIVATE,
+                file.as_raw_fd(), 0,
+            )
+        };
+        // MAP_FAILED. The mapping stays valid after the file is closed.
+        if data as isize == -1 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Mapped { data: data as *const u8, len })
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+}
+
+impl Drop for Mapped {
+    fn drop(&mut self) {
+        unsafe { c::munmap(self.data as *mut _, self.len) };
+    }
+}
+
+/// 64-bit FNV-1a. Stable across builds, unlike the standard hasher.
+fn hash(hash: u64, data: &[u8]) -> u64 {
+    data.iter().fold(hash, |hash, byte| {
+        (hash ^ *byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+const HASH_START: u64 = 0xcbf29ce484222325;
+
+/// Names the cache entry for the contents of a layout file.
+/// Entries of the same file share the part before the "-".
+pub fn get_key(path: &Path, contents: &[u8]) -> String {
+    let source = hash(HASH_START, path.as_os_str().as_bytes());
+    // The squeekboard version, which meson puts in Cargo.toml
+    let h = hash(HASH_START, env!("CARGO_PKG_VERSION").as_bytes());
+    let h = hash(h, &compiled::FORMAT_VERSION.to_le_bytes());
+    let h = hash(h, contents);
+    format!("{:016x}-{:016x}", source, h)
+}
+
+pub fn get_dir() -> Option<PathBuf> {
+    xdg::cache_path("squeekboard/layouts")
+}
+
+fn get_path(dir: &Path, key: &str) -> PathBuf {
+    dir.join(key).with_extension("bin")
+}
+
+/// Returns the cached layout, if there is a good one
+pub fn load(dir: &Path, key: &str) -> Option<compiled::Layout> {
+    let path = get_path(dir, key);
+    let mapped = match Mapped::open(&path) {
+        Ok(mapped) => mapped,
+        Err(ref e) if e.kind() == io::ErrorKind::NotFound => return None,
+        Err(e) => {
+            log_print!(
+                logging::Level::Surprise,
+                "Can't read cached layout {:?}: {}", path, e,
+            );
+            return None;
+        },
+    };
+    compiled::Layout::read(mapped.as_slice())
+        .or_print(
+            logging::Problem::Warning,
+            &format!("Bad cached layout {:?}", path),
+        )
+}
+
+/// Tells apart temporary files written by threads of the same process
+static STORE_COUNT: AtomicUsize = AtomicUsize::new(0);
+
+pub fn store(dir: &Path, key: &str, layout: &compiled::Layout) {
+    let path = get_path(dir, key);
+    // Another instance may be reading the file, so it's replaced whole.
+    // Others may be writing the same entry, so each gets its own file.
+    let new_path = dir.join(format!(
+        "{}.{}-{}.new",
+        key, process::id(), STORE_COUNT.fetch_add(1, Ordering::Relaxed),
+    ));
+    let result = fs::create_dir_all(dir)
+        .and_then(|()| fs::write(&new_path, layout.to_bytes()))
+        .and_then(|()| fs::rename(&new_path, &path));
+    if result.is_err() {
+        // Nothing half-written stays behind
+        let _ = fs::remove_file(&new_path);
+    }
+    result.and_then(|()| prune(dir, key))
+        .or_print(
+            logging::Problem::Surprise,
+            &format!("Can't cache layout {:?}", path),
+        );
+}
+
+/// Removes the other entries of the same file.
+/// They are for older contents, or older versions of squeekboard.
+/// A reader which has one mapped already can keep using it.
+fn prune(dir: &Path, key: &str) -> io::Result<()> {
+    let prefix = match key.find('-') {
+        Some(i) => &key[..(i + 1)],
+        None => return Ok(()),
+    };
+    let current = get_path(dir, key);
+    for entry in fs::read_dir(dir)? {
+        let path = entry?.path();
+        let is_stale = path != current
+            && path.extension() == Some(OsStr::new("bin"))
+            && path.file_name()
+                .and_then(|name| name.to_str())
+                .map(|name| name.starts_with(prefix))
+                .unwrap_or(false);
+        if is_stale {
+            fs::remove_file(&path)?;
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::env;
+    use std::process;
+
+    #[test]
+    fn round_trip() {
+        let dir = env::temp_dir()
+            .join(format!("squeekboard-cache-{}", process::id()));
+        let layout = compiled::Layout {
+            margins: compiled::Margins {
+                top: 1.0, bottom: 2.0, left: 3.0, right: 3.0,
+            },
+            keymap_str: "xkb_keymap {};".into(),
+            buttons: Vec::new(),
+            views: vec![("base".into(), vec![vec![]])],
+        };
+        let source = Path::new("/a.yaml");
+        let key = get_key(source, b"views: {}");
+        assert_ne!(key, get_key(source, b"views: {} "));
+        assert_ne!(key, get_key(Path::new("/b.yaml"), b"views: {}"));
+        assert_eq!(load(&dir, &key), None);
+        store(&dir, &key, &layout);
+        assert_eq!(load(&dir, &key), Some(layout.clone()));
+
+        // Only the newest entry of a file stays
+        let other_key = get_key(Path::new("/b.yaml"), b"views: {}");
+        store(&dir, &other_key, &layout);
+        let edited_key = get_key(source, b"views: {} ");
+        store(&dir, &edited_key, &layout);
+        assert_eq!(load(&dir, &key), None);
+        assert_eq!(load(&dir, &other_key), Some(layout.clone()));
+        assert_eq!(load(&dir, &edited_key), Some(layout.clone()));
+        assert_eq!(fs::read_dir(&dir).unwrap().count(), 2);
+
+        // A damaged entry is not used
+        let mut damaged = layout;
+        damaged.keymap_str = "xkb_keymap {\0};".into();
+        fs::write(get_path(&dir, &key), damaged.to_bytes()).unwrap();
+        assert_eq!(load(&dir, &key), None);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
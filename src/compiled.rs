@@ -0,0 +1,442 @@
+/*! Layouts compiled into a compact binary form.
+ *
+ * The build script compiles the built-in layouts
+ * and the executable embeds them.
+ * Loading a compiled layout skips parsing YAML, validating keysyms,
+ * and generating the keymap.
+ * What's left is reading numbers and strings in order,
+ * and putting the UI structures together.
+ *
+ * The data carries no version.
+ * Whatever keeps it between builds must keep FORMAT_VERSION with it.
+ * Numbers are little endian.
+ * A string is a u32 length followed by UTF-8 bytes.
+ * A list is a u32 count followed by the items.
+ *
+ * This module is shared with the build script,
+ * so it must not depend on anything besides `action`.
+ */
+
+use std::ffi::CString;
+use std::fmt;
+use std::str;
+
+use ::action::{ Action, KeySym, Modifier };
+
+/// Must change whenever the format does
+pub const FORMAT_VERSION: u32 = 2;
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Margins {
+    pub top: f64,
+    pub bottom: f64,
+    pub left: f64,
+    pub right: f64,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Label {
+    Text(String),
+    IconName(String),
+}
+
+/// Everything about a button, except for its position
+#[derive(Debug, Clone, PartialEq)]
+pub struct Button {
+    pub name: String,
+    pub label: Label,
+    pub outline_name: String,
+    pub width: f64,
+    pub height: f64,
+    pub action: Action,
+    pub keycodes: Vec<u32>,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Layout {
+    pub margins: Margins,
+    /// Empty if the keysyms don't fit in a keymap.
+    /// Then buttons have no keycodes either.
+    pub keymap_str: String,
+    /// Buttons with the same name share state,
+    /// so each name appears only once
+    pub buttons: Vec<Button>,
+    /// Rows of indices into `buttons`, by view name
+    pub views: Vec<(String, Vec<Vec<u32>>)>,
+}
+
+#[derive(Debug)]
+pub enum Error {
+    Truncated,
+    BadUtf8(str::Utf8Error),
+    BadTag(u8),
+    BadButton(u32),
+    /// In a string which becomes a C string
+    NulInString,
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::Truncated => write!(f, "Data ends too early"),
+            Error::BadUtf8(e) => write!(f, "Bad string: {}", e),
+            Error::BadTag(tag) => write!(f, "Unknown tag {}", tag),
+            Error::BadButton(i) => write!(f, "No button number {}", i),
+            Error::NulInString => write!(f, "String contains a null byte"),
+        }
+    }
+}
+
+struct Writer(Vec<u8>);
+
+impl Writer {
+    fn u8(&mut self, value: u8) {
+        self.0.push(value);
+    }
+
+    fn u32(&mut self, value: u32) {
+        for i in 0..4 {
+            self.0.push((value >> (i * 8)) as u8);
+        }
+    }
+
+    fn f64(&mut self, value: f64) {
+        let bits = value.to_bits();
+        for i in 0..8 {
+            self.0.push((bits >> (i * 8)) as u8);
+        }
+    }
+
+    fn bytes(&mut self, value: &[u8]) {
+        self.u32(value.len() as u32);
+        self.0.extend_from_slice(value);
+    }
+
+    fn str(&mut self, value: &str) {
+        self.bytes(value.as_bytes());
+    }
+}
+
+struct Reader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, count: usize) -> Result<&'a [u8], Error> {
+        if self.data.len() < count {
+            return Err(Error::Truncated);
+        }
+        let (taken, rest) = self.data.split_at(count);
+        self.data = rest;
+        Ok(taken)
+    }
+
+    fn u8(&mut self) -> Result<u8, Error> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u32(&mut self) -> Result<u32, Error> {
+        let bytes = self.take(4)?;
+        Ok(bytes.iter().rev().fold(0, |acc, b| (acc << 8) | *b as u32))
+    }
+
+    fn f64(&mut self) -> Result<f64, Error> {
+        let bytes = self.take(8)?;
+        Ok(f64::from_bits(
+            bytes.iter().rev().fold(0, |acc, b| (acc << 8) | *b as u64)
+        ))
+    }
+
+    fn bytes(&mut self) -> Result<&'a [u8], Error> {
+        let len = self.u32()? as usize;
+        self.take(len)
+    }
+
+    fn str(&mut self) -> Result<&'a str, Error> {
+        str::from_utf8(self.bytes()?).map_err(Error::BadUtf8)
+    }
+
+    /// A string which will be passed to C, so without a 0 inside.
+    /// Data may come from a damaged cache.
+    fn c_str(&mut self) -> Result<&'a str, Error> {
+        let s = self.str()?;
+        match s.bytes().any(|b| b == 0) {
+            true => Err(Error::NulInString),
+            false => Ok(s),
+        }
+    }
+
+    fn list<T, F>(&mut self, mut f: F) -> Result<Vec<T>, Error>
+        where F: FnMut(&mut Self) -> Result<T, Error>
+    {
+        let count = self.u32()? as usize;
+        // The count comes from the data, so it's not trusted for allocation
+        let mut items = Vec::with_capacity(count.min(self.data.len()));
+        for _ in 0..count {
+            items.push(f(self)?);
+        }
+        Ok(items)
+    }
+}
+
+fn write_action(w: &mut Writer, action: &Action) {
+    match action {
+        Action::SetView(view) => {
+            w.u8(0);
+            w.str(view);
+        },
+        Action::LockView { lock, unlock } => {
+            w.u8(1);
+            w.str(lock);
+            w.str(unlock);
+        },
+        Action::ApplyModifier(modifier) => {
+            w.u8(2);
+            w.u8(match modifier {
+                Modifier::Control => 0,
+                Modifier::Alt => 1,
+                Modifier::Mod4 => 2,
+                Modifier::Shift => 3,
+            });
+        },
+        Action::Submit { text, keys } => {
+            w.u8(3);
+            match text {
+                Some(text) => {
+                    w.u8(1);
+                    w.bytes(text.as_bytes());
+                },
+                None => w.u8(0),
+            }
+            w.u32(keys.len() as u32);
+            for key in keys {
+                w.str(&key.0);
+            }
+        },
+        Action::Erase => w.u8(4),
+        Action::ShowPreferences => w.u8(5),
+    }
+}
+
+fn read_action(r: &mut Reader) -> Result<Action, Error> {
+    Ok(match r.u8()? {
+        0 => Action::SetView(r.str()?.into()),
+        1 => Action::LockView {
+            lock: r.str()?.into(),
+            unlock: r.str()?.into(),
+        },
+        2 => Action::ApplyModifier(match r.u8()? {
+            0 => Modifier::Control,
+            1 => Modifier::Alt,
+            2 => Modifier::Mod4,
+            3 => Modifier::Shift,
+            other => return Err(Error::BadTag(other)),
+        }),
+        3 => Action::Submit {
+            text: match r.u8()? {
+                0 => None,
+                _ => Some(
+                    CString::new(r.bytes()?)
+                        .map_err(|_| Error::NulInString)?
+                ),
+            },
+            keys: r.list(|r| Ok(KeySym(r.str()?.into())))?,
+        },
+        4 => Action::Erase,
+        5 => Action::ShowPreferences,
+        other => return Err(Error::BadTag(other)),
+    })
+}
+
+impl Layout {
+    fn write(&self, w: &mut Writer) {
+        let margins = &self.margins;
+        for value in &[margins.top, margins.bottom, margins.left, margins.right] {
+            w.f64(*value);
+        }
+        w.str(&self.keymap_str);
+        w.u32(self.buttons.len() as u32);
+        for button in &self.buttons {
+            w.str(&button.name);
+            match &button.label {
+                Label::Text(text) => {
+                    w.u8(0);
+                    w.str(text);
+                },
+                Label::IconName(icon) => {
+                    w.u8(1);
+                    w.str(icon);
+                },
+            }
+            w.str(&button.outline_name);
+            w.f64(button.width);
+            w.f64(button.height);
+            write_action(w, &button.action);
+            w.u32(button.keycodes.len() as u32);
+            for keycode in &button.keycodes {
+                w.u32(*keycode);
+            }
+        }
+        w.u32(self.views.len() as u32);
+        for (name, rows) in &self.views {
+            w.str(name);
+            w.u32(rows.len() as u32);
+            for row in rows {
+                w.u32(row.len() as u32);
+                for index in row {
+                    w.u32(*index);
+                }
+            }
+        }
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut w = Writer(Vec::new());
+        self.write(&mut w);
+        w.0
+    }
+
+    pub fn read(data: &[u8]) -> Result<Layout, Error> {
+        let r = &mut Reader { data };
+        let margins = Margins {
+            top: r.f64()?,
+            bottom: r.f64()?,
+            left: r.f64()?,
+            right: r.f64()?,
+        };
+        let keymap_str = r.c_str()?.into();
+        let buttons = r.list(|r| Ok(Button {
+            name: r.c_str()?.into(),
+            label: match r.u8()? {
+                0 => Label::Text(r.c_str()?.into()),
+                1 => Label::IconName(r.c_str()?.into()),
+                other => return Err(Error::BadTag(other)),
+            },
+            outline_name: r.c_str()?.into(),
+            width: r.f64()?,
+            height: r.f64()?,
+            action: read_action(r)?,
+            keycodes: r.list(Reader::u32)?,
+        }))?;
+        let button_count = buttons.len() as u32;
+        let views = r.list(|r| Ok((
+            r.str()?.into(),
+            r.list(|r| r.list(|r| match r.u32()? {
+                i if i < button_count => Ok(i),
+                i => Err(Error::BadButton(i)),
+            }))?,
+        )))?;
+        Ok(Layout { margins, keymap_str, buttons, views })
+    }
+}
+
+/* A bundle is a sequence of named layouts,
+ * each entry being the name, and the layout data,
+ * both prefixed with their length.
+ * Bundles get written by the build script. */
+
+/// Lists the names of layouts in the bundle, in order
+#[cfg(any(test, feature = "benchmarks"))]
+pub fn get_bundle_names(bundle: &[u8]) -> Result<Vec<&str>, Error> {
+    let r = &mut Reader { data: bundle };
+    let mut names = Vec::new();
+    while !r.data.is_empty() {
+        names.push(r.str()?);
+        r.bytes()?;
+    }
+    Ok(names)
+}
+
+/// Finds the layout in the bundle, without reading the others
+pub fn find_in_bundle<'a>(bundle: &'a [u8], needle: &str)
+    -> Result<Option<&'a [u8]>, Error>
+{
+    let r = &mut Reader { data: bundle };
+    while !r.data.is_empty() {
+        let name = r.bytes()?;
+        let data = r.bytes()?;
+        if name == needle.as_bytes() {
+            return Ok(Some(data));
+        }
+    }
+    Ok(None)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn round_trip() {
+        let layout = Layout {
+            margins: Margins { top: 1.0, bottom: 2.0, left: 0.5, right: 0.5 },
+            keymap_str: "xkb_keymap {};".into(),
+            buttons: vec![
+                Button {
+                    name: "a".into(),
+                    label: Label::Text("a".into()),
+                    outline_name: "default".into(),
+                    width: 35.33,
+                    height: 52.0,
+                    action: Action::Submit {
+                        text: Some(CString::new("a").unwrap()),
+                        keys: vec![KeySym("a".into())],
+                    },
+                    keycodes: vec![9],
+                },
+                Button {
+                    name: "show_numbers".into(),
+                    label: Label::IconName("keyboard".into()),
+                    outline_name: "altline".into(),
+                    width: 52.0,
+                    height: 52.0,
+                    action: Action::LockView {
+                        lock: "numbers".into(),
+                        unlock: "base".into(),
+                    },
+                    keycodes: vec![],
+                },
+            ],
+            views: vec![("base".into(), vec![vec![0, 1], vec![1]])],
+        };
+        let mut bundle = Writer(Vec::new());
+        bundle.str("us");
+        bundle.bytes(&layout.to_bytes());
+        let bundle = bundle.0;
+        let data = find_in_bundle(&bundle, "us").unwrap().unwrap();
+        assert_eq!(Layout::read(data).unwrap(), layout);
+        assert!(find_in_bundle(&bundle, "de").unwrap().is_none());
+        assert_eq!(get_bundle_names(&bundle).unwrap(), vec!["us"]);
+    }
+
+    #[test]
+    fn nul_in_string() {
+        let layout = Layout {
+            margins: Margins { top: 0.0, bottom: 0.0, left: 0.0, right: 0.0 },
+            keymap_str: "xkb\0keymap".into(),
+            buttons: Vec::new(),
+            views: vec![("base".into(), vec![vec![]])],
+        };
+        match Layout::read(&layout.to_bytes()) {
+            Err(Error::NulInString) => {},
+            other => panic!("Unexpected {:?}", other),
+        }
+    }
+
+    #[test]
+    fn truncated() {
+        let layout = Layout {
+            margins: Margins { top: 0.0, bottom: 0.0, left: 0.0, right: 0.0 },
+            keymap_str: String::new(),
+            buttons: Vec::new(),
+            views: vec![("base".into(), vec![vec![]])],
+        };
+        let mut w = Writer(Vec::new());
+        layout.write(&mut w);
+        let data = &w.0[..w.0.len() - 1];
+        match Layout::read(data) {
+            Err(Error::Truncated) => {},
+            other => panic!("Unexpected {:?}", other),
+        }
+    }
+}
@@ -1,62 +1,135 @@
-/**! The parsing of the data files for layouts */
+/**! Loading layouts from the data files and the built-in ones */
 
-// TODO: find a nice way to make sure non-positive sizes don't break layouts
-
-use std::cell::RefCell;
-use std::collections::{ HashMap, HashSet };
+use std::collections::HashMap;
 use std::env;
 use std::ffi::CString;
 use std::fmt;
 use std::fs;
-use std::io;
-use std::path::PathBuf;
-use std::rc::Rc;
+use std::path::{ Path, PathBuf };
+use std::sync::Arc;
 use std::vec::Vec;
 
-use xkbcommon::xkb;
-
-use ::action;
-use ::keyboard::{
-    KeyState, PressType,
-    generate_keymap, generate_keycodes, FormattingError
-};
+use ::cache;
+use ::compiled;
+use ::keyboard::{ FormattingError, Key, KeyId };
 use ::layout;
 use ::layout::ArrangementKind;
 use ::logging;
 use ::resources;
+use ::superset::Superset;
 use ::util::c::as_str;
-use ::util::hash_map_map;
+use ::watcher::Watcher;
 use ::xdg;
 
-// traits, derives
-use serde::Deserialize;
-use std::io::BufReader;
+pub use ::parsing::{ Error, Layout };
+
+// traits
 use std::iter::FromIterator;
-use ::logging::Warn;
 
 /// Gathers stuff defined in C or called by C
 pub mod c {
     use super::*;
     use std::os::raw::c_char;
 
+    fn get_kind(type_: u32) -> ArrangementKind {
+        match type_ {
+            0 => ArrangementKind::Base,
+            1 => ArrangementKind::Wide,
+            _ => panic!("Bad enum value"),
+        }
+    }
+
     #[no_mangle]
     pub extern "C"
     fn squeek_load_layout(
         name: *const c_char,
         type_: u32,
+        watcher: *const Watcher,
+        superset: *const Superset,
     ) -> *mut ::layout::Layout {
-        let type_ = match type_ {
-            0 => ArrangementKind::Base,
-            1 => ArrangementKind::Wide,
-            _ => panic!("Bad enum value"),
-        };
         let name = as_str(&name)
             .expect("Bad layout name")
             .expect("Empty layout name");
+        let watcher = unsafe { watcher.as_ref() };
+        let superset = unsafe { superset.as_ref() };
+
+        let prepared = prepare_layout_with_fallback(
+            &name,
+            get_kind(type_),
+            watcher,
+            superset,
+        );
+        Box::into_raw(Box::new(prepared.into_layout()))
+    }
 
-        let (kind, layout) = load_layout_data_with_fallback(&name, type_);
-        let layout = ::layout::Layout::new(layout, kind);
-        Box::into_raw(Box::new(layout))
+    /// Does the slow part of loading a layout.
+    /// Safe to call from any thread.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_prepare_layout(
+        name: *const c_char,
+        type_: u32,
+        watcher: *const Watcher,
+        superset: *const Superset,
+    ) -> *mut PreparedLayout {
+        let name = as_str(&name)
+            .expect("Bad layout name")
+            .expect("Empty layout name");
+        let watcher = unsafe { watcher.as_ref() };
+        let superset = unsafe { superset.as_ref() };
+
+        let prepared = prepare_layout_with_fallback(
+            &name,
+            get_kind(type_),
+            watcher,
+            superset,
+        );
+        Box::into_raw(Box::new(prepared))
+    }
+
+    /// The returned string lives as long as the prepared layout.
+    /// Safe to call from any thread.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_prepared_layout_get_keymap(
+        prepared: *const PreparedLayout,
+    ) -> *const c_char {
+        let prepared = unsafe { &*prepared };
+        prepared.arrangement.keymap_str.as_ptr()
+    }
+
+    /// Finishes loading the layout. Consumes the prepared layout.
+    /// Must be called on the main thread.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_from_prepared(
+        prepared: *mut PreparedLayout,
+    ) -> *mut ::layout::Layout {
+        let prepared = unsafe { Box::from_raw(prepared) };
+        Box::into_raw(Box::new(prepared.into_layout()))
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_prepared_layout_free(prepared: *mut PreparedLayout) {
+        drop(unsafe { Box::from_raw(prepared) });
+    }
+}
+
+/// A layout with its arrangement built, but without any state yet.
+/// Unlike the layout, it can be sent between threads.
+pub struct PreparedLayout {
+    kind: ArrangementKind,
+    arrangement: Arc<layout::Arrangement>,
+}
+
+impl PreparedLayout {
+    /// Must be called on the main thread,
+    /// because it uses the user's touch model.
+    pub fn into_layout(self) -> ::layout::Layout {
+        let mut layout = ::layout::Layout::new(self.arrangement, self.kind);
+        layout.set_touch_model(::spatial::get_stored());
+        layout
     }
 }
 
@@ -68,6 +141,7 @@ pub enum LoadError {
     MissingResource,
     BadResource(serde_yaml::Error),
     BadKeyMap(FormattingError),
+    BadCompiled(compiled::Error),
 }
 
 impl fmt::Display for LoadError {
@@ -78,6 +152,7 @@ impl fmt::Display for LoadError {
             MissingResource => write!(f, "Missing resource"),
             BadResource(e) => write!(f, "Bad resource: {}", e),
             BadKeyMap(e) => write!(f, "Bad key map: {}", e),
+            BadCompiled(e) => write!(f, "Bad compiled layout: {}", e),
         }
     }
 }
@@ -156,35 +231,58 @@ fn list_layout_sources(
 }
 
 fn load_layout_data(source: DataSource)
-    -> Result<::layout::LayoutData, LoadError>
+    -> Result<compiled::Layout, LoadError>
 {
-    let handler = logging::Print {};
     match source {
-        DataSource::File(path) => {
-            Layout::from_file(path.clone())
-                .map_err(LoadError::BadData)
-                .and_then(|layout|
-                    layout.build(handler).0.map_err(LoadError::BadKeyMap)
-                )
-        },
-        DataSource::Resource(name) => {
-            Layout::from_resource(&name)
-                .and_then(|layout|
-                    layout.build(handler).0.map_err(LoadError::BadKeyMap)
-                )
-        },
+        DataSource::File(path) => load_user_file(&path),
+        DataSource::Resource(name) => load_compiled(&name),
+    }
+}
+
+/// User layouts get cached in their compiled form
+fn load_user_file(path: &Path) -> Result<compiled::Layout, LoadError> {
+    let contents = fs::read(path)
+        .map_err(|e| LoadError::BadData(e.into()))?;
+    let cache_dir = cache::get_dir();
+    let key = cache::get_key(path, &contents);
+    let cached = cache_dir.as_ref()
+        .and_then(|dir| cache::load(dir, &key));
+    if let Some(layout) = cached {
+        return Ok(layout);
+    }
+
+    let layout = Layout::from_bytes(&contents)
+        .map_err(LoadError::BadData)?
+        .compile(logging::Print {}).0
+        .map_err(LoadError::BadKeyMap)?;
+    if let Some(dir) = cache_dir {
+        cache::store(&dir, &key, &layout);
     }
+    Ok(layout)
+}
+
+/// Where the user's layouts are
+pub fn get_keyboards_path() -> Option<PathBuf> {
+    env::var_os("SQUEEKBOARD_KEYBOARDSDIR")
+        .map(PathBuf::from)
+        .or_else(|| xdg::data_path("squeekboard/keyboards"))
 }
 
-fn load_layout_data_with_fallback(
+/// The watcher, if present, saves looking for missing files
+fn prepare_layout_with_fallback(
     name: &str,
     kind: ArrangementKind,
-) -> (ArrangementKind, ::layout::LayoutData) {
-    let path = env::var_os("SQUEEKBOARD_KEYBOARDSDIR")
-        .map(PathBuf::from)
-        .or_else(|| xdg::data_path("squeekboard/keyboards"));
+    watcher: Option<&Watcher>,
+    superset: Option<&Superset>,
+) -> PreparedLayout {
+    let path = get_keyboards_path();
     
     for (kind, source) in list_layout_sources(name, kind, path) {
+        if let DataSource::File(file) = &source {
+            if let Some(false) = watcher.and_then(|w| w.contains(file)) {
+                continue;
+            }
+        }
         let layout = load_layout_data(source.clone());
         match layout {
             Err(e) => match (e, source) {
@@ -204,7 +302,14 @@ fn load_layout_data_with_fallback(
             },
             Ok(layout) => {
                 log_print!(logging::Level::Info, "Loaded layout {}", source);
-                return (kind, layout);
+                let mut arrangement = build_layout_data(layout);
+                if let Some(superset) = superset {
+                    superset.adopt(&mut arrangement);
+                }
+                return PreparedLayout {
+                    kind,
+                    arrangement: Arc::new(arrangement),
+                };
             }
         }
     }
@@ -212,122 +317,6 @@ fn load_layout_data_with_fallback(
     panic!("No useful layout found!");
 }
 
-/// The root element describing an entire keyboard
-#[derive(Debug, Deserialize, PartialEq)]
-#[serde(deny_unknown_fields)]
-pub struct Layout {
-    #[serde(default)]
-    margins: Margins,
-    views: HashMap<String, Vec<ButtonIds>>,
-    #[serde(default)] 
-    buttons: HashMap<String, ButtonMeta>,
-    outlines: HashMap<String, Outline>
-}
-
-#[derive(Debug, Clone, Deserialize, PartialEq, Default)]
-#[serde(deny_unknown_fields)]
-struct Margins {
-    top: f64,
-    bottom: f64,
-    side: f64,
-}
-
-/// Buttons are embedded in a single string
-type ButtonIds = String;
-
-/// All info about a single button
-/// Buttons can have multiple instances though.
-#[derive(Debug, Default, Deserialize, PartialEq)]
-#[serde(deny_unknown_fields)]
-struct ButtonMeta {
-    // TODO: structure (action, keysym, text, modifier) as an enum
-    // to detect conflicts and missing values at compile time
-    /// Special action to perform on activation.
-    /// Conflicts with keysym, text, modifier.
-    action: Option<Action>,
-    /// The name of the XKB keysym to emit on activation.
-    /// Conflicts with action, text, modifier.
-    keysym: Option<String>,
-    /// The text to submit on activation. Will be derived from ID if not present
-    /// Conflicts with action, keysym, modifier.
-    text: Option<String>,
-    /// The modifier to apply while the key is locked
-    /// Conflicts with action, keysym, text
-    modifier: Option<Modifier>,
-    /// If not present, will be derived from text or the button ID
-    label: Option<String>,
-    /// Conflicts with label
-    icon: Option<String>,
-    /// The name of the outline. If not present, will be "default"
-    outline: Option<String>,
-}
-
-#[derive(Debug, Deserialize, PartialEq, Clone)]
-#[serde(deny_unknown_fields)]
-enum Action {
-    #[serde(rename="locking")]
-    Locking { lock_view: String, unlock_view: String },
-    #[serde(rename="set_view")]
-    SetView(String),
-    #[serde(rename="show_prefs")]
-    ShowPrefs,
-    /// Remove last character
-    #[serde(rename="erase")]
-    Erase,
-}
-
-#[derive(Debug, Clone, PartialEq, Deserialize)]
-#[serde(deny_unknown_fields)]
-enum Modifier {
-    Control,
-    Shift,
-    Lock,
-    #[serde(alias="Mod1")]
-    Alt,
-    Mod2,
-    Mod3,
-    Mod4,
-    Mod5,
-}
-
-#[derive(Debug, Clone, Deserialize, PartialEq)]
-#[serde(deny_unknown_fields)]
-struct Outline {
-    width: f64,
-    height: f64,
-}
-
-/// Errors encountered loading the layout into yaml
-#[derive(Debug)]
-pub enum Error {
-    Yaml(serde_yaml::Error),
-    Io(io::Error),
-    /// The file was missing.
-    /// It's distinct from Io in order to make it matchable
-    /// without calling io::Error::kind()
-    Missing(io::Error),
-}
-
-impl fmt::Display for Error {
-    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
-        match self {
-            Error::Yaml(e) => write!(f, "YAML: {}", e),
-            Error::Io(e) => write!(f, "IO: {}", e),
-            Error::Missing(e) => write!(f, "Missing: {}", e),
-        }
-    }
-}
-
-impl From<io::Error> for Error {
-    fn from(e: io::Error) -> Self {
-        let kind = e.kind();
-        match kind {
-            io::ErrorKind::NotFound => Error::Missing(e),
-            _ => Error::Io(e),
-        }
-    }
-}
-
 pub fn add_offsets<'a, I: 'a, T, F: 'a>(iterator: I, get_size: F)
     -> impl Iterator<Item=(f64, T)> + 'a
     where I: Iterator<Item=T>,
@@ -342,7 +331,10 @@ pub fn add_offsets<'a, I: 'a, T, F: 'a>(iterator: I, get_size: F)
     })
 }
 
+/// Loading and building need the rest of squeekboard,
+/// so they are not in the parsing module
 impl Layout {
+    #[cfg(any(test, feature = "builtin_yaml"))]
     pub fn from_resource(name: &str) -> Result<Layout, LoadError> {
         let data = resources::get_keyboard(name)
                     .ok_or(LoadError::MissingResource)?;
@@ -350,393 +342,114 @@ impl Layout {
                     .map_err(LoadError::BadResource)
     }
 
-    pub fn from_file(path: PathBuf) -> Result<Layout, Error> {
-        let infile = BufReader::new(
-            fs::OpenOptions::new()
-                .read(true)
-                .open(&path)?
-        );
-        serde_yaml::from_reader(infile).map_err(Error::Yaml)
-    }
-
-    pub fn build<H: logging::Handler>(self, mut warning_handler: H)
-        -> (Result<::layout::LayoutData, FormattingError>, H)
+    pub fn build<H: logging::Handler>(self, warning_handler: H)
+        -> (Result<::layout::Arrangement, FormattingError>, H)
     {
-        let button_names = self.views.values()
-            .flat_map(|rows| {
-                rows.iter()
-                    .flat_map(|row| row.split_ascii_whitespace())
-            });
-        
-        let button_names: HashSet<&str>
-            = HashSet::from_iter(button_names);
-
-        let button_actions: Vec<(&str, ::action::Action)>
-            = button_names.iter().map(|name| {(
-                *name,
-                create_action(
-                    &self.buttons,
-                    name,
-                    self.views.keys().collect(),
-                    &mut warning_handler,
-                )
-            )}).collect();
-
-        let keymap: HashMap<String, u32> = generate_keycodes(
-            button_actions.iter()
-                .filter_map(|(_name, action)| {
-                    match action {
-                        ::action::Action::Submit {
-                            text: _, keys,
-                        } => Some(keys),
-                        _ => None,
-                    }
-                })
-                .flatten()
-                .map(|named_keysym| named_keysym.0.as_str())
-        );
-
-        let button_states = button_actions.into_iter().map(|(name, action)| {
-            let keycodes = match &action {
-                ::action::Action::Submit { text: _, keys } => {
-                    keys.iter().map(|named_keycode| {
-                        *keymap.get(named_keycode.0.as_str())
-                            .expect(
-                                format!(
-                                    "keycode {} in key {} missing from keymap",
-                                    named_keycode.0,
-                                    name
-                                ).as_str()
-                            )
-                    }).collect()
-                },
-                action::Action::Erase => vec![
-                    *keymap.get("BackSpace")
-                        .expect(&format!("BackSpace missing from keymap")),
-                ],
-                _ => Vec::new(),
-            };
-            (
-                name.into(),
-                KeyState {
-                    pressed: PressType::Released,
-                    keycodes,
-                    action,
-                }
-            )
-        });
-
-        let button_states = HashMap::<String, KeyState>::from_iter(
-            button_states
-        );
+        let (layout, warning_handler) = self.compile(warning_handler);
+        (layout.map(build_layout_data), warning_handler)
+    }
+}
 
-        // TODO: generate from symbols
-        let keymap_str = match generate_keymap(&button_states) {
-            Err(e) => { return (Err(e), warning_handler) },
-            Ok(v) => v,
-        };
+fn load_compiled(name: &str) -> Result<compiled::Layout, LoadError> {
+    let data = compiled::find_in_bundle(resources::COMPILED_KEYBOARDS, name)
+        .map_err(LoadError::BadCompiled)?
+        .ok_or(LoadError::MissingResource)?;
+    compiled::Layout::read(data).map_err(LoadError::BadCompiled)
+}
 
-        let button_states_cache = hash_map_map(
-            button_states,
-            |name, state| {(
-                name,
-                Rc::new(RefCell::new(state))
-            )}
-        );
+/// Loads a built-in layout from its compiled form
+pub fn load_builtin(name: &str) -> Result<::layout::Arrangement, LoadError> {
+    load_compiled(name).map(build_layout_data)
+}
 
-        let views: Vec<_> = self.views.iter()
-            .map(|(name, view)| {
-                let rows = view.iter().map(|row| {
-                    let buttons = row.split_ascii_whitespace()
-                        .map(|name| {
-                            Box::new(create_button(
-                                &self.buttons,
-                                &self.outlines,
-                                name,
-                                button_states_cache.get(name.into())
-                                    .expect("Button state not created")
-                                    .clone(),
-                                &mut warning_handler,
-                            ))
-                        });
-                    layout::Row {
-                        buttons: add_offsets(
-                            buttons,
-                            |button| button.size.width,
-                        ).collect()
-                    }
-                });
-                let rows = add_offsets(rows, |row| row.get_height())
-                    .collect();
-                (
-                    name.clone(),
-                    layout::View::new(rows)
-                )
-            }).collect();
-
-        // Center views on the same point.
-        let views = {
-            let total_size = layout::View::calculate_super_size(
-                views.iter().map(|(_name, view)| view).collect()
-            );
-
-            HashMap::from_iter(views.into_iter().map(|(name, view)| (
-                name,
-                (
-                    layout::c::Point {
-                        x: (total_size.width - view.get_width()) / 2.0,
-                        y: (total_size.height - view.get_height()) / 2.0,
-                    },
-                    view,
-                ),
-            )))
-        };
+/// Puts together the UI structures
+pub fn build_layout_data(layout: compiled::Layout) -> ::layout::Arrangement {
+    fn to_cstring(s: String) -> CString {
+        // Reading the compiled layout made sure there's no 0 inside
+        CString::new(s).expect("Bad string in compiled layout")
+    }
 
-        (
-            Ok(::layout::LayoutData {
-                views: views,
-                keymap_str: {
-                    CString::new(keymap_str)
-                        .expect("Invalid keymap string generated")
+    // Every compiled button is a different key
+    let keys = layout.buttons.iter()
+        .map(|button| Key {
+            keycodes: Arc::new(button.keycodes.clone()),
+            action: button.action.clone(),
+        })
+        .collect();
+
+    let make_button = |i: u32| {
+        let button = &layout.buttons[i as usize];
+        Box::new(layout::Button {
+            name: to_cstring(button.name.clone()),
+            label: match &button.label {
+                compiled::Label::Text(text) => {
+                    layout::Label::Text(to_cstring(text.clone()))
                 },
-                // FIXME: use a dedicated field
-                margins: layout::Margins {
-                    top: self.margins.top,
-                    left: self.margins.side,
-                    bottom: self.margins.bottom,
-                    right: self.margins.side,
+                compiled::Label::IconName(icon) => {
+                    layout::Label::IconName(to_cstring(icon.clone()))
                 },
-            }),
-            warning_handler,
-        )
-    }
-}
-
-fn create_action<H: logging::Handler>(
-    button_info: &HashMap<String, ButtonMeta>,
-    name: &str,
-    view_names: Vec<&String>,
-    warning_handler: &mut H,
-) -> ::action::Action {
-    let default_meta = ButtonMeta::default();
-    let symbol_meta = button_info.get(name)
-        .unwrap_or(&default_meta);
-
-    fn keysym_valid(name: &str) -> bool {
-        xkb::keysym_from_name(name, xkb::KEYSYM_NO_FLAGS) != xkb::KEY_NoSymbol
-    }
-    
-    enum SubmitData {
-        Action(Action),
-        Text(String),
-        Keysym(String),
-        Modifier(Modifier),
-    };
-    
-    let submission = match (
-        &symbol_meta.action,
-        &symbol_meta.keysym,
-        &symbol_meta.text,
-        &symbol_meta.modifier,
-    ) {
-        (Some(action), None, None, None) => SubmitData::Action(action.clone()),
-        (None, Some(keysym), None, None) => SubmitData::Keysym(keysym.clone()),
-        (None, None, Some(text), None) => SubmitData::Text(text.clone()),
-        (None, None, None, Some(modifier)) => {
-            SubmitData::Modifier(modifier.clone())
-        },
-        (None, None, None, None) => SubmitData::Text(name.into()),
-        _ => {
-            warning_handler.handle(
-                logging::Level::Warning,
-                &format!(
-                    "Button {} has more than one of (action, keysym, text, modifier)",
-                    name,
-                ),
-            );
-            SubmitData::Text("".into())
-        },
+            },
+            size: layout::Size {
+                width: button.width,
+                height: button.height,
+            },
+            outline_name: to_cstring(button.outline_name.clone()),
+            key: KeyId(i as usize),
+        })
     };
 
-    fn filter_view_name<H: logging::Handler>(
-        button_name: &str,
-        view_name: String,
-        view_names: &Vec<&String>,
-        warning_handler: &mut H,
-    ) -> String {
-        if view_names.contains(&&view_name) {
-            view_name
-        } else {
-            warning_handler.handle(
-                logging::Level::Warning,
-                &format!("Button {} switches to missing view {}",
-                    button_name,
-                    view_name,
-                ),
-            );
-            "base".into()
-        }
-    }
-
-    match submission {
-        SubmitData::Action(
-            Action::SetView(view_name)
-        ) => ::action::Action::SetView(
-            filter_view_name(
-                name, view_name.clone(), &view_names,
-                warning_handler,
-            )
-        ),
-        SubmitData::Action(Action::Locking {
-            lock_view, unlock_view
-        }) => ::action::Action::LockView {
-            lock: filter_view_name(
-                name,
-                lock_view.clone(),
-                &view_names,
-                warning_handler,
-            ),
-            unlock: filter_view_name(
-                name,
-                unlock_view.clone(),
-                &view_names,
-                warning_handler,
-            ),
-        },
-        SubmitData::Action(
-            Action::ShowPrefs
-        ) => ::action::Action::ShowPreferences,
-        SubmitData::Action(Action::Erase) => action::Action::Erase,
-        SubmitData::Keysym(keysym) => ::action::Action::Submit {
-            text: None,
-            keys: vec!(::action::KeySym(
-                match keysym_valid(keysym.as_str()) {
-                    true => keysym.clone(),
-                    false => {
-                        warning_handler.handle(
-                            logging::Level::Warning,
-                            &format!(
-                                "Keysym name invalid: {}",
-                                keysym,
-                            ),
-                        );
-                        "space".into() // placeholder
-                    },
+    let views: Vec<_> = layout.views.iter()
+        .map(|(name, rows)| {
+            let rows = rows.iter().map(|row| {
+                layout::Row {
+                    buttons: add_offsets(
+                        row.iter().map(|i| make_button(*i)),
+                        |button| button.size.width,
+                    ).collect()
                 }
-            )),
-        },
-        SubmitData::Text(text) => ::action::Action::Submit {
-            text: CString::new(text.clone()).or_warn(
-                warning_handler,
-                logging::Problem::Warning,
-                &format!("Text {} contains problems", text),
-            ),
-            keys: text.chars().map(|codepoint| {
-                let codepoint_string = codepoint.to_string();
-                ::action::KeySym(match keysym_valid(codepoint_string.as_str()) {
-                    true => codepoint_string,
-                    false => format!("U{:04X}", codepoint as u32),
-                })
-            }).collect(),
-        },
-        SubmitData::Modifier(modifier) => match modifier {
-            Modifier::Control => action::Action::ApplyModifier(
-                action::Modifier::Control,
-            ),
-            Modifier::Alt => action::Action::ApplyModifier(
-                action::Modifier::Alt,
-            ),
-            Modifier::Mod4 => action::Action::ApplyModifier(
-                action::Modifier::Mod4,
-            ),
-            Modifier::Shift => action::Action::ApplyModifier(
-                action::Modifier::Shift,
-            ),
-            unsupported_modifier => {
-                warning_handler.handle(
-                    logging::Level::Bug,
-                    &format!(
-                        "Modifier {:?} unsupported", unsupported_modifier,
-                    ),
-                );
-                action::Action::Submit {
-                    text: None,
-                    keys: Vec::new(),
-                }
-            },
-        },
-    }
-}
+            });
+            let rows = add_offsets(rows, |row| row.get_height())
+                .collect();
+            (
+                name.clone(),
+                layout::View::new(rows)
+            )
+        }).collect();
 
-/// TODO: Since this will receive user-provided data,
-/// all .expect() on them should be turned into soft fails
-fn create_button<H: logging::Handler>(
-    button_info: &HashMap<String, ButtonMeta>,
-    outlines: &HashMap<String, Outline>,
-    name: &str,
-    state: Rc<RefCell<KeyState>>,
-    warning_handler: &mut H,
-) -> ::layout::Button {
-    let cname = CString::new(name.clone())
-        .expect("Bad name");
-    // don't remove, because multiple buttons with the same name are allowed
-    let default_meta = ButtonMeta::default();
-    let button_meta = button_info.get(name)
-        .unwrap_or(&default_meta);
-
-    // TODO: move conversion to the C/Rust boundary
-    let label = if let Some(label) = &button_meta.label {
-        ::layout::Label::Text(CString::new(label.as_str())
-            .expect("Bad label"))
-    } else if let Some(icon) = &button_meta.icon {
-        ::layout::Label::IconName(CString::new(icon.as_str())
-            .expect("Bad icon"))
-    } else if let Some(text) = &button_meta.text {
-        ::layout::Label::Text(
-            CString::new(text.as_str())
-                .or_warn(
-                    warning_handler,
-                    logging::Problem::Warning,
-                    &format!("Text {} is invalid", text),
-                ).unwrap_or_else(|| CString::new("").unwrap())
-        )
-    } else {
-        ::layout::Label::Text(cname.clone())
-    };
+    // Center views on the same point.
+    let views = {
+        let total_size = layout::View::calculate_super_size(
+            views.iter().map(|(_name, view)| view).collect()
+        );
 
-    let outline_name = match &button_meta.outline {
-        Some(outline) => {
-            if outlines.contains_key(outline) {
-                outline.clone()
-            } else {
-                warning_handler.handle(
-                    logging::Level::Warning,
-                    &format!("Outline named {} does not exist! Using default for button {}", outline, name)
-                );
-                "default".into()
-            }
-        }
-        None => "default".into(),
+        HashMap::from_iter(views.into_iter().map(|(name, view)| (
+            name,
+            (
+                layout::c::Point {
+                    x: (total_size.width - view.get_width()) / 2.0,
+                    y: (total_size.height - view.get_height()) / 2.0,
+                },
+                view,
+            ),
+        )))
     };
 
-    let outline = outlines.get(&outline_name)
-        .map(|outline| (*outline).clone())
-        .or_warn(
-            warning_handler,
-            logging::Problem::Warning,
-            "No default outline defined! Using 1x1!",
-        ).unwrap_or(Outline { width: 1f64, height: 1f64 });
-
-    layout::Button {
-        name: cname,
-        outline_name: CString::new(outline_name).expect("Bad outline"),
-        // TODO: do layout before creating buttons
-        size: layout::Size {
-            width: outline.width,
-            height: outline.height,
+    let margins = &layout.margins;
+    ::layout::Arrangement {
+        views: views,
+        keys,
+        keymap_str: to_cstring(layout.keymap_str.clone()),
+        // Layouts too big for a keymap are compiled without one
+        keymap_kind: match layout.keymap_str.is_empty() {
+            true => layout::KeymapKind::OnDemand,
+            false => layout::KeymapKind::Own,
+        },
+        margins: layout::Margins {
+            top: margins.top,
+            left: margins.left,
+            bottom: margins.bottom,
+            right: margins.right,
         },
-        label: label,
-        state: state,
     }
 }
 
@@ -744,7 +457,6 @@ fn create_button<H: logging::Handler>(
 mod tests {
     use super::*;
     
-    use std::error::Error as ErrorTrait;
     use ::logging::ProblemPanic;
 
     const THIS_FILE: &str = file!();
@@ -756,71 +468,6 @@ mod tests {
             .join(file)
     }
 
-    #[test]
-    fn test_parse_path() {
-        assert_eq!(
-            Layout::from_file(path_from_root("tests/layout.yaml")).unwrap(),
-            Layout {
-                margins: Margins { top: 0f64, bottom: 0f64, side: 0f64 },
-                views: hashmap!(
-                    "base".into() => vec!("test".into()),
-                ),
-                buttons: hashmap!{
-                    "test".into() => ButtonMeta {
-                        icon: None,
-                        keysym: None,
-                        action: None,
-                        text: None,
-                        modifier: None,
-                        label: Some("test".into()),
-                        outline: None,
-                    }
-                },
-                outlines: hashmap!{
-                    "default".into() => Outline { width: 0f64, height: 0f64 }, 
-                },
-            }
-        );
-    }
-
-    /// Check if the default protection works
-    #[test]
-    fn test_empty_views() {
-        let out = Layout::from_file(path_from_root("tests/layout2.yaml"));
-        match out {
-            Ok(_) => assert!(false, "Data mistakenly accepted"),
-            Err(e) => {
-                let mut handled = false;
-                if let Error::Yaml(ye) = &e {
-                    handled = ye.description() == "missing field `views`";
-                };
-                if !handled {
-                    println!("Unexpected error {:?}", e);
-                    assert!(false)
-                }
-            }
-        }
-    }
-
-    #[test]
-    fn test_extra_field() {
-        let out = Layout::from_file(path_from_root("tests/layout3.yaml"));
-        match out {
-            Ok(_) => assert!(false, "Data mistakenly accepted"),
-            Err(e) => {
-                let mut handled = false;
-                if let Error::Yaml(ye) = &e {
-                    handled = ye.description()
-                        .starts_with("unknown field `bad_field`");
-                };
-                if !handled {
-                    println!("Unexpected error {:?}", e);
-                    assert!(false)
-                }
-            }
-        }
-    }
-    
     #[test]
     fn test_layout_punctuation() {
         let out = Layout::from_file(path_from_root("tests/layout_key1.yaml"))
@@ -829,7 +476,7 @@ mod tests {
             .unwrap();
         assert_eq!(
             out.views["base"].1
-                .get_rows()[0].1
+                .get_rows().next().unwrap().1
                 .buttons[0].1
                 .label,
             ::layout::Label::Text(CString::new("test").unwrap())
@@ -844,7 +491,7 @@ mod tests {
             .unwrap();
         assert_eq!(
             out.views["base"].1
-                .get_rows()[0].1
+                .get_rows().next().unwrap().1
                 .buttons[0].1
                 .label,
             ::layout::Label::Text(CString::new("test").unwrap())
@@ -859,11 +506,12 @@ mod tests {
             .build(ProblemPanic).0
             .unwrap();
         assert_eq!(
-            out.views["base"].1
-                .get_rows()[0].1
-                .buttons[0].1
-                .state.borrow()
-                .keycodes.len(),
+            out.get_key(
+                out.views["base"].1
+                    .get_rows().next().unwrap().1
+                    .buttons[0].1
+                    .key
+            ).keycodes.len(),
             2
         );
     }
@@ -875,7 +523,34 @@ mod tests {
             .is_ok()
         );
     }
-    
+
+    /// The embedded layouts must match their sources
+    #[test]
+    fn compiled_builtins() {
+        for name in resources::get_keyboard_names() {
+            let data = compiled::find_in_bundle(
+                resources::COMPILED_KEYBOARDS,
+                name,
+            ).unwrap().expect(name);
+            let source = Layout::from_resource(name).unwrap()
+                .compile(logging::Print {}).0
+                .unwrap();
+            assert_eq!(compiled::Layout::read(data).unwrap(), source);
+        }
+    }
+
+    #[test]
+    fn prepare_on_thread() {
+        let prepared = ::std::thread::spawn(|| {
+            prepare_layout_with_fallback("de", ArrangementKind::Wide, None, None)
+        }).join().unwrap();
+        let arrangement = prepared.arrangement.clone();
+        let layout = prepared.into_layout();
+        assert!(Arc::ptr_eq(&layout.arrangement, &arrangement));
+        assert_eq!(layout.kind, ArrangementKind::Wide);
+        assert_eq!(layout.current_view, "base");
+    }
+
     /// First fallback should be to builtin, not to FALLBACK_LAYOUT_NAME
     #[test]
     fn fallbacks_order() {
@@ -892,42 +567,6 @@ mod tests {
             )
         );
     }
-    
-    #[test]
-    fn unicode_keysym() {
-        let keysym = xkb::keysym_from_name(
-            format!("U{:X}", "å".chars().next().unwrap() as u32).as_str(),
-            xkb::KEYSYM_NO_FLAGS,
-        );
-        let keysym = xkb::keysym_to_utf8(keysym);
-        assert_eq!(keysym, "å\0");
-    }
-    
-    #[test]
-    fn test_key_unicode() {
-        assert_eq!(
-            create_action(
-                &hashmap!{
-                    ".".into() => ButtonMeta {
-                        icon: None,
-                        keysym: None,
-                        text: None,
-                        action: None,
-                        modifier: None,
-                        label: Some("test".into()),
-                        outline: None,
-                    }
-                },
-                ".",
-                Vec::new(),
-                &mut ProblemPanic,
-            ),
-            ::action::Action::Submit {
-                text: Some(CString::new(".").unwrap()),
-                keys: vec!(::action::KeySym("U002E".into())),
-            },
-        );
-    }
 
     #[test]
     fn test_layout_margins() {
@@ -1,7 +1,6 @@
 /*! Drawing the UI */
 
 use cairo;
-use std::cell::RefCell;
 
 use ::action::Action;
 use ::keyboard;
@@ -51,25 +50,17 @@ mod c {
         let layout = unsafe { &mut *layout };
         let submission = unsafe { &*submission };
         let cr = unsafe { cairo::Context::from_raw_none(cr) };
-        let active_modifiers = submission.get_active_modifiers();
 
-        layout.foreach_visible_button(|offset, button| {
-            let state = RefCell::borrow(&button.state).clone();
-            let active_mod = match &state.action {
-                Action::ApplyModifier(m) => active_modifiers.contains(m),
-                _ => false,
-            };
-            let locked = state.action.is_active(&layout.current_view)
-                | active_mod;
-            if state.pressed == keyboard::PressType::Pressed || locked {
-                render_button_at_position(
-                    renderer, &cr,
-                    offset,
-                    button.as_ref(),
-                    state.pressed, locked,
-                );
-            }
-        })
+        foreach_changed_button(
+            layout,
+            submission,
+            |offset, button, pressed, locked| render_button_at_position(
+                renderer, &cr,
+                offset,
+                button,
+                pressed, locked,
+            ),
+        )
     }
     
     #[no_mangle]
@@ -93,6 +84,30 @@ mod c {
     }
 }
 
+/// Calls `f` on all buttons that are not in the base state,
+/// together with their position, press state, and lock state
+pub fn foreach_changed_button<F>(
+    layout: &Layout,
+    submission: &Submission,
+    mut f: F,
+)
+    where F: FnMut(Point, &Button, keyboard::PressType, bool)
+{
+    layout.foreach_visible_button(|offset, button| {
+        let key = layout.get_key(button.key);
+        let state = layout.get_key_state(button.key);
+        let active_mod = match &key.action {
+            Action::ApplyModifier(m) => submission.is_modifier_active(m.clone()),
+            _ => false,
+        };
+        let locked = key.action.is_active(&layout.current_view)
+            | active_mod;
+        if state.pressed == keyboard::PressType::Pressed || locked {
+            f(offset, button.as_ref(), state.pressed, locked);
+        }
+    })
+}
+
 /// Renders a button at a position (button's own bounds ignored)
 pub fn render_button_at_position(
     renderer: c::EekRenderer,
@@ -0,0 +1,437 @@
+/*! Gesture typing: entering a word by sliding over its letters.
+ *
+ * The stroke is compared to the paths of words from a word list.
+ * A word's path goes straight from one letter key centre to the next.
+ * Both get resampled to the same number of points,
+ * and the word whose path has the least average distance
+ * to the stroke wins.
+ *
+ * Before comparing, words get pruned:
+ * they must start with the letter where the stroke started,
+ * end near where the stroke ended,
+ * and have a path of similar length.
+ *
+ * The word list is a text file in the data directory,
+ * `squeekboard/words.txt`, with one word per line,
+ * most frequent first.
+ * Without it, sliding the finger works like before:
+ * it releases the key left behind, and presses the one entered.
+ */
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::sync::Arc;
+
+use ::action::Action;
+use ::float_ord::FloatOrd;
+use ::keyboard::{ Key, KeyId };
+use ::layout::{ Arrangement, View };
+use ::layout::c::Point;
+use ::logging;
+use ::xdg;
+
+// traits
+use std::io::BufRead;
+
+/// Points in a resampled path
+const SAMPLES: usize = 32;
+
+/// Enough for a long word, drawn slowly.
+/// Longer strokes will allocate.
+const STROKE_CAPACITY: usize = 512;
+
+/// Tolerance for the end of the stroke, in key widths
+const END_TOLERANCE: f64 = 1.5;
+
+fn distance(a: &Point, b: &Point) -> f64 {
+    (a.x - b.x).hypot(a.y - b.y)
+}
+
+fn path_length(points: &[Point]) -> f64 {
+    points.windows(2)
+        .map(|pair| distance(&pair[0], &pair[1]))
+        .sum()
+}
+
+/// Returns SAMPLES points, equally spaced along the path
+fn resample(points: &[Point]) -> Vec<Point> {
+    let mut out = Vec::with_capacity(SAMPLES);
+    let first = match points.first() {
+        Some(first) => first.clone(),
+        None => return out,
+    };
+    out.push(first.clone());
+    let step = path_length(points) / (SAMPLES - 1) as f64;
+    if step > 0.0 {
+        let mut walked = 0.0;
+        let mut target = step;
+        for pair in points.windows(2) {
+            let (a, b) = (&pair[0], &pair[1]);
+            let segment = distance(a, b);
+            while segment > 0.0
+                && walked + segment >= target
+                && out.len() < SAMPLES
+            {
+                let t = (target - walked) / segment;
+                out.push(Point {
+                    x: a.x + (b.x - a.x) * t,
+                    y: a.y + (b.y - a.y) * t,
+                });
+                target += step;
+            }
+            walked += segment;
+        }
+    }
+    // Rounding errors may leave the last point out
+    let last = points.last().unwrap_or(&first).clone();
+    while out.len() < SAMPLES {
+        out.push(last.clone());
+    }
+    out
+}
+
+/// Returns the letter typed by the action, lowercase
+pub fn get_letter(action: &Action) -> Option<char> {
+    match action {
+        Action::Submit { text: Some(text), keys: _ } => {
+            let text = match text.to_str() {
+                Ok(text) => text,
+                Err(_) => return None,
+            };
+            let mut chars = text.chars();
+            match (chars.next(), chars.next()) {
+                (Some(c), None) if c.is_alphabetic() => c.to_lowercase().next(),
+                _ => None,
+            }
+        },
+        _ => None,
+    }
+}
+
+struct Template {
+    word: String,
+    /// Resampled path through the word's letters
+    shape: Vec<Point>,
+    /// Length of the path before resampling
+    length: f64,
+}
+
+pub struct Decoder {
+    /// Grouped by the first letter
+    templates: HashMap<char, Vec<Template>>,
+    /// Average width of letter keys, the unit of tolerance
+    key_size: f64,
+}
+
+impl Decoder {
+    /// Words which can't be typed on the view are skipped.
+    pub fn new<I: Iterator<Item=String>>(words: I, view: &View, keys: &[Key])
+        -> Decoder
+    {
+        let mut letters = HashMap::new();
+        let mut widths = 0.0;
+        for (row_offset, row) in view.get_rows() {
+            for (x_offset, button) in &row.buttons {
+                let letter = get_letter(&keys[button.key.0].action);
+                if let Some(letter) = letter {
+                    widths += button.size.width;
+                    letters.entry(letter).or_insert(Point {
+                        x: row_offset.x + x_offset + button.size.width / 2.0,
+                        y: row_offset.y + button.size.height / 2.0,
+                    });
+                }
+            }
+        }
+        let key_size = match letters.len() {
+            0 => 1.0,
+            count => widths / count as f64,
+        };
+
+        let mut templates: HashMap<char, Vec<Template>> = HashMap::new();
+        for word in words {
+            let path: Option<Vec<Point>> = word.chars()
+                .map(|c| c.to_lowercase().next())
+                .map(|c| c.and_then(|c| letters.get(&c)).cloned())
+                .collect();
+            let first = word.chars().next()
+                .and_then(|c| c.to_lowercase().next());
+            // A single letter is a tap, not a gesture
+            if let (Some(path), Some(first)) = (path, first) {
+                if path.len() > 1 {
+                    templates.entry(first).or_insert_with(Vec::new)
+                        .push(Template {
+                            shape: resample(&path),
+                            length: path_length(&path),
+                            word,
+                        });
+                }
+            }
+        }
+        Decoder { templates, key_size }
+    }
+
+    /// Uses the word list from the data directory
+    pub fn load(view: &View, keys: &[Key]) -> Decoder {
+        let words = get_words();
+        Decoder::new(words.iter().cloned(), view, keys)
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.templates.is_empty()
+    }
+
+    /// Finds the word best matching the stroke,
+    /// starting with the letter `first`.
+    pub fn decode(&self, first: char, stroke: &[Point]) -> Option<&str> {
+        let templates = self.templates.get(&first)?;
+        let shape = resample(stroke);
+        let end = shape.last()?;
+        let length = path_length(stroke);
+        templates.iter()
+            .filter(|t| {
+                distance(&t.shape[SAMPLES - 1], end)
+                    < END_TOLERANCE * self.key_size
+            })
+            .filter(|t| (t.length - length).abs() < length / 2.0 + self.key_size)
+            .map(|t| {
+                let total: f64 = t.shape.iter().zip(shape.iter())
+                    .map(|(a, b)| distance(a, b))
+                    .sum();
+                (FloatOrd(total), t)
+            })
+            // The first of equal scores wins,
+            // which is the more frequent word
+            .min_by_key(|(score, _t)| *score)
+            .map(|(_score, t)| t.word.as_str())
+    }
+}
+
+thread_local! {
+    /// The word list, read on first use.
+    /// Empty if it failed to load, so that it's not tried again.
+    /// Only the main thread handles gestures.
+    static WORDS: RefCell<Option<Arc<Vec<String>>>> = RefCell::new(None);
+}
+
+fn read_words() -> Vec<String> {
+    let path = xdg::data_path("squeekboard/words.txt");
+    let words = path.ok_or(io::Error::new(
+        io::ErrorKind::NotFound,
+        "No data directory",
+    ))
+        .and_then(fs::File::open)
+        .map(io::BufReader::new);
+    match words {
+        Ok(words) => words.lines()
+            .filter_map(Result::ok)
+            .map(|line| line.trim().to_owned())
+            .filter(|word| !word.is_empty())
+            .collect(),
+        Err(e) => {
+            log_print!(
+                logging::Level::Debug,
+                "No word list, gesture typing disabled: {}", e,
+            );
+            Vec::new()
+        },
+    }
+}
+
+/// Returns the word list, reading it only the first time
+fn get_words() -> Arc<Vec<String>> {
+    WORDS.with(|words| {
+        words.borrow_mut()
+            .get_or_insert_with(|| Arc::new(read_words()))
+            .clone()
+    })
+}
+
+/// The path of the touch since the press,
+/// in the coordinates of the view where it started
+pub struct Stroke {
+    points: Vec<Point>,
+    /// The key where the stroke started, if it types a letter
+    first_key: Option<(KeyId, char)>,
+    /// The stroke left the first key, and is read as a gesture
+    pub is_gesture: bool,
+    /// Created on the first gesture on each view
+    decoders: HashMap<String, Decoder>,
+    /// The view of the last decoder used
+    decoder_view: Option<String>,
+}
+
+impl Stroke {
+    pub fn new() -> Stroke {
+        Stroke {
+            points: Vec::with_capacity(STROKE_CAPACITY),
+            first_key: None,
+            is_gesture: false,
+            decoders: HashMap::new(),
+            decoder_view: None,
+        }
+    }
+
+    pub fn start(&mut self, point: Point, key: KeyId, action: &Action) {
+        self.points.clear();
+        self.points.push(point);
+        self.first_key = get_letter(action).map(|letter| (key, letter));
+        self.is_gesture = false;
+    }
+
+    pub fn add(&mut self, point: Point) {
+        if !self.points.is_empty() {
+            self.points.push(point);
+        }
+    }
+
+    pub fn reset(&mut self) {
+        self.points.clear();
+        self.first_key = None;
+        self.is_gesture = false;
+    }
+
+    /// Whether the stroke started on a letter, and left it for `key`
+    pub fn is_leaving_first_key(
+        &self,
+        key: Option<KeyId>,
+    ) -> bool {
+        match (&self.first_key, key) {
+            (Some((first, _)), Some(key)) => *first != key,
+            (Some(_), None) => true,
+            (None, _) => false,
+        }
+    }
+
+    /// Returns a decoder for the view, loading it if needed
+    pub fn get_decoder(&mut self, view_name: &str, arrangement: &Arrangement)
+        -> &Decoder
+    {
+        let is_current = match &self.decoder_view {
+            Some(name) => name == view_name,
+            None => false,
+        };
+        if !is_current {
+            if !self.decoders.contains_key(view_name) {
+                let view = &arrangement.views[view_name].1;
+                self.decoders.insert(
+                    view_name.into(),
+                    Decoder::load(view, &arrangement.keys),
+                );
+            }
+            self.decoder_view = Some(view_name.into());
+        }
+        &self.decoders[view_name]
+    }
+
+    /// Returns the first letter and the best word starting with it.
+    /// Uses the last decoder, because the view may have changed
+    /// when the first key got released.
+    pub fn decode(&self) -> Option<(char, String)> {
+        let decoder = self.decoder_view.as_ref()
+            .and_then(|name| self.decoders.get(name));
+        match (&self.first_key, decoder) {
+            (Some((_key, first)), Some(decoder)) => {
+                decoder.decode(*first, &self.points)
+                    .map(|word| (*first, String::from(word)))
+            },
+            _ => None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn load_arrangement(name: &str) -> Arrangement {
+        ::data::Layout::from_resource(name).unwrap()
+            .build(logging::Print {}).0
+            .unwrap()
+    }
+
+    fn find_centre(arrangement: &Arrangement, letter: char) -> Point {
+        let view = &arrangement.views["base"].1;
+        view.get_rows()
+            .flat_map(|(row_offset, row)| {
+                row.buttons.iter().map(move |(x_offset, button)| {
+                    (row_offset.clone(), *x_offset, button)
+                })
+            })
+            .find(|(_, _, button)| {
+                get_letter(&arrangement.get_key(button.key).action)
+                    == Some(letter)
+            })
+            .map(|(row_offset, x_offset, button)| Point {
+                x: row_offset.x + x_offset + button.size.width / 2.0,
+                y: row_offset.y + button.size.height / 2.0,
+            })
+            .unwrap()
+    }
+
+    #[test]
+    fn resample_line() {
+        let shape = resample(&[
+            Point { x: 0.0, y: 0.0 },
+            Point { x: 31.0, y: 0.0 },
+        ]);
+        assert_eq!(shape.len(), SAMPLES);
+        for (i, point) in shape.iter().enumerate() {
+            assert!((point.x - i as f64).abs() < 0.0001);
+        }
+    }
+
+    #[test]
+    fn resample_point() {
+        let shape = resample(&[Point { x: 1.0, y: 2.0 }]);
+        assert_eq!(shape, vec![Point { x: 1.0, y: 2.0 }; SAMPLES]);
+    }
+
+    #[test]
+    fn decode_words() {
+        let arrangement = load_arrangement("us");
+        let words = ["hello", "help", "hell", "world", "word", "wolf"];
+        let decoder = Decoder::new(
+            words.iter().map(|w| String::from(*w)),
+            &arrangement.views["base"].1,
+            &arrangement.keys,
+        );
+        let stroke = |word: &str| -> Vec<Point> {
+            // Wobbly, and not hitting the centres
+            word.chars()
+                .map(|c| find_centre(&arrangement, c))
+                .enumerate()
+                .map(|(i, p)| Point {
+                    x: p.x + if i % 2 == 0 { 5.0 } else { -5.0 },
+                    y: p.y + 4.0,
+                })
+                .collect()
+        };
+        for word in words.iter() {
+            let first = word.chars().next().unwrap();
+            assert_eq!(decoder.decode(first, &stroke(word)), Some(*word));
+        }
+    }
+
+    /// Stands in for the word list from the data directory,
+    /// which differs between machines
+    fn set_words(words: &[&str]) {
+        let words = words.iter().map(|w| String::from(*w)).collect();
+        WORDS.with(|cached| *cached.borrow_mut() = Some(Arc::new(words)));
+    }
+
+    #[test]
+    fn decoders_cached() {
+        set_words(&["hello", "world"]);
+        let arrangement = load_arrangement("us");
+        let mut stroke = Stroke::new();
+        assert!(!stroke.get_decoder("base", &arrangement).is_empty());
+        stroke.get_decoder("upper", &arrangement);
+        stroke.get_decoder("base", &arrangement);
+        assert_eq!(stroke.decoders.len(), 2);
+        assert_eq!(stroke.decoder_view, Some("base".into()));
+        // The word list is shared, not read again
+        assert!(Arc::ptr_eq(&get_words(), &get_words()));
+    }
+}
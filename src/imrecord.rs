@@ -0,0 +1,423 @@
+/*! Recording input method traffic.
+ *
+ * When the environment variable `SQUEEKBOARD_RECORD_IM` names a file,
+ * the events of the input method protocol get written there,
+ * together with the keys which submit text.
+ * Each line is one event:
+ * microseconds since the start of the recording, the event name,
+ * and its arguments, separated by tabs.
+ * Text comes last, with backslashes, tabs and newlines escaped.
+ *
+ * Text typed into password fields is not written, see `Recorder`.
+ *
+ * Recordings are replayed by ::imreplay.
+ */
+
+use std::fmt;
+use std::fs::File;
+use std::io;
+use std::io::{ BufWriter, Write };
+use std::time::{ Duration, Instant };
+
+use ::imservice::{ ContentHint, ContentPurpose };
+use ::logging;
+
+// Traits
+use std::convert::TryFrom;
+use ::logging::Warn;
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Event {
+    Activate,
+    Deactivate,
+    SurroundingText { text: String, cursor: u32, anchor: u32 },
+    ContentType { hint: u32, purpose: u32 },
+    TextChangeCause(u32),
+    Done,
+    Unavailable,
+    /// A key submitting text was pressed and released
+    PressText(String),
+    /// The erase key was pressed and released
+    PressErase,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Record {
+    /// Since the start of the recording
+    pub time: Duration,
+    pub event: Event,
+}
+
+fn escape(text: &str) -> String {
+    text.replace('\\', "\\\\")
+        .replace('\t', "\\t")
+        .replace('\n', "\\n")
+}
+
+fn unescape(text: &str) -> Result<String, String> {
+    let mut out = String::with_capacity(text.len());
+    let mut chars = text.chars();
+    while let Some(c) = chars.next() {
+        if c == '\\' {
+            out.push(match chars.next() {
+                Some('\\') => '\\',
+                Some('t') => '\t',
+                Some('n') => '\n',
+                other => return Err(format!("Bad escape: {:?}", other)),
+            });
+        } else {
+            out.push(c);
+        }
+    }
+    Ok(out)
+}
+
+impl fmt::Display for Record {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let micros = self.time.as_secs() * 1_000_000
+            + self.time.subsec_micros() as u64;
+        write!(f, "{}\t", micros)?;
+        match &self.event {
+            Event::Activate => write!(f, "activate"),
+            Event::Deactivate => write!(f, "deactivate"),
+            Event::SurroundingText { text, cursor, anchor } => write!(
+                f, "surrounding_text\t{}\t{}\t{}",
+                cursor, anchor, escape(text),
+            ),
+            Event::ContentType { hint, purpose } => write!(
+                f, "content_type\t{}\t{}", hint, purpose,
+            ),
+            Event::TextChangeCause(cause) => write!(
+                f, "text_change_cause\t{}", cause,
+            ),
+            Event::Done => write!(f, "done"),
+            Event::Unavailable => write!(f, "unavailable"),
+            Event::PressText(text) => write!(
+                f, "press_text\t{}", escape(text),
+            ),
+            Event::PressErase => write!(f, "press_erase"),
+        }
+    }
+}
+
+#[derive(Debug)]
+pub struct ParseError {
+    pub line: usize,
+    pub message: String,
+}
+
+impl fmt::Display for ParseError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "Line {}: {}", self.line, self.message)
+    }
+}
+
+fn parse_line(line: &str) -> Result<Record, String> {
+    // Text is the last field, and contains no unescaped tabs
+    let fields: Vec<&str> = line.split('\t').collect();
+    let number = |i: usize| -> Result<u32, String> {
+        fields.get(i)
+            .ok_or_else(|| format!("Missing field {}", i))?
+            .parse()
+            .map_err(|e| format!("Bad number in field {}: {}", i, e))
+    };
+    let text = |i: usize| -> Result<String, String> {
+        unescape(fields.get(i).ok_or_else(|| format!("Missing field {}", i))?)
+    };
+    let micros: u64 = fields[0].parse()
+        .map_err(|e| format!("Bad time: {}", e))?;
+    let name = fields.get(1).ok_or("Missing event name")?;
+    let (event, count) = match *name {
+        "activate" => (Event::Activate, 2),
+        "deactivate" => (Event::Deactivate, 2),
+        "surrounding_text" => (
+            Event::SurroundingText {
+                cursor: number(2)?,
+                anchor: number(3)?,
+                text: text(4)?,
+            },
+            5,
+        ),
+        "content_type" => (
+            Event::ContentType { hint: number(2)?, purpose: number(3)? },
+            4,
+        ),
+        "text_change_cause" => (Event::TextChangeCause(number(2)?), 3),
+        "done" => (Event::Done, 2),
+        "unavailable" => (Event::Unavailable, 2),
+        "press_text" => (Event::PressText(text(2)?), 3),
+        "press_erase" => (Event::PressErase, 2),
+        other => return Err(format!("Unknown event {}", other)),
+    };
+    if fields.len() != count {
+        return Err(format!("Expected {} fields", count));
+    }
+    Ok(Record {
+        time: Duration::from_micros(micros),
+        event,
+    })
+}
+
+/// Skips empty lines and lines starting with "#"
+pub fn parse(source: &str) -> Result<Vec<Record>, ParseError> {
+    source.lines()
+        .enumerate()
+        .filter(|(_i, line)| !line.is_empty() && !line.starts_with('#'))
+        .map(|(i, line)| {
+            parse_line(line)
+                .map_err(|message| ParseError { line: i + 1, message })
+        })
+        .collect()
+}
+
+/// Text typed into such fields must not end up in recordings
+fn is_sensitive(hint: u32, purpose: u32) -> bool {
+    let hint = ContentHint::from_bits_truncate(hint);
+    hint.intersects(ContentHint::SENSITIVE_DATA | ContentHint::HIDDEN_TEXT)
+        || match ContentPurpose::try_from(purpose) {
+            Ok(ContentPurpose::Password) | Ok(ContentPurpose::Pin) => true,
+            _ => false,
+        }
+}
+
+/// Keeps the length, so that cursor positions stay valid
+fn redact(text: &str) -> String {
+    "*".repeat(text.len())
+}
+
+/// Writes events to a file as they come.
+///
+/// While the text field is for passwords or other sensitive data,
+/// text in the events is replaced by asterisks.
+/// The content type of a state is known only once the state is complete,
+/// so the events of a state are held until "done".
+pub struct Recorder<W: Write = BufWriter<File>> {
+    out: W,
+    start: Instant,
+    /// Events of the state which is not complete yet
+    pending: Vec<Record>,
+    /// The last complete state is for a sensitive field
+    sensitive: bool,
+}
+
+impl Recorder {
+    /// Returns None unless recording was asked for
+    pub fn from_env() -> Option<Recorder> {
+        let path = ::std::env::var_os("SQUEEKBOARD_RECORD_IM")?;
+        File::create(&path)
+            .map(|file| Recorder::new(BufWriter::new(file)))
+            .or_print(
+                logging::Problem::Warning,
+                "Can't create input method recording",
+            )
+    }
+}
+
+impl<W: Write> Recorder<W> {
+    pub fn new(out: W) -> Recorder<W> {
+        Recorder {
+            out,
+            start: Instant::now(),
+            pending: Vec::new(),
+            sensitive: false,
+        }
+    }
+
+    pub fn record(&mut self, event: Event) {
+        let record = Record { time: self.start.elapsed(), event };
+        let result = match record.event {
+            Event::Done => {
+                // Like the input method,
+                // each state starts from the default content type
+                let sensitive = self.pending.iter()
+                    .filter_map(|record| match record.event {
+                        Event::ContentType { hint, purpose } => {
+                            Some(is_sensitive(hint, purpose))
+                        },
+                        _ => None,
+                    })
+                    .last()
+                    .unwrap_or(false);
+                let pending = self.pending.split_off(0);
+                let result = pending.into_iter()
+                    .chain(Some(record))
+                    .map(|record| {
+                        let sensitive = match record.event {
+                            // Surrounding text belongs to the new state
+                            Event::SurroundingText { .. } => sensitive,
+                            // Keys were pressed in the old one
+                            _ => self.sensitive,
+                        };
+                        self.write(record, sensitive)
+                    })
+                    .collect::<io::Result<()>>()
+                    // A state is complete on "done",
+                    // so that's where to make sure it's on disk
+                    .and_then(|()| self.out.flush());
+                self.sensitive = sensitive;
+                result
+            },
+            // The incomplete state will never apply
+            Event::Unavailable => {
+                self.pending.clear();
+                self.write(record, false)
+                    .and_then(|()| self.out.flush())
+            },
+            Event::PressText(_) | Event::PressErase
+                if self.pending.is_empty()
+            => {
+                let sensitive = self.sensitive;
+                self.write(record, sensitive)
+            },
+            _ => {
+                self.pending.push(record);
+                Ok(())
+            },
+        };
+        result.or_print(
+            logging::Problem::Warning,
+            "Failed to record input method event",
+        );
+    }
+
+    fn write(&mut self, record: Record, sensitive: bool) -> io::Result<()> {
+        let Record { time, event } = record;
+        let event = match (sensitive, event) {
+            (true, Event::SurroundingText { text, cursor, anchor }) => {
+                Event::SurroundingText { text: redact(&text), cursor, anchor }
+            },
+            (true, Event::PressText(text)) => Event::PressText(redact(&text)),
+            (_, event) => event,
+        };
+        writeln!(self.out, "{}", Record { time, event })
+    }
+}
+
+/// Generates a recording of typing `count` characters
+/// at the end of a text field already holding `length` bytes,
+/// with the application sending the whole text after every change
+pub fn generate_typing(length: usize, count: usize) -> Vec<Record> {
+    let mut text: String = "lorem ipsum ".chars().cycle().take(length).collect();
+    let mut records = vec![Event::Activate];
+    let surrounding = |text: &str| vec![
+        Event::SurroundingText {
+            text: text.into(),
+            cursor: text.len() as u32,
+            anchor: text.len() as u32,
+        },
+        Event::TextChangeCause(0),
+        Event::ContentType { hint: 0, purpose: 0 },
+        Event::Done,
+    ];
+    records.extend(surrounding(&text));
+    for i in 0..count {
+        match i % 5 {
+            // Some mistakes get corrected
+            4 => {
+                records.push(Event::PressErase);
+                text.pop();
+            },
+            _ => {
+                records.push(Event::PressText("a".into()));
+                text.push('a');
+            },
+        }
+        records.extend(surrounding(&text));
+    }
+    records.into_iter()
+        .enumerate()
+        .map(|(i, event)| Record {
+            time: Duration::from_millis(i as u64),
+            event,
+        })
+        .collect()
+}
+
+/// Writes a recording in the format it's read in
+pub fn write<W: io::Write>(out: &mut W, records: &[Record]) -> io::Result<()> {
+    for record in records {
+        writeln!(out, "{}", record)?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn round_trip() {
+        let records = vec![
+            Record { time: Duration::from_micros(5), event: Event::Activate },
+            Record {
+                time: Duration::from_micros(1_000_007),
+                event: Event::SurroundingText {
+                    text: "a\tb\\c\nd".into(),
+                    cursor: 3,
+                    anchor: 1,
+                },
+            },
+            Record {
+                time: Duration::from_secs(2),
+                event: Event::PressText("\t".into()),
+            },
+        ];
+        let mut out = Vec::new();
+        write(&mut out, &records).unwrap();
+        let out = String::from_utf8(out).unwrap();
+        assert_eq!(out.lines().count(), 3);
+        assert_eq!(parse(&out).unwrap(), records);
+        assert_eq!(parse("# comment\n\n0\tdone").unwrap().len(), 1);
+        assert_eq!(parse("0\tdone\n0\tdone\textra").unwrap_err().line, 2);
+    }
+
+    #[test]
+    fn redacts_sensitive_text() {
+        let mut recorder = Recorder::new(Vec::new());
+        let surrounding = |text: &str| Event::SurroundingText {
+            text: text.into(),
+            cursor: text.len() as u32,
+            anchor: text.len() as u32,
+        };
+        let events = vec![
+            Event::Activate,
+            surrounding("ab"),
+            Event::Done,
+            Event::PressText("c".into()),
+            // Password
+            surrounding("secret"),
+            Event::ContentType { hint: 0, purpose: 8 },
+            Event::Done,
+            Event::PressText("ż".into()),
+            // Sensitive data
+            surrounding("secretż"),
+            Event::ContentType { hint: 0x80, purpose: 0 },
+            Event::Done,
+            Event::PressText("x".into()),
+            // Back to normal
+            surrounding("abc"),
+            Event::Done,
+            Event::PressText("d".into()),
+        ];
+        for event in events {
+            recorder.record(event);
+        }
+        let out = String::from_utf8(recorder.out).unwrap();
+        let texts: Vec<String> = parse(&out).unwrap().into_iter()
+            .filter_map(|record| match record.event {
+                Event::SurroundingText { text, .. } => Some(text),
+                Event::PressText(text) => Some(text),
+                _ => None,
+            })
+            .collect();
+        assert_eq!(
+            texts,
+            vec![
+                "ab", "c",
+                "******", "**",
+                "********", "*",
+                "abc", "d",
+            ],
+        );
+    }
+}
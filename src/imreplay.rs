@@ -0,0 +1,273 @@
+/*! Replaying input method recordings, made by ::imrecord.
+ *
+ * The events go through the same handlers as the ones from the compositor,
+ * and the keys go through submission,
+ * while the stand-ins in `c_stubs.rs` collect what would be sent back.
+ *
+ * Only for tests and tools, built with the "replay" feature.
+ * squeekboard itself has no use for it.
+ */
+
+use std::cell::RefCell;
+use std::ffi::CString;
+use std::os::raw::c_char;
+use std::ptr;
+use std::sync::Arc;
+use std::time::Instant;
+
+use ::action::Action;
+use ::imrecord::{ Event, Record };
+use ::imservice;
+use ::imservice::IMService;
+use ::keyboard::{ Key, KeyState, PressType };
+use ::submission::{ Submission, SubmitData, Timestamp };
+use ::timing::Timing;
+use ::util::c::as_str;
+use ::vkeyboard::VirtualKeyboard;
+use ::vkeyboard::c::ZwpVirtualKeyboardV1;
+
+/// Stand-ins for the compositor call these, see `c_stubs.rs`
+pub mod c {
+    use super::*;
+
+    use std::os::raw::c_char;
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_replay_commit_string(text: *const c_char) {
+        collect(|| {
+            let text = as_str(&text)
+                .expect("Bad text")
+                .unwrap_or("")
+                .to_owned();
+            Output::CommitString(text)
+        });
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_replay_delete_surrounding_text(before: u32, after: u32) {
+        collect(|| Output::DeleteSurroundingText(before, after));
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_replay_commit(serial: u32) {
+        collect(|| Output::Commit(serial));
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_replay_set_hint_purpose(hint: u32, purpose: u32) {
+        collect(|| Output::SetHintPurpose(hint, purpose));
+    }
+}
+
+/// What squeekboard sent in response to the events
+#[derive(Debug, Clone, PartialEq)]
+pub enum Output {
+    CommitString(String),
+    DeleteSurroundingText(u32, u32),
+    Commit(u32),
+    /// Makes the layout change to one fitting the text field
+    SetHintPurpose(u32, u32),
+}
+
+thread_local! {
+    /// None when not collecting
+    static OUTPUTS: RefCell<Option<Vec<Output>>> = RefCell::new(None);
+}
+
+/// The output is created only when collecting
+fn collect<F: FnOnce() -> Output>(get_output: F) {
+    OUTPUTS.with(|outputs| {
+        if let Some(outputs) = outputs.borrow_mut().as_mut() {
+            outputs.push(get_output());
+        }
+    });
+}
+
+fn set_collecting(collecting: bool) -> Vec<Output> {
+    OUTPUTS.with(|outputs| {
+        let new = match collecting {
+            true => Some(Vec::new()),
+            false => None,
+        };
+        outputs.replace(new).unwrap_or(Vec::new())
+    })
+}
+
+/// Squeekboard, as far as the input method is concerned
+pub struct Replay {
+    submission: Submission,
+    /// Owned by submission
+    imservice: *mut IMService,
+    im: *mut imservice::c::InputMethod,
+    /// Identifies the pressed key
+    key_state: KeyState,
+    time: u32,
+}
+
+impl Replay {
+    pub fn new() -> Replay {
+        // Never dereferenced, only compared
+        let im = ptr::NonNull::dangling().as_ptr();
+        let mut imservice = IMService::new(im, ptr::null());
+        let imservice_ptr = imservice.as_mut() as *mut IMService;
+        Replay {
+            submission: Submission::new(
+                Some(imservice),
+                VirtualKeyboard(ZwpVirtualKeyboardV1(ptr::null())),
+            ),
+            imservice: imservice_ptr,
+            im,
+            key_state: KeyState { pressed: PressType::Released },
+            time: 0,
+        }
+    }
+
+    pub fn feed(&mut self, event: &Event) {
+        use ::imservice::c::*;
+        let (imservice, im) = (self.imservice, self.im);
+        match event {
+            Event::Activate => {
+                imservice_handle_input_method_activate(imservice, im)
+            },
+            Event::Deactivate => {
+                imservice_handle_input_method_deactivate(imservice, im)
+            },
+            Event::SurroundingText { text, cursor, anchor } => {
+                let text = CString::new(text.as_str())
+                    .expect("Text contains a null byte");
+                imservice_handle_surrounding_text(
+                    imservice, im,
+                    text.as_ptr() as *const c_char, *cursor, *anchor,
+                )
+            },
+            Event::ContentType { hint, purpose } => {
+                imservice_handle_content_type(imservice, im, *hint, *purpose)
+            },
+            Event::TextChangeCause(cause) => {
+                imservice_handle_text_change_cause(imservice, im, *cause)
+            },
+            Event::Done => imservice_handle_done(imservice, im),
+            Event::Unavailable => {
+                imservice_handle_unavailable(imservice, im as *mut _)
+            },
+            Event::PressText(text) => {
+                let text = CString::new(text.as_str())
+                    .expect("Text contains a null byte");
+                self.press(
+                    SubmitData::Text(&text),
+                    Action::Submit { text: Some(text.clone()), keys: vec![] },
+                );
+            },
+            Event::PressErase => self.press(SubmitData::Erase, Action::Erase),
+        }
+    }
+
+    fn press(&mut self, data: SubmitData, action: Action) {
+        let key = Key { keycodes: Arc::new(Vec::new()), action };
+        let time = self.time;
+        self.submission.handle_press(
+            KeyState::get_id(&self.key_state),
+            data,
+            &key,
+            Timestamp(time),
+        );
+        self.submission.handle_release(
+            KeyState::get_id(&self.key_state),
+            Timestamp(time + 1),
+        );
+        // Like at the end of the main loop iteration
+        self.submission.flush();
+        self.time += 100;
+    }
+}
+
+/// Returns what squeekboard sent in response to the recording
+pub fn replay(records: &[Record]) -> Vec<Output> {
+    set_collecting(true);
+    let mut replay = Replay::new();
+    for record in records {
+        replay.feed(&record.event);
+    }
+    set_collecting(false)
+}
+
+/// Times replaying the recording `iterations` times,
+/// in nanoseconds per event
+pub fn time_replay(records: &[Record], iterations: usize) -> Timing {
+    let mut samples = Vec::with_capacity(iterations);
+    // The first round warms up caches, and doesn't count
+    for i in 0..(iterations + 1) {
+        let mut replay = Replay::new();
+        let start = Instant::now();
+        for record in records {
+            replay.feed(&record.event);
+        }
+        let elapsed = start.elapsed();
+        if i > 0 {
+            let nanos = elapsed.as_secs() * 1_000_000_000
+                + elapsed.subsec_nanos() as u64;
+            samples.push(nanos / records.len().max(1) as u64);
+        }
+    }
+    Timing::new("replay", samples)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use ::imrecord::{ generate_typing, parse };
+
+    #[test]
+    fn replay_recording() {
+        let records = parse(include_str!("../tests/input_method.rec"))
+            .unwrap();
+        assert_eq!(
+            replay(&records),
+            vec![
+                // Purpose: number
+                Output::SetHintPurpose(0, 3),
+                // "ą" takes 2 bytes
+                Output::DeleteSurroundingText(2, 0),
+                Output::Commit(1),
+                Output::CommitString("12".into()),
+                Output::Commit(2),
+                // "3" went to the virtual keyboard
+            ],
+        );
+    }
+
+    #[test]
+    fn large_text() {
+        let records = generate_typing(10000, 10);
+        let outputs = replay(&records);
+        assert_eq!(
+            outputs.iter()
+                .filter(|output| match output {
+                    Output::CommitString(_) => true,
+                    _ => false,
+                })
+                .count(),
+            8,
+        );
+        assert!(outputs.contains(&Output::DeleteSurroundingText(1, 0)));
+        assert_eq!(time_replay(&records, 2).iterations, 2);
+    }
+
+    #[test]
+    fn selection_erased_by_keycodes() {
+        let records: Vec<Record> = vec![
+            Event::Activate,
+            Event::SurroundingText { text: "abc".into(), cursor: 3, anchor: 1 },
+            Event::Done,
+            Event::PressErase,
+        ].into_iter()
+            .map(|event| Record { time: Default::default(), event })
+            .collect();
+        // Nothing deleted through the input method
+        assert_eq!(replay(&records), vec![Output::SetHintPurpose(0, 0)]);
+    }
+}
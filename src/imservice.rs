@@ -4,13 +4,16 @@
  */
 
 use std::boxed::Box;
-use std::ffi::CString;
+use std::ffi::{ CStr, CString };
 use std::fmt;
+use std::mem;
 use std::num::Wrapping;
+use std::os::raw::c_char;
+use std::str;
 use std::string::String;
 
+use ::imrecord::{ Event, Recorder };
 use ::logging;
-use ::util::c::into_cstring;
 
 // Traits
 use std::convert::TryFrom;
@@ -54,11 +57,10 @@ pub mod c {
         im: *const InputMethod)
     {
         let imservice = check_imservice(imservice, im).unwrap();
+        imservice.record(|| Event::Activate);
         imservice.preedit_string = String::new();
-        imservice.pending = IMProtocolState {
-            active: true,
-            ..IMProtocolState::default()
-        };
+        imservice.pending.reset();
+        imservice.pending.active = true;
     }
     
     #[no_mangle]
@@ -67,26 +69,32 @@ pub mod c {
         im: *const InputMethod)
     {
         let imservice = check_imservice(imservice, im).unwrap();
-        imservice.pending = IMProtocolState {
-            active: false,
-            ..imservice.pending.clone()
-        };
+        imservice.record(|| Event::Deactivate);
+        imservice.pending.active = false;
     }
     
     #[no_mangle]
     pub extern "C"
     fn imservice_handle_surrounding_text(imservice: *mut IMService,
         im: *const InputMethod,
-        text: *const c_char, cursor: u32, _anchor: u32)
+        text: *const c_char, cursor: u32, anchor: u32)
     {
         let imservice = check_imservice(imservice, im).unwrap();
-        imservice.pending = IMProtocolState {
-            surrounding_text: into_cstring(text)
-                .expect("Received invalid string")
-                .expect("Received null string"),
-            surrounding_cursor: cursor,
-            ..imservice.pending.clone()
-        };
+        if text.is_null() {
+            panic!("Received null string");
+        }
+        // Copied into the buffer, which is big enough after the first time
+        let text = unsafe { CStr::from_ptr(text) }.to_bytes();
+        imservice.record(|| Event::SurroundingText {
+            text: String::from_utf8_lossy(text).into_owned(),
+            cursor,
+            anchor,
+        });
+        imservice.pending.surrounding_text.clear();
+        imservice.pending.surrounding_text.extend_from_slice(text);
+        imservice.pending.surrounding_cursor = cursor;
+        imservice.pending.surrounding_anchor = anchor;
+        imservice.pending.has_surrounding_text = true;
     }
     
     #[no_mangle]
@@ -96,24 +104,22 @@ pub mod c {
         hint: u32, purpose: u32)
     {
         let imservice = check_imservice(imservice, im).unwrap();
-        imservice.pending = IMProtocolState {
-            content_hint: {
-                ContentHint::from_bits(hint)
-                    .or_print(
-                        logging::Problem::Warning,
-                        "Received invalid hint flags",
-                    )
-                    .unwrap_or(ContentHint::NONE)
-            },
-            content_purpose: {
-                ContentPurpose::try_from(purpose)
-                    .or_print(
-                        logging::Problem::Warning,
-                        "Received invalid purpose value",
-                    )
-                    .unwrap_or(ContentPurpose::Normal)
-            },
-            ..imservice.pending.clone()
+        imservice.record(|| Event::ContentType { hint, purpose });
+        imservice.pending.content_hint = {
+            ContentHint::from_bits(hint)
+                .or_print(
+                    logging::Problem::Warning,
+                    "Received invalid hint flags",
+                )
+                .unwrap_or(ContentHint::NONE)
+        };
+        imservice.pending.content_purpose = {
+            ContentPurpose::try_from(purpose)
+                .or_print(
+                    logging::Problem::Warning,
+                    "Received invalid purpose value",
+                )
+                .unwrap_or(ContentPurpose::Normal)
         };
     }
     
@@ -124,16 +130,14 @@ pub mod c {
         cause: u32)
     {
         let imservice = check_imservice(imservice, im).unwrap();
-        imservice.pending = IMProtocolState {
-            text_change_cause: {
-                ChangeCause::try_from(cause)
-                    .or_print(
-                        logging::Problem::Warning,
-                        "Received invalid cause value",
-                    )
-                    .unwrap_or(ChangeCause::InputMethod)
-            },
-            ..imservice.pending.clone()
+        imservice.record(|| Event::TextChangeCause(cause));
+        imservice.pending.text_change_cause = {
+            ChangeCause::try_from(cause)
+                .or_print(
+                    logging::Problem::Warning,
+                    "Received invalid cause value",
+                )
+                .unwrap_or(ChangeCause::InputMethod)
         };
     }
     
@@ -143,13 +147,14 @@ pub mod c {
         im: *const InputMethod)
     {
         let imservice = check_imservice(imservice, im).unwrap();
+        imservice.record(|| Event::Done);
+        imservice.serial += Wrapping(1u32);
         let active_changed = imservice.current.active ^ imservice.pending.active;
 
-        imservice.current = imservice.pending.clone();
-        imservice.pending = IMProtocolState {
-            active: imservice.current.active,
-            ..IMProtocolState::default()
-        };
+        // The buffers trade places, so that no text gets copied
+        mem::swap(&mut imservice.current, &mut imservice.pending);
+        imservice.pending.reset();
+        imservice.pending.active = imservice.current.active;
 
         if active_changed {
             if imservice.current.active {
@@ -178,6 +183,7 @@ pub mod c {
         im: *mut InputMethod)
     {
         let imservice = check_imservice(imservice, im).unwrap();
+        imservice.record(|| Event::Unavailable);
         unsafe { imservice_destroy_im(im); }
 
         // no need to care about proper double-buffering,
@@ -311,21 +317,64 @@ impl TryFrom<u32> for ChangeCause {
 }
 
 /// Describes the desired state of the input method as requested by the server
-#[derive(Clone)]
 struct IMProtocolState {
-    surrounding_text: CString,
+    /// UTF-8, without the terminating null.
+    /// Kept between events, so that it's allocated only when it grows
+    surrounding_text: Vec<u8>,
     surrounding_cursor: u32,
+    /// Differs from the cursor when text is selected
+    surrounding_anchor: u32,
+    /// False if the application doesn't send surrounding text
+    has_surrounding_text: bool,
     content_purpose: ContentPurpose,
     content_hint: ContentHint,
     text_change_cause: ChangeCause,
     active: bool,
 }
 
+impl IMProtocolState {
+    /// Guesses the effect of an edit made by the input method,
+    /// for the edits which follow before the application answers
+    fn edit_surrounding_text(&mut self, before: u32, after: u32, text: &[u8]) {
+        if !self.has_surrounding_text {
+            return;
+        }
+        if self.surrounding_anchor != self.surrounding_cursor {
+            // Applications treat the selection in their own ways,
+            // so the text is not known until they send it again
+            self.has_surrounding_text = false;
+            return;
+        }
+        let len = self.surrounding_text.len();
+        let cursor = (self.surrounding_cursor as usize).min(len);
+        let start = cursor.saturating_sub(before as usize);
+        let end = (cursor + after as usize).min(len);
+        // Moves only the text after the cursor
+        self.surrounding_text.splice(start..end, text.iter().cloned());
+        self.surrounding_cursor = (start + text.len()) as u32;
+        self.surrounding_anchor = self.surrounding_cursor;
+    }
+
+    /// Returns to the defaults, keeping the buffer
+    fn reset(&mut self) {
+        self.surrounding_text.clear();
+        self.surrounding_cursor = 0;
+        self.surrounding_anchor = 0;
+        self.has_surrounding_text = false;
+        self.content_hint = ContentHint::NONE;
+        self.content_purpose = ContentPurpose::Normal;
+        self.text_change_cause = ChangeCause::InputMethod;
+        self.active = false;
+    }
+}
+
 impl Default for IMProtocolState {
     fn default() -> IMProtocolState {
         IMProtocolState {
-            surrounding_text: CString::default(),
-            surrounding_cursor: 0, // TODO: mark that there's no cursor
+            surrounding_text: Vec::new(),
+            surrounding_cursor: 0,
+            surrounding_anchor: 0,
+            has_surrounding_text: false,
             content_hint: ContentHint::NONE,
             content_purpose: ContentPurpose::Normal,
             text_change_cause: ChangeCause::InputMethod,
@@ -345,7 +394,13 @@ pub struct IMService {
     pending: IMProtocolState,
     current: IMProtocolState, // turn current into an idiomatic representation?
     preedit_string: String,
+    /// Done events received, as the commit request wants
     serial: Wrapping<u32>,
+    /// Requests waiting for the next flush, see `commit`
+    queued_delete: Option<(u32, u32)>,
+    queued_text: Vec<u8>,
+    commit_queued: bool,
+    recorder: Option<Recorder>,
 }
 
 pub enum SubmitError {
@@ -368,6 +423,10 @@ impl IMService {
             current: IMProtocolState::default(),
             preedit_string: String::new(),
             serial: Wrapping(0u32),
+            queued_delete: None,
+            queued_text: Vec::new(),
+            commit_queued: false,
+            recorder: Recorder::from_env(),
         });
         unsafe {
             c::imservice_connect_listeners(
@@ -378,12 +437,12 @@ impl IMService {
         imservice
     }
     
-    pub fn commit_string(&self, text: &CString) -> Result<(), SubmitError> {
+    /// Appends to the text of the next commit
+    pub fn commit_string(&mut self, text: &CString) -> Result<(), SubmitError> {
         match self.current.active {
             true => {
-                unsafe {
-                    c::eek_input_method_commit_string(self.im, text.as_ptr())
-                }
+                self.queued_text.extend_from_slice(text.as_bytes());
+                self.current.edit_surrounding_text(0, 0, text.as_bytes());
                 Ok(())
             },
             false => Err(SubmitError::NotActive),
@@ -391,37 +450,245 @@ impl IMService {
     }
 
     pub fn delete_surrounding_text(
-        &self,
+        &mut self,
         before: u32, after: u32,
     ) -> Result<(), SubmitError> {
         match self.current.active {
             true => {
-                unsafe {
-                    c::eek_input_method_delete_surrounding_text(
-                        self.im,
-                        before, after,
-                    )
+                // The application deletes before inserting the text,
+                // so deleting after text needs its own commit
+                if self.queued_text.len() > 0 {
+                    self.flush();
                 }
+                self.queued_delete = Some(match self.queued_delete {
+                    Some((b, a)) => (b + before, a + after),
+                    None => (before, after),
+                });
+                self.current.edit_surrounding_text(before, after, &[]);
                 Ok(())
             },
             false => Err(SubmitError::NotActive),
         }
     }
 
+    /// Queues the commit.
+    /// Commits queued before a flush get merged into one,
+    /// so that fast typing doesn't send a request for every key.
     pub fn commit(&mut self) -> Result<(), SubmitError> {
         match self.current.active {
             true => {
-                unsafe {
-                    c::eek_input_method_commit(self.im, self.serial.0)
-                }
-                self.serial += Wrapping(1u32);
+                self.commit_queued = true;
                 Ok(())
             },
             false => Err(SubmitError::NotActive),
         }
     }
 
+    /// Sends queued requests
+    pub fn flush(&mut self) {
+        if !self.commit_queued {
+            return;
+        }
+        self.commit_queued = false;
+        let delete = self.queued_delete.take();
+        if !self.current.active {
+            log_print!(
+                logging::Level::Surprise,
+                "Text field went away, dropping {:?}",
+                String::from_utf8_lossy(&self.queued_text),
+            );
+            self.queued_text.clear();
+            return;
+        }
+        unsafe {
+            if let Some((before, after)) = delete {
+                c::eek_input_method_delete_surrounding_text(
+                    self.im,
+                    before, after,
+                );
+            }
+            if self.queued_text.len() > 0 {
+                // Terminated in place, so that the buffer gets reused.
+                // The text came from CStrings, so it has no other nulls.
+                self.queued_text.push(0);
+                c::eek_input_method_commit_string(
+                    self.im,
+                    self.queued_text.as_ptr() as *const c_char,
+                );
+            }
+            c::eek_input_method_commit(self.im, self.serial.0);
+        }
+        self.queued_text.clear();
+    }
+
+    /// Returns the length in bytes of the character before the cursor,
+    /// as the user sees it, or None if the surrounding text doesn't tell.
+    pub fn get_erase_len(&self) -> Option<u32> {
+        if !self.current.has_surrounding_text {
+            return None;
+        }
+        // Erasing a selection takes the application's own rules,
+        // which the keycodes bring
+        if self.current.surrounding_anchor != self.current.surrounding_cursor {
+            return None;
+        }
+        let text = &self.current.surrounding_text;
+        let before = text.get(..self.current.surrounding_cursor as usize)?;
+        // Only the end of the text matters,
+        // and checking all of it would take longer the longer it is
+        let start = before.len().saturating_sub(MAX_GRAPHEME_LEN);
+        let start = (start..before.len())
+            .find(|i| !is_utf8_continuation(before[*i]))
+            .unwrap_or(before.len());
+        match str::from_utf8(&before[start..]).map(get_last_grapheme_len) {
+            Ok(0) | Err(_) => None,
+            Ok(len) => Some(len as u32),
+        }
+    }
+
+    /// The event is created only when recording
+    pub fn record<F: FnOnce() -> Event>(&mut self, get_event: F) {
+        if let Some(recorder) = &mut self.recorder {
+            recorder.record(get_event());
+        }
+    }
+
     pub fn is_active(&self) -> bool {
         self.current.active
     }
 }
+
+/// Longer sequences are cut short when erasing
+const MAX_GRAPHEME_LEN: usize = 128;
+
+fn is_utf8_continuation(byte: u8) -> bool {
+    byte & 0b1100_0000 == 0b1000_0000
+}
+
+/// Approximates the length of the last grapheme cluster in bytes.
+/// Covers the combining marks and emoji sequences of the built-in layouts,
+/// without the full Unicode tables.
+fn get_last_grapheme_len(text: &str) -> usize {
+    let regional_count = text.chars().rev()
+        .take_while(|c| is_regional_indicator(*c))
+        .count();
+    if regional_count > 0 {
+        // Flags are pairs of regional indicators
+        let count = if regional_count % 2 == 0 { 2 } else { 1 };
+        return count * '\u{1F1E6}'.len_utf8();
+    }
+
+    let mut chars = text.chars().rev().peekable();
+    let mut len = 0;
+    while let Some(c) = chars.next() {
+        len += c.len_utf8();
+        let joins_previous = match chars.peek() {
+            None => false,
+            Some(&previous) => {
+                is_extending(c)
+                    || previous == '\u{200D}' // zero width joiner
+                    || (c == '\n' && previous == '\r')
+            },
+        };
+        if !joins_previous {
+            break;
+        }
+    }
+    len
+}
+
+fn is_regional_indicator(c: char) -> bool {
+    '\u{1F1E6}' <= c && c <= '\u{1F1FF}'
+}
+
+/// Characters which attach to the one before them
+fn is_extending(c: char) -> bool {
+    match c as u32 {
+        0x0300..=0x036F // combining diacritical marks
+        | 0x0483..=0x0489 // Cyrillic
+        | 0x1AB0..=0x1AFF
+        | 0x1DC0..=0x1DFF
+        | 0x200C..=0x200D // zero width (non-)joiner
+        | 0x20D0..=0x20FF // marks for symbols, like the keycap
+        | 0x3099..=0x309A // kana voicing marks
+        | 0xFE00..=0xFE0F // variation selectors
+        | 0xFE20..=0xFE2F // half marks
+        | 0x1F3FB..=0x1F3FF // skin tones
+        | 0xE0020..=0xE007F // tags
+        | 0xE0100..=0xE01EF // variation selectors
+        => true,
+        _ => false,
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn last_grapheme() {
+        assert_eq!(get_last_grapheme_len(""), 0);
+        assert_eq!(get_last_grapheme_len("ab"), 1);
+        assert_eq!(get_last_grapheme_len("aż"), 2);
+        // e with a combining acute accent
+        assert_eq!(get_last_grapheme_len("ae\u{301}"), 3);
+        assert_eq!(get_last_grapheme_len("a\r\n"), 2);
+        // Family, joined with ZWJ
+        let family = "\u{1F468}\u{200D}\u{1F469}\u{200D}\u{1F467}";
+        assert_eq!(get_last_grapheme_len(&format!("a{}", family)), family.len());
+        // Thumbs up with a skin tone
+        assert_eq!(get_last_grapheme_len("a\u{1F44D}\u{1F3FD}"), 8);
+        // Three flag halves: the last one stands alone
+        assert_eq!(get_last_grapheme_len("\u{1F1E9}\u{1F1EA}\u{1F1EB}"), 4);
+        assert_eq!(get_last_grapheme_len("a\u{1F1E9}\u{1F1EA}"), 8);
+    }
+
+    #[test]
+    fn edits() {
+        let mut state = IMProtocolState::default();
+        state.edit_surrounding_text(0, 0, b"ignored");
+        assert_eq!(state.surrounding_text, b"");
+
+        state.surrounding_text.extend_from_slice(b"abcd");
+        state.surrounding_cursor = 2;
+        state.surrounding_anchor = 2;
+        state.has_surrounding_text = true;
+        state.edit_surrounding_text(1, 0, b"");
+        state.edit_surrounding_text(0, 1, "ż".as_bytes());
+        assert_eq!(state.surrounding_text, "ażd".as_bytes());
+        assert_eq!(state.surrounding_cursor, 3);
+        assert_eq!(state.surrounding_anchor, 3);
+
+        // With a selection, the result is up to the application
+        state.surrounding_anchor = 1;
+        state.edit_surrounding_text(0, 0, b"e");
+        assert!(!state.has_surrounding_text);
+    }
+
+    #[test]
+    fn selection_not_erased_by_length() {
+        use std::ptr;
+        use self::c::*;
+
+        // Never dereferenced, only compared
+        let im = ptr::NonNull::dangling().as_ptr();
+        let mut imservice = IMService::new(im, ptr::null());
+        let imservice_ptr = imservice.as_mut() as *mut IMService;
+        let text = CString::new("abc").unwrap();
+        imservice_handle_input_method_activate(imservice_ptr, im);
+        imservice_handle_surrounding_text(
+            imservice_ptr, im,
+            text.as_ptr(), 3, 3,
+        );
+        imservice_handle_done(imservice_ptr, im);
+        assert_eq!(imservice.get_erase_len(), Some(1));
+
+        // "bc" selected
+        imservice_handle_surrounding_text(
+            imservice_ptr, im,
+            text.as_ptr(), 3, 1,
+        );
+        imservice_handle_done(imservice_ptr, im);
+        assert_eq!(imservice.get_erase_len(), None);
+    }
+}
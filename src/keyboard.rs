@@ -1,14 +1,15 @@
 /*! State of the emulated keyboard and keys.
  * Regards the keyboard as if it was composed of switches. */
 
-use std::cell::RefCell;
-use std::collections::HashMap;
+use std::collections::{ BTreeMap, HashMap };
 use std::fmt;
 use std::io;
-use std::rc::Rc;
 use std::string::FromUtf8Error;
+use std::sync::Arc;
 
-use ::action::Action;
+use xkbcommon::xkb;
+
+use ::action::{ Action, KeySym };
 use ::logging;
 
 // Traits
@@ -23,6 +24,14 @@ pub enum PressType {
 
 pub type KeyCode = u32;
 
+/// HACK: starting from 9, because 8 results in keycode 0,
+/// which the compositor likes to discard
+pub const FIRST_KEYCODE: KeyCode = 9;
+/// The maximum in generated keymaps
+pub const LAST_KEYCODE: KeyCode = 255;
+/// How many keysyms fit in one keymap
+pub const KEYCODE_COUNT: usize = (LAST_KEYCODE - FIRST_KEYCODE + 1) as usize;
+
 bitflags!{
     /// Map to `virtual_keyboard.modifiers` modifiers values
     /// From https://www.x.org/releases/current/doc/kbproto/xkbproto.html#Keyboard_State
@@ -41,65 +50,82 @@ bitflags!{
     }
 }
 
+/// What a key does. Doesn't change after loading,
+/// so it can be shared between threads.
+#[derive(Debug, Clone)]
+pub struct Key {
+    /// A cache of raw keycodes derived from Action::Submit given a keymap.
+    /// Shared, so that submission can hold on to it without copying.
+    /// Empty when keycodes get assigned on demand, see ::slots.
+    pub keycodes: Arc<Vec<KeyCode>>,
+    /// Static description of what the key does when pressed or released
+    pub action: Action,
+}
+
+impl Key {
+    /// The keysyms submitted by the key, in the order of keycodes
+    pub fn get_keysyms(&self) -> Vec<&str> {
+        self.iter_keysyms().collect()
+    }
+
+    /// Like get_keysyms, but without allocating
+    pub fn iter_keysyms(&self) -> impl Iterator<Item=&str> + Clone {
+        let (keys, other): (&[KeySym], _) = match &self.action {
+            Action::Submit { text: _, keys } => (keys, None),
+            Action::Erase => (&[], Some("BackSpace")),
+            _ => (&[], None),
+        };
+        keys.iter().map(|keysym| keysym.0.as_str()).chain(other)
+    }
+}
+
+/// The position of a key in its arrangement
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct KeyId(pub usize);
+
 /// When the submitted actions of keys need to be tracked,
 /// they need a stable, comparable ID
 #[derive(Clone, PartialEq)]
 pub struct KeyStateId(*const KeyState);
 
+/// The part of a key that changes when it's used.
+/// Every layout instance has its own.
 #[derive(Debug, Clone)]
 pub struct KeyState {
     pub pressed: PressType,
-    /// A cache of raw keycodes derived from Action::Submit given a keymap
-    pub keycodes: Vec<KeyCode>,
-    /// Static description of what the key does when pressed or released
-    pub action: Action,
 }
 
 impl KeyState {
-    #[must_use]
-    pub fn into_released(self) -> KeyState {
-        KeyState {
-            pressed: PressType::Released,
-            ..self
-        }
-    }
-
-    #[must_use]
-    pub fn into_pressed(self) -> KeyState {
-        KeyState {
-            pressed: PressType::Pressed,
-            ..self
-        }
-    }
-
     /// KeyStates instances are the unique identifiers of pressed keys,
     /// and the actions submitted with them.
-    pub fn get_id(keystate: &Rc<RefCell<KeyState>>) -> KeyStateId {
-        KeyStateId(keystate.as_ptr() as *const KeyState)
+    pub fn get_id(keystate: &KeyState) -> KeyStateId {
+        KeyStateId(keystate as *const KeyState)
     }
 }
 
-/// Sorts an iterator by converting it to a Vector and back
-fn sorted<'a, I: Iterator<Item=&'a str>>(
+/// Sorts an iterator by converting it to a Vector and back,
+/// dropping repeated items
+fn sorted_unique<'a, I: Iterator<Item=&'a str>>(
     iter: I
 ) -> impl Iterator<Item=&'a str> {
     let mut v: Vec<&'a str> = iter.collect();
     v.sort();
+    v.dedup();
     v.into_iter()
 }
 
-/// Generates a mapping where each key gets a keycode, starting from ~~8~~
-/// HACK: starting from 9, because 8 results in keycode 0,
-/// which the compositor likes to discard
+/// Generates a mapping where each key gets a keycode,
+/// starting from FIRST_KEYCODE.
+/// Keycodes past LAST_KEYCODE don't fit in a keymap.
 pub fn generate_keycodes<'a, C: IntoIterator<Item=&'a str>>(
     key_names: C
 ) -> HashMap<String, u32> {
     let special_keysyms = ["BackSpace", "Return"].iter().map(|&s| s);
     HashMap::from_iter(
         // sort to remove a source of indeterminism in keycode assignment
-        sorted(key_names.into_iter().chain(special_keysyms))
+        sorted_unique(key_names.into_iter().chain(special_keysyms))
             .map(|name| String::from(name))
-            .zip(9..)
+            .zip(FIRST_KEYCODE..)
     )
 }
 
@@ -107,6 +133,8 @@ pub fn generate_keycodes<'a, C: IntoIterator<Item=&'a str>>(
 pub enum FormattingError {
     Utf(FromUtf8Error),
     Format(io::Error),
+    /// xkbcommon refused the keymap
+    Rejected,
 }
 
 impl fmt::Display for FormattingError {
@@ -114,6 +142,7 @@ impl fmt::Display for FormattingError {
         match self {
             FormattingError::Utf(e) => write!(f, "UTF: {}", e),
             FormattingError::Format(e) => write!(f, "Format: {}", e),
+            FormattingError::Rejected => write!(f, "Keymap rejected"),
         }
     }
 }
@@ -125,24 +154,19 @@ impl From<io::Error> for FormattingError {
 }
 
 /// Generates a de-facto single level keymap.
-// TODO: don't rely on keys and their order,
-// but rather on what keysyms and keycodes are in use.
-// Iterating actions makes it hard to deduplicate keysyms.
+/// The compositor gets it as it is, without a round trip through xkbcommon,
+/// so every keysym appears once, in the order of keycodes.
 pub fn generate_keymap(
-    keystates: &HashMap::<String, KeyState>
+    keys: &HashMap::<String, Key>
 ) -> Result<String, FormattingError> {
-    let mut buf: Vec<u8> = Vec::new();
-    writeln!(
-        buf,
-        "xkb_keymap {{
+    // Sorted, so that problems get reported in the same order
+    let mut keys: Vec<(&String, &Key)> = keys.iter().collect();
+    keys.sort_by(|(a, _), (b, _)| a.cmp(b));
 
-    xkb_keycodes \"squeekboard\" {{
-        minimum = 8;
-        maximum = 255;"
-    )?;
-    
-    for (name, state) in keystates.iter() {
-        match &state.action {
+    // Keys may share keysyms, and then they share keycodes too
+    let mut keysyms = BTreeMap::<KeyCode, &str>::new();
+    for (name, key) in keys.iter() {
+        match &key.action {
             Action::Submit { text: _, keys } => {
                 if let 0 = keys.len() {
                     log_print!(
@@ -150,24 +174,16 @@ pub fn generate_keymap(
                         "Key {} has no keysyms", name,
                     );
                 };
-                for (named_keysym, keycode) in keys.iter().zip(&state.keycodes) {
-                    write!(
-                        buf,
-                        "
-        <{}> = {};",
-                        named_keysym.0,
-                        keycode,
-                    )?;
+                for (named_keysym, keycode) in keys.iter().zip(key.keycodes.iter()) {
+                    keysyms.insert(*keycode, named_keysym.0.as_str());
                 }
             },
             Action::Erase => {
-                let mut keycodes = state.keycodes.iter();
-                write!(
-                    buf,
-                    "
-        <BackSpace> = {};",
-                    keycodes.next().expect("Erase key has no keycode"),
-                )?;
+                let mut keycodes = key.keycodes.iter();
+                keysyms.insert(
+                    *keycodes.next().expect("Erase key has no keycode"),
+                    "BackSpace",
+                );
                 if let Some(_) = keycodes.next() {
                     log_print!(
                         logging::Level::Bug,
@@ -178,6 +194,45 @@ pub fn generate_keymap(
             _ => {},
         }
     }
+    format_keymap(&keysyms)
+}
+
+/// Writes out a keymap where each keycode submits its keysym
+pub fn format_keymap(
+    keysyms: &BTreeMap<KeyCode, &str>,
+) -> Result<String, FormattingError> {
+    let mut buf: Vec<u8> = Vec::new();
+    write_keymap(
+        &mut buf,
+        keysyms.iter().map(|(keycode, keysym)| (*keycode, *keysym)),
+    )?;
+    //println!("{}", String::from_utf8(buf.clone()).unwrap());
+    String::from_utf8(buf).map_err(FormattingError::Utf)
+}
+
+/// Appends the keymap to `buf`, which can be reused to avoid allocating.
+/// Keycodes must come in increasing order.
+pub fn write_keymap<'a, I>(buf: &mut Vec<u8>, keysyms: I) -> io::Result<()>
+    where I: Iterator<Item=(KeyCode, &'a str)> + Clone
+{
+    writeln!(
+        buf,
+        "xkb_keymap {{
+
+    xkb_keycodes \"squeekboard\" {{
+        minimum = 8;
+        maximum = 255;"
+    )?;
+
+    for (keycode, keysym) in keysyms.clone() {
+        write!(
+            buf,
+            "
+        <{}> = {};",
+            keysym,
+            keycode,
+        )?;
+    }
     
     writeln!(
         buf,
@@ -187,22 +242,16 @@ pub fn generate_keymap(
     xkb_symbols \"squeekboard\" {{
 
         name[Group1] = \"Letters\";
-        name[Group2] = \"Numbers/Symbols\";
-        
-        key <BackSpace> {{ [ BackSpace ] }};"
+        name[Group2] = \"Numbers/Symbols\";"
     )?;
     
-    for (name, state) in keystates.iter() {
-        if let Action::Submit { text: _, keys } = &state.action {
-            for keysym in keys.iter() {
-                write!(
-                    buf,
-                    "
+    for (_keycode, keysym) in keysyms {
+        write!(
+            buf,
+            "
         key <{}> {{ [ {0} ] }};",
-                    keysym.0,
-                )?;
-            }
-        }
+            keysym,
+        )?;
     }
     writeln!(
         buf,
@@ -222,10 +271,21 @@ pub fn generate_keymap(
     xkb_compatibility \"squeekboard\" {{
     }};
 }};"
-    )?;
-    
-    //println!("{}", String::from_utf8(buf.clone()).unwrap());
-    String::from_utf8(buf).map_err(FormattingError::Utf)
+    )
+}
+
+/// Makes sure that the compositor will accept the keymap.
+/// Done when compiling layouts, so that using them needs no xkbcommon.
+pub fn check_keymap(keymap_str: &str) -> Result<(), FormattingError> {
+    let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+    xkb::Keymap::new_from_string(
+        &context,
+        keymap_str.into(),
+        xkb::KEYMAP_FORMAT_TEXT_V1,
+        xkb::KEYMAP_COMPILE_NO_FLAGS,
+    )
+        .map(|_keymap| ())
+        .ok_or(FormattingError::Rejected)
 }
 
 #[cfg(test)]
@@ -241,13 +301,12 @@ mod tests {
         let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
 
         let keymap_str = generate_keymap(&hashmap!{
-            "ac".into() => KeyState {
+            "ac".into() => Key {
                 action: Action::Submit {
                     text: None,
                     keys: vec!(KeySym("a".into()), KeySym("c".into())),
                 },
-                keycodes: vec!(9, 10),
-                pressed: PressType::Released,
+                keycodes: Arc::new(vec!(9, 10)),
             },
         }).unwrap();
 
@@ -263,4 +322,27 @@ mod tests {
         assert_eq!(state.key_get_one_sym(9), xkb::KEY_a);
         assert_eq!(state.key_get_one_sym(10), xkb::KEY_c);
     }
+    /// Keys sharing a keysym share the keycode
+    #[test]
+    fn keymap_dedup() {
+        let key = |keysym: &str, keycode| Key {
+            action: Action::Submit {
+                text: None,
+                keys: vec!(KeySym(keysym.into())),
+            },
+            keycodes: Arc::new(vec!(keycode)),
+        };
+        let keymap_str = generate_keymap(&hashmap!{
+            "a".into() => key("a", 9),
+            "also_a".into() => key("a", 9),
+            "BackSpace".into() => Key {
+                action: Action::Erase,
+                keycodes: Arc::new(vec!(10)),
+            },
+        }).unwrap();
+        assert_eq!(keymap_str.matches("<a> = 9;").count(), 1);
+        assert_eq!(keymap_str.matches("key <a>").count(), 1);
+        assert_eq!(keymap_str.matches("key <BackSpace>").count(), 1);
+        check_keymap(&keymap_str).unwrap();
+    }
 }
@@ -38,10 +38,36 @@ struct transformation squeek_layout_calculate_transformation(
         const struct squeek_layout *layout,
         double allocation_width, double allocation_size);
 
-struct squeek_layout *squeek_load_layout(const char *name, uint32_t type);
+/// Keeps track of the user's layout files
+struct squeek_layout_watcher;
+struct squeek_layout_watcher *squeek_layout_watcher_new(void);
+void squeek_layout_watcher_free(struct squeek_layout_watcher *watcher);
+int squeek_layout_watcher_get_fd(const struct squeek_layout_watcher *watcher);
+uint32_t squeek_layout_watcher_dispatch(const struct squeek_layout_watcher *watcher);
+
+/// Keymap shared between layouts, to avoid sending new ones
+struct squeek_keymap_superset;
+struct squeek_keymap_superset *squeek_keymap_superset_new(void);
+void squeek_keymap_superset_free(struct squeek_keymap_superset *superset);
+
+/// The watcher and the superset may be NULL
+struct squeek_layout *squeek_load_layout(const char *name, uint32_t type,
+                                         const struct squeek_layout_watcher *watcher,
+                                         const struct squeek_keymap_superset *superset);
+/// A layout loaded off the main thread, not yet usable
+struct squeek_prepared_layout;
+struct squeek_prepared_layout *squeek_prepare_layout(const char *name, uint32_t type,
+                                                     const struct squeek_layout_watcher *watcher,
+                                                     const struct squeek_keymap_superset *superset);
+const char *squeek_prepared_layout_get_keymap(const struct squeek_prepared_layout *prepared);
+struct squeek_layout *squeek_layout_from_prepared(struct squeek_prepared_layout *prepared);
+void squeek_prepared_layout_free(struct squeek_prepared_layout *prepared);
 const char *squeek_layout_get_keymap(const struct squeek_layout*);
 enum squeek_arrangement_kind squeek_layout_get_kind(const struct squeek_layout *);
 void squeek_layout_free(struct squeek_layout*);
+void squeek_layout_suspend(struct squeek_layout*);
+void squeek_layout_save_learned(struct squeek_layout*);
+void squeek_layout_reset(struct squeek_layout*);
 
 void squeek_layout_release(struct squeek_layout *layout,
                            struct submission *submission,
@@ -57,6 +83,11 @@ void squeek_layout_depress(struct squeek_layout *layout,
                            double x_widget, double y_widget,
                            struct transformation widget_to_layout,
                            uint32_t timestamp, EekGtkKeyboard *ui_keyboard);
+uint32_t squeek_layout_is_repeating(struct squeek_layout *layout);
+uint32_t squeek_layout_repeat(struct squeek_layout *layout,
+                              struct submission *submission,
+                              uint32_t delay_ms, uint32_t interval_ms,
+                              uint32_t timestamp);
 void squeek_layout_drag(struct squeek_layout *layout,
                         struct submission *submission,
                         double x_widget, double y_widget,
@@ -15,27 +15,34 @@
  * Note that it might be a better idea
  * to make `View` position depend on its contents,
  * and let the renderer scale and center it within the widget.
+ *
+ * All of that, together with what the keys do, is the `Arrangement`.
+ * It never changes once built, so it's shared, also between threads.
+ * What changes when the keyboard is used lives in the `Layout`.
+ * Buttons refer to keys by `KeyId`, which indexes both.
  */
 
 use std::cell::RefCell;
-use std::collections::{ HashMap, HashSet };
+use std::collections::HashMap;
 use std::ffi::CString;
 use std::fmt;
 use std::rc::Rc;
+use std::sync::Arc;
+use std::time::Instant;
 use std::vec::Vec;
 
 use ::action::Action;
 use ::drawing;
-use ::keyboard::KeyState;
+use ::gesture;
+use ::keyboard::{ Key, KeyId, KeyState, KeyStateId, PressType };
 use ::logging;
 use ::manager;
+use ::repeat;
+use ::spatial;
 use ::submission::{ Submission, SubmitData, Timestamp };
+use ::superset::Generation;
 use ::util::find_max_double;
 
-// Traits
-use std::borrow::Borrow;
-use ::logging::Warn;
-
 /// Gathers stuff defined in C or called by C
 pub mod c {
     use super::*;
@@ -241,7 +248,7 @@ pub mod c {
     pub extern "C"
     fn squeek_layout_get_keymap(layout: *const Layout) -> *const c_char {
         let layout = unsafe { &*layout };
-        layout.keymap_str.as_ptr()
+        layout.arrangement.keymap_str.as_ptr()
     }
 
     #[no_mangle]
@@ -254,13 +261,41 @@ pub mod c {
     #[no_mangle]
     pub extern "C"
     fn squeek_layout_free(layout: *mut Layout) {
-        unsafe { Box::from_raw(layout) };
+        let layout = unsafe { Box::from_raw(layout) };
+        layout.touch_model.borrow_mut().save();
+    }
+
+    /// Saves what the layout learned, before it's set aside for reuse
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_suspend(layout: *mut Layout) {
+        let layout = unsafe { &mut *layout };
+        layout.touch_model.borrow_mut().save();
+    }
+
+    /// Saves what the layout learned, if there's enough of it.
+    /// Called when the keyboard is idle.
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_save_learned(layout: *mut Layout) {
+        let layout = unsafe { &mut *layout };
+        layout.touch_model.borrow_mut().save_if_due();
+    }
+
+    /// Prepares a layout which was set aside to be used again
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_reset(layout: *mut Layout) {
+        let layout = unsafe { &mut *layout };
+        layout.reset();
     }
 
     /// Entry points for more complex procedures and algorithms which span multiple modules
     pub mod procedures {
         use super::*;
 
+        use std::time::Duration;
+
         /// Release pointer in the specified position
         #[no_mangle]
         pub extern "C"
@@ -280,22 +315,52 @@ pub mod c {
                 keyboard: ui_keyboard,
             };
 
-            // The list must be copied,
-            // because it will be mutated in the loop
-            for key in layout.pressed_keys.clone() {
-                let key: &Rc<RefCell<KeyState>> = key.borrow();
-                seat::handle_release_key(
-                    layout,
-                    submission,
-                    Some(&ui_backend),
-                    time,
-                    Some(manager),
-                    key,
-                );
-            }
+            seat::handle_stroke_end(layout, submission);
+            seat::release_all_except(
+                layout,
+                submission,
+                Some(&ui_backend),
+                time,
+                Some(manager),
+                None,
+            );
             drawing::queue_redraw(ui_keyboard);
         }
 
+        /// Submits the held key again if it's time.
+        /// Returns 0 when there's no key to repeat any more.
+        #[no_mangle]
+        pub extern "C"
+        fn squeek_layout_repeat(
+            layout: *mut Layout,
+            submission: *mut Submission,
+            delay_ms: u32,
+            interval_ms: u32,
+            time: u32,
+        ) -> u32 {
+            let layout = unsafe { &mut *layout };
+            let submission = unsafe { &mut *submission };
+            let settings = repeat::Settings {
+                delay: Duration::from_millis(delay_ms as u64),
+                interval: Duration::from_millis(interval_ms as u64),
+            };
+            seat::handle_repeat(
+                layout,
+                submission,
+                &settings,
+                Instant::now(),
+                Timestamp(time),
+            ) as u32
+        }
+
+        /// Returns whether a held key needs `squeek_layout_repeat`
+        #[no_mangle]
+        pub extern "C"
+        fn squeek_layout_is_repeating(layout: *const Layout) -> u32 {
+            let layout = unsafe { &*layout };
+            layout.repeating.is_some() as u32
+        }
+
         /// Release all buttons but don't redraw
         #[no_mangle]
         pub extern "C"
@@ -306,19 +371,15 @@ pub mod c {
         ) {
             let layout = unsafe { &mut *layout };
             let submission = unsafe { &mut *submission };
-            // The list must be copied,
-            // because it will be mutated in the loop
-            for key in layout.pressed_keys.clone() {
-                let key: &Rc<RefCell<KeyState>> = key.borrow();
-                seat::handle_release_key(
-                    layout,
-                    submission,
-                    None, // don't update UI
-                    Timestamp(time),
-                    None, // don't switch layouts
-                    &mut key.clone(),
-                );
-            }
+            layout.stroke.reset();
+            seat::release_all_except(
+                layout,
+                submission,
+                None, // don't update UI
+                Timestamp(time),
+                None, // don't switch layouts
+                None,
+            );
         }
 
         #[no_mangle]
@@ -337,15 +398,15 @@ pub mod c {
                 Point { x: x_widget, y: y_widget }
             );
 
-            let state = layout.find_button_by_position(point)
-                .map(|place| place.button.state.clone());
-            
-            if let Some(state) = state {
+            let key = seat::handle_touch(layout, point.clone());
+
+            if let Some(key) = key {
+                seat::handle_stroke_start(layout, point, key);
                 seat::handle_press_key(
                     layout,
                     submission,
                     Timestamp(time),
-                    &state,
+                    key,
                 );
                 // maybe TODO: draw on the display buffer here
                 drawing::queue_redraw(ui_keyboard);
@@ -379,40 +440,39 @@ pub mod c {
             let point = ui_backend.widget_to_layout.forward(
                 Point { x: x_widget, y: y_widget }
             );
-            
-            let pressed = layout.pressed_keys.clone();
-            let button_info = {
-                let place = layout.find_button_by_position(point);
-                place.map(|place| {(
-                    place.button.state.clone(),
-                    place.button.clone(),
-                    place.offset,
-                )})
-            };
 
-            if let Some((state, _button, _view_position)) = button_info {
-                let mut found = false;
-                for wrapped_key in pressed {
-                    let key: &Rc<RefCell<KeyState>> = wrapped_key.borrow();
-                    if Rc::ptr_eq(&state, &wrapped_key.0) {
-                        found = true;
-                    } else {
-                        seat::handle_release_key(
-                            layout,
-                            submission,
-                            Some(&ui_backend),
-                            time,
-                            Some(manager),
-                            key,
-                        );
-                    }
-                }
+            let is_gesture = seat::handle_stroke_drag(
+                layout,
+                submission,
+                Some(&ui_backend),
+                time,
+                Some(manager),
+                point.clone(),
+            );
+            if is_gesture {
+                drawing::queue_redraw(ui_keyboard);
+                return;
+            }
+
+            let key = layout.find_button_by_position(point)
+                .map(|place| place.button.key);
+
+            if let Some(key) = key {
+                let found = layout.pressed_keys.contains(&key);
+                seat::release_all_except(
+                    layout,
+                    submission,
+                    Some(&ui_backend),
+                    time,
+                    Some(manager),
+                    Some(key),
+                );
                 if !found {
                     seat::handle_press_key(
                         layout,
                         submission,
                         time,
-                        &state,
+                        key,
                     );
                     // maybe TODO: draw on the display buffer here
                     unsafe {
@@ -420,17 +480,14 @@ pub mod c {
                     }
                 }
             } else {
-                for wrapped_key in pressed {
-                    let key: &Rc<RefCell<KeyState>> = wrapped_key.borrow();
-                    seat::handle_release_key(
-                        layout,
-                        submission,
-                        Some(&ui_backend),
-                        time,
-                        Some(manager),
-                        key,
-                    );
-                }
+                seat::release_all_except(
+                    layout,
+                    submission,
+                    Some(&ui_backend),
+                    time,
+                    Some(manager),
+                    None,
+                );
             }
             drawing::queue_redraw(ui_keyboard);
         }
@@ -460,8 +517,8 @@ pub mod c {
 }
 
 pub struct ButtonPlace<'a> {
-    button: &'a Button,
-    offset: c::Point,
+    pub button: &'a Button,
+    pub offset: c::Point,
 }
 
 #[derive(Debug, Clone, PartialEq)]
@@ -488,8 +545,8 @@ pub struct Button {
     pub size: Size,
     /// The name of the visual class applied
     pub outline_name: CString,
-    /// current state, shared with other buttons
-    pub state: Rc<RefCell<KeyState>>,
+    /// The key the button belongs to, shared with other buttons
+    pub key: KeyId,
 }
 
 /// The graphical representation of a row of buttons
@@ -548,10 +605,10 @@ impl View {
     fn find_button_by_position(&self, point: c::Point)
         -> Option<ButtonPlace>
     {
-        self.get_rows().iter().find_map(|(row_offset, row)| {
+        self.get_rows().find_map(|(row_offset, row)| {
             // make point relative to the inside of the row
             row.find_button_by_position({
-                c::Point { x: point.x, y: point.y } - row_offset
+                c::Point { x: point.x, y: point.y } - &row_offset
             }).map(|(button_x_offset, button)| ButtonPlace {
                 button,
                 offset: row_offset + c::Point {
@@ -576,15 +633,15 @@ impl View {
     }
     
     /// Returns positioned rows, with appropriate x offsets (centered)
-    pub fn get_rows(&self) -> Vec<(c::Point, &Row)> {
+    pub fn get_rows(&self) -> impl Iterator<Item=(c::Point, &Row)> {
         let available_width = self.get_width();
-        self.rows.iter().map(|(y_offset, row)| {(
+        self.rows.iter().map(move |(y_offset, row)| {(
             c::Point {
                 x: (available_width - row.get_width()) / 2.0,
                 y: *y_offset,
             },
             row,
-        )}).collect()
+        )})
     }
 
     /// Returns a size which contains all the views
@@ -618,82 +675,39 @@ pub struct Margins {
     pub right: f64,
 }
 
-// TODO: split into sth like
-// Arrangement (views) + details (keymap) + State (keys)
-/// State of the UI, contains the backend as well
-pub struct Layout {
-    pub margins: Margins,
-    pub kind: ArrangementKind,
-    pub current_view: String,
-    // Views own the actual buttons which have state
-    // Maybe they should own UI only,
-    // and keys should be owned by a dedicated non-UI-State?
-    /// Point is the offset within the layout
-    pub views: HashMap<String, (c::Point, View)>,
-
-    // Non-UI stuff
-    /// xkb keymap applicable to the contained keys. Unchangeable
-    pub keymap_str: CString,
-    // Changeable state
-    // a Vec would be enough, but who cares, this will be small & fast enough
-    // TODO: turn those into per-input point *_buttons to track dragging.
-    // The renderer doesn't need the list of pressed keys any more,
-    // because it needs to iterate
-    // through all buttons of the current view anyway.
-    // When the list tracks actual location,
-    // it becomes possible to place popovers and other UI accurately.
-    pub pressed_keys: HashSet<::util::Pointer<RefCell<KeyState>>>,
+/// Where the keycodes of the keys come from
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum KeymapKind {
+    /// The keymap compiled with the layout
+    Own,
+    /// The keymap shared between layouts, see ::superset
+    Shared(Generation),
+    /// Too many keysyms for a keymap.
+    /// Keys get keycodes when pressed, see ::slots
+    OnDemand,
 }
 
-/// A builder structure for picking up layout data from storage
-pub struct LayoutData {
+/// Enough for all fingers.
+/// Pressing more keys at the same time allocates.
+const MAX_PRESSED_KEYS: usize = 10;
+
+/// The part of the layout which doesn't change once built:
+/// what the keys do, and where the buttons are.
+/// Shareable between layout instances and threads.
+pub struct Arrangement {
     /// Point is the offset within layout
     pub views: HashMap<String, (c::Point, View)>,
+    /// xkb keymap applicable to the contained keys
     pub keymap_str: CString,
+    pub keymap_kind: KeymapKind,
     pub margins: Margins,
+    /// Indexed by KeyId
+    pub keys: Vec<Key>,
 }
 
-#[derive(Debug)]
-struct NoSuchView;
-
-impl fmt::Display for NoSuchView {
-    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
-        write!(f, "No such view")
-    }
-}
-
-// Unfortunately, changes are not atomic due to mutability :(
-// An error will not be recoverable
-// The usage of &mut on Rc<RefCell<KeyState>> doesn't mean anything special.
-// Cloning could also be used.
-impl Layout {
-    pub fn new(data: LayoutData, kind: ArrangementKind) -> Layout {
-        Layout {
-            kind,
-            current_view: "base".to_owned(),
-            views: data.views,
-            keymap_str: data.keymap_str,
-            pressed_keys: HashSet::new(),
-            margins: data.margins,
-        }
-    }
-
-    pub fn get_current_view_position(&self) -> &(c::Point, View) {
-        &self.views
-            .get(&self.current_view).expect("Selected nonexistent view")
-    }
-
-    pub fn get_current_view(&self) -> &View {
-        &self.views.get(&self.current_view).expect("Selected nonexistent view").1
-    }
-
-    fn set_view(&mut self, view: String) -> Result<(), NoSuchView> {
-        if self.views.contains_key(&view) {
-            self.current_view = view;
-            Ok(())
-        } else {
-            Err(NoSuchView)
-        }
+impl Arrangement {
+    pub fn get_key(&self, key: KeyId) -> &Key {
+        &self.keys[key.0]
     }
 
     /// Calculates size without margins
@@ -735,17 +749,186 @@ impl Layout {
             scale: 1.0,
         })
     }
+}
+
+/// State of the UI, contains the backend as well
+pub struct Layout {
+    pub kind: ArrangementKind,
+    /// Has enough capacity for the longest view name,
+    /// so that switching views doesn't allocate
+    pub current_view: String,
+    pub arrangement: Arc<Arrangement>,
+
+    // Changeable state
+    /// Indexed by KeyId. Never resized,
+    /// because the addresses of its items identify pressed keys.
+    key_states: Vec<KeyState>,
+    // A Vec is enough, it never holds more than a handful of keys.
+    // Its capacity is kept, so pressing keys doesn't allocate.
+    // TODO: turn those into per-input point *_buttons to track dragging.
+    // The renderer doesn't need the list of pressed keys any more,
+    // because it needs to iterate
+    // through all buttons of the current view anyway.
+    // When the list tracks actual location,
+    // it becomes possible to place popovers and other UI accurately.
+    pub pressed_keys: Vec<KeyId>,
+    /// The last pressed key, if it submits something and is still held
+    pub repeating: Option<(KeyId, repeat::Timer)>,
+    pub stroke: gesture::Stroke,
+    /// Knows every button name in the layout.
+    /// Shared with other layouts.
+    pub touch_model: spatial::Shared,
+}
+
+#[derive(Debug)]
+struct NoSuchView;
+
+impl fmt::Display for NoSuchView {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "No such view")
+    }
+}
+
+/// Lets the model learn every button, without allocating later
+fn add_touch_keys(model: &mut spatial::Model, arrangement: &Arrangement) {
+    for (_offset, view) in arrangement.views.values() {
+        for (_offset, row) in view.get_rows() {
+            for (_offset, button) in &row.buttons {
+                model.add_key(&button.name);
+            }
+        }
+    }
+}
 
-    fn find_button_by_position(&self, point: c::Point) -> Option<ButtonPlace> {
+impl Layout {
+    pub fn new(arrangement: Arc<Arrangement>, kind: ArrangementKind)
+        -> Layout
+    {
+        let longest_view_name = arrangement.views.keys()
+            .map(String::len)
+            .max()
+            .unwrap_or(0);
+        let mut current_view = String::with_capacity(longest_view_name);
+        current_view.push_str("base");
+        let mut touch_model = spatial::Model::new();
+        add_touch_keys(&mut touch_model, &arrangement);
+        Layout {
+            kind,
+            current_view,
+            key_states: vec![
+                KeyState { pressed: PressType::Released };
+                arrangement.keys.len()
+            ],
+            arrangement,
+            pressed_keys: Vec::with_capacity(MAX_PRESSED_KEYS),
+            repeating: None,
+            stroke: gesture::Stroke::new(),
+            touch_model: Rc::new(RefCell::new(touch_model)),
+        }
+    }
+
+    /// Learns into `model` from now on.
+    /// Used to share one model between layouts.
+    pub fn set_touch_model(&mut self, model: spatial::Shared) {
+        add_touch_keys(&mut model.borrow_mut(), &self.arrangement);
+        self.touch_model = model;
+    }
+
+    pub fn get_key(&self, key: KeyId) -> &Key {
+        self.arrangement.get_key(key)
+    }
+
+    pub fn get_key_state(&self, key: KeyId) -> &KeyState {
+        &self.key_states[key.0]
+    }
+
+    /// Identifies the key in this instance of the layout
+    pub fn get_key_state_id(&self, key: KeyId) -> KeyStateId {
+        KeyState::get_id(self.get_key_state(key))
+    }
+
+    pub fn get_current_view_position(&self) -> &(c::Point, View) {
+        &self.arrangement.views
+            .get(&self.current_view).expect("Selected nonexistent view")
+    }
+
+    pub fn get_current_view(&self) -> &View {
+        &self.get_current_view_position().1
+    }
+
+    fn set_view(&mut self, view: &str) -> Result<(), NoSuchView> {
+        if self.arrangement.views.contains_key(view) {
+            self.current_view.clear();
+            self.current_view.push_str(view);
+            Ok(())
+        } else {
+            Err(NoSuchView)
+        }
+    }
+
+    /// Returns to the state right after loading:
+    /// nothing pressed, and the base view.
+    /// Nothing gets submitted, the keys are just forgotten.
+    pub fn reset(&mut self) {
+        for state in self.key_states.iter_mut() {
+            state.pressed = PressType::Released;
+        }
+        self.pressed_keys.clear();
+        self.repeating = None;
+        self.stroke.reset();
+        self.current_view.clear();
+        self.current_view.push_str("base");
+    }
+
+    pub fn calculate_transformation(
+        &self,
+        available: Size,
+    ) -> c::Transformation {
+        self.arrangement.calculate_transformation(available)
+    }
+
+    pub fn find_button_by_position(&self, point: c::Point)
+        -> Option<ButtonPlace>
+    {
         let (offset, layout) = self.get_current_view_position();
         layout.find_button_by_position(point - offset)
     }
 
+    /// Finds the button the touch was most likely aimed at,
+    /// according to what was learned about the user's touches
+    pub fn find_button_by_touch(&self, point: c::Point)
+        -> Option<ButtonPlace>
+    {
+        let (offset, view) = self.get_current_view_position();
+        let point = point - offset;
+        let under = view.find_button_by_position(point.clone())
+            .map(|place| place.button as *const Button);
+        let candidates = view.get_rows()
+            .flat_map(|(row_offset, row)| {
+                row.buttons.iter().map(move |(x_offset, button)| {
+                    let offset = row_offset.clone() + c::Point {
+                        x: *x_offset,
+                        y: 0.0,
+                    };
+                    let button: &Button = button;
+                    (
+                        button.name.as_c_str(),
+                        offset.clone(),
+                        &button.size,
+                        under == Some(button as *const Button),
+                        ButtonPlace { button, offset },
+                    )
+                })
+            });
+        let touch_model = self.touch_model.borrow();
+        touch_model.resolve(&point, candidates)
+    }
+
     pub fn foreach_visible_button<F>(&self, mut f: F)
         where F: FnMut(c::Point, &Box<Button>)
     {
         let (view_offset, view) = self.get_current_view_position();
-        for (row_offset, row) in &view.get_rows() {
+        for (row_offset, row) in view.get_rows() {
             for (x_offset, button) in &row.buttons {
                 let offset = view_offset
                     + row_offset.clone()
@@ -755,21 +938,15 @@ impl Layout {
         }
     }
 
-    pub fn get_locked_keys(&self) -> Vec<Rc<RefCell<KeyState>>> {
-        let mut out = Vec::new();
-        let view = self.get_current_view();
-        for (_, row) in &view.get_rows() {
-            for (_, button) in &row.buttons {
-                let locked = {
-                    let state = RefCell::borrow(&button.state).clone();
-                    state.action.is_locked(&self.current_view)
-                };
-                if locked {
-                    out.push(button.state.clone());
-                }
-            }
-        }
-        out
+    /// Returns the last of the keys locked in the current view
+    fn find_locked_key(&self) -> Option<KeyId> {
+        self.get_current_view().get_rows()
+            .flat_map(|(_offset, row)| row.buttons.iter())
+            .map(|(_offset, button)| button.key)
+            .filter(|key| {
+                self.get_key(*key).action.is_locked(&self.current_view)
+            })
+            .last()
     }
 }
 
@@ -778,25 +955,25 @@ mod procedures {
 
     type Place<'v> = (c::Point, &'v Box<Button>);
 
-    /// Finds all buttons referring to the key in `state`,
+    /// Finds all buttons referring to the key,
     /// together with their offsets within the view.
-    pub fn find_key_places<'v, 's>(
-        view: &'v View,
-        state: &'s Rc<RefCell<KeyState>>
-    ) -> Vec<Place<'v>> {
-        view.get_rows().iter().flat_map(|(row_offset, row)| {
+    pub fn find_key_places<'a>(
+        view: &'a View,
+        key: KeyId,
+    ) -> impl Iterator<Item=Place<'a>> + 'a {
+        view.get_rows().flat_map(move |(row_offset, row)| {
             row.buttons.iter()
                 .filter_map(move |(x_offset, button)| {
-                    if Rc::ptr_eq(&button.state, state) {
+                    if button.key == key {
                         Some((
-                            row_offset + c::Point { x: *x_offset, y: 0.0 },
+                            &row_offset + c::Point { x: *x_offset, y: 0.0 },
                             button,
                         ))
                     } else {
                         None
                     }
                 })
-        }).collect()
+        })
     }
     
     #[cfg(test)]
@@ -814,10 +991,7 @@ mod procedures {
                 v.as_ref() as *const T
             }
 
-            let state = make_state();
-            let state_clone = state.clone();
-
-            let button = make_button_with_state("1".into(), state);
+            let button = make_button_with_key("1".into(), KeyId(0));
             let button_ptr = as_ptr(&button);
 
             let row = Row {
@@ -829,7 +1003,7 @@ mod procedures {
             };
 
             assert_eq!(
-                find_key_places(&view, &state_clone.clone()).into_iter()
+                find_key_places(&view, KeyId(0))
                     .map(|(place, button)| { (place, as_ptr(button)) })
                     .collect::<Vec<_>>(),
                 vec!(
@@ -841,7 +1015,7 @@ mod procedures {
                 rows: Vec::new(),
             };
             assert_eq!(
-                find_key_places(&view, &state_clone.clone()).is_empty(),
+                find_key_places(&view, KeyId(0)).next().is_none(),
                 true
             );
         }
@@ -854,114 +1028,123 @@ pub struct UIBackend {
 }
 
 /// Top level procedures, dispatching to everything
-mod seat {
+pub mod seat {
     use super::*;
 
-    fn try_set_view(layout: &mut Layout, view_name: String) {
-        layout.set_view(view_name.clone())
-            .or_print(
-                logging::Problem::Bug,
-                &format!("Bad view {}, ignoring", view_name),
-            );
-    }
+    use ::util::vec_remove;
 
-    /// A vessel holding an obligation to switch view.
-    /// Use with #[must_use]
-    struct ViewChange<'a> {
-        layout: &'a mut Layout,
-        view_name: Option<String>,
-    }
-    
-    impl<'a> ViewChange<'a> {
-        fn choose_view(self, view_name: String) -> ViewChange<'a> {
-            ViewChange {
-                view_name: Some(view_name),
-                ..self
-            }
-        }
-        fn apply(self) {
-            if let Some(name) = self.view_name {
-                try_set_view(self.layout, name);
-            }
+    fn try_set_view(layout: &mut Layout, view_name: &str) {
+        // Not using or_print, which would format the message up front
+        if let Err(e) = layout.set_view(view_name) {
+            log_print!(
+                logging::Level::Bug,
+                "Bad view {}, ignoring: {}", view_name, e,
+            );
         }
     }
 
     /// Find all impermanent view changes and undo them in an arbitrary order.
-    /// Return an obligation to actually switch the view.
     /// The final view is the "unlock" view
     /// from one of the currently stuck keys.
     // As long as only one stuck button is used, this should be fine.
     // This is guaranteed because pressing a lock button unlocks all others.
     // TODO: Make some broader guarantee about the resulting view,
     // e.g. by maintaining a stack of stuck keys.
-    #[must_use]
-    fn unstick_locks(layout: &mut Layout) -> ViewChange {
-        let mut new_view = None;
-        for key in layout.get_locked_keys().clone() {
-            let key: &Rc<RefCell<KeyState>> = key.borrow();
-            let key = RefCell::borrow(key);
-            match &key.action {
-                Action::LockView { lock: _, unlock: view } => {
-                    new_view = Some(view.clone());
-                },
-                a => log_print!(
-                    logging::Level::Bug,
-                    "Non-locking action {:?} was found inside locked keys",
-                    a,
-                ),
-            };
-        }
-        
-        ViewChange {
-            layout,
-            view_name: new_view,
+    fn unstick_locks(layout: &mut Layout) {
+        let key = match layout.find_locked_key() {
+            Some(key) => key,
+            None => return,
+        };
+        // Keeps the key alive while the layout changes
+        let arrangement = layout.arrangement.clone();
+        match &arrangement.get_key(key).action {
+            Action::LockView { lock: _, unlock: view } => {
+                try_set_view(layout, view);
+            },
+            a => log_print!(
+                logging::Level::Bug,
+                "Non-locking action {:?} was found inside locked keys",
+                a,
+            ),
+        };
+    }
+
+    fn get_submit_data(action: &Action) -> Option<SubmitData> {
+        match action {
+            Action::Submit { text: Some(text), keys: _ } => {
+                Some(SubmitData::Text(text))
+            },
+            Action::Submit { text: None, keys: _ } => Some(SubmitData::Keycodes),
+            Action::Erase => Some(SubmitData::Erase),
+            _ => None,
         }
     }
 
+    /// Finds the key being touched,
+    /// and keeps the touch to learn from it if the keystroke is accepted
+    pub fn handle_touch(layout: &mut Layout, point: c::Point)
+        -> Option<KeyId>
+    {
+        let found = {
+            let view_offset = &layout.get_current_view_position().0;
+            layout.find_button_by_touch(point.clone()).map(|place| {
+                let button = place.button;
+                let is_erase = match layout.get_key(button.key).action {
+                    Action::Erase => true,
+                    _ => false,
+                };
+                (
+                    button.key,
+                    layout.touch_model.borrow().find(&button.name),
+                    spatial::get_relative(
+                        &point,
+                        &(view_offset + place.offset),
+                        &button.size,
+                    ),
+                    is_erase,
+                )
+            })
+        };
+        found.map(|(key, id, position, is_erase)| {
+            layout.touch_model.borrow_mut()
+                .handle_touch(id, position, is_erase);
+            key
+        })
+    }
+
     pub fn handle_press_key(
         layout: &mut Layout,
         submission: &mut Submission,
         time: Timestamp,
-        rckey: &Rc<RefCell<KeyState>>,
+        key: KeyId,
     ) {
-        if !layout.pressed_keys.insert(::util::Pointer(rckey.clone())) {
+        if layout.pressed_keys.contains(&key) {
             log_print!(
                 logging::Level::Bug,
-                "Key {:?} was already pressed", rckey,
+                "Key {:?} was already pressed", layout.get_key(key),
             );
+        } else {
+            layout.pressed_keys.push(key);
         }
-        let key: KeyState = {
-            RefCell::borrow(rckey).clone()
-        };
-        let action = key.action.clone();
-        match action {
-            Action::Submit {
-                text: Some(text),
-                keys: _,
-            } => submission.handle_press(
-                KeyState::get_id(rckey),
-                SubmitData::Text(&text),
-                &key.keycodes,
-                time,
-            ),
-            Action::Submit {
-                text: None,
-                keys: _,
-            } => submission.handle_press(
-                KeyState::get_id(rckey),
-                SubmitData::Keycodes,
-                &key.keycodes,
-                time,
-            ),
-            Action::Erase => submission.handle_press(
-                KeyState::get_id(rckey),
-                SubmitData::Erase,
-                &key.keycodes,
-                time,
-            ),
-            _ => {},
+        let repeats = {
+            let key_def = layout.get_key(key);
+            match get_submit_data(&key_def.action) {
+                Some(data) => submission.handle_press(
+                    layout.get_key_state_id(key),
+                    data,
+                    key_def,
+                    time,
+                ),
+                None => false,
+            }
         };
-        RefCell::replace(rckey, key.into_pressed());
+        if repeats {
+            layout.repeating = Some((
+                key,
+                repeat::Timer::new(Instant::now()),
+            ));
+        }
+        layout.key_states[key.0].pressed = PressType::Pressed;
     }
 
     pub fn handle_release_key(
@@ -970,85 +1153,227 @@ mod seat {
         ui: Option<&UIBackend>,
         time: Timestamp,
         manager: Option<manager::c::Manager>,
-        rckey: &Rc<RefCell<KeyState>>,
+        key: KeyId,
     ) {
-        let key: KeyState = {
-            RefCell::borrow(rckey).clone()
-        };
-        let action = key.action.clone();
-
-        // update
-        let key = key.into_released();
-
-        // process changes
-        match action {
-            Action::Submit { text: _, keys: _ }
-                | Action::Erase
-            => {
-                unstick_locks(layout).apply();
-                submission.handle_release(KeyState::get_id(rckey), time);
-            },
-            Action::SetView(view) => {
-                try_set_view(layout, view)
-            },
-            Action::LockView { lock, unlock } => {
-                let gets_locked = !key.action.is_locked(&layout.current_view);
-                unstick_locks(layout)
-                    // It doesn't matter what the resulting view should be,
-                    // it's getting changed anyway.
-                    .choose_view(
+        {
+            let key_id = layout.get_key_state_id(key);
+            // Keeps the key alive while the layout changes
+            let arrangement = layout.arrangement.clone();
+            let key_def = arrangement.get_key(key);
+            // process changes
+            match &key_def.action {
+                Action::Submit { text: _, keys: _ }
+                    | Action::Erase
+                => {
+                    unstick_locks(layout);
+                    submission.handle_release(key_id, time);
+                },
+                Action::SetView(view) => {
+                    try_set_view(layout, view)
+                },
+                Action::LockView { lock, unlock } => {
+                    let gets_locked
+                        = !key_def.action.is_locked(&layout.current_view);
+                    // Other locks don't need to be unstuck,
+                    // the view is getting changed anyway.
+                    try_set_view(
+                        layout,
                         match gets_locked {
-                            true => lock.clone(),
-                            false => unlock.clone(),
-                        }
+                            true => lock,
+                            false => unlock,
+                        },
                     )
-                    .apply()
-            },
-            Action::ApplyModifier(modifier) => {
-                // FIXME: key id is unneeded with stateless locks
-                let key_id = KeyState::get_id(rckey);
-                let gets_locked = !submission.is_modifier_active(modifier.clone());
-                match gets_locked {
-                    true => submission.handle_add_modifier(
-                        key_id,
-                        modifier, time,
-                    ),
-                    false => submission.handle_drop_modifier(key_id, time),
+                },
+                Action::ApplyModifier(modifier) => {
+                    // FIXME: key id is unneeded with stateless locks
+                    let gets_locked = !submission.is_modifier_active(modifier.clone());
+                    match gets_locked {
+                        true => submission.handle_add_modifier(
+                            key_id,
+                            modifier.clone(), time,
+                        ),
+                        false => submission.handle_drop_modifier(key_id, time),
+                    }
                 }
-            }
-            // only show when UI is present
-            Action::ShowPreferences => if let Some(ui) = &ui {
-                // only show when layout manager is available
-                if let Some(manager) = manager {
-                    let view = layout.get_current_view();
-                    let places = ::layout::procedures::find_key_places(
-                        view, &rckey,
-                    );
-                    // Getting first item will cause mispositioning
-                    // with more than one button with the same key
-                    // on the keyboard.
-                    if let Some((position, button)) = places.get(0) {
-                        let bounds = c::Bounds {
-                            x: position.x,
-                            y: position.y,
-                            width: button.size.width,
-                            height: button.size.height,
-                        };
-                        ::popover::show(
-                            ui.keyboard,
-                            ui.widget_to_layout.reverse_bounds(bounds),
-                            manager,
+                // only show when UI is present
+                Action::ShowPreferences => if let Some(ui) = &ui {
+                    // only show when layout manager is available
+                    if let Some(manager) = manager {
+                        let view = layout.get_current_view();
+                        let mut places = ::layout::procedures::find_key_places(
+                            view, key,
                         );
+                        // Getting first item will cause mispositioning
+                        // with more than one button with the same key
+                        // on the keyboard.
+                        if let Some((position, button)) = places.next() {
+                            let bounds = c::Bounds {
+                                x: position.x,
+                                y: position.y,
+                                width: button.size.width,
+                                height: button.size.height,
+                            };
+                            ::popover::show(
+                                ui.keyboard,
+                                ui.widget_to_layout.reverse_bounds(bounds),
+                                manager,
+                            );
+                        }
                     }
-                }
-            },
-        };
+                },
+            };
+        }
 
-        let pointer = ::util::Pointer(rckey.clone());
         // Apply state changes
-        layout.pressed_keys.remove(&pointer);
+        vec_remove(&mut layout.pressed_keys, |pressed| *pressed == key);
+        let was_repeating = match &layout.repeating {
+            Some((repeating, _timer)) => *repeating == key,
+            None => false,
+        };
+        if was_repeating {
+            layout.repeating = None;
+        }
         // Commit activated button state changes
-        RefCell::replace(rckey, key);
+        layout.key_states[key.0].pressed = PressType::Released;
+    }
+
+    /// Submits the held key as many times as it's due.
+    /// Returns false if there's no key to repeat.
+    pub fn handle_repeat(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        settings: &repeat::Settings,
+        now: Instant,
+        time: Timestamp,
+    ) -> bool {
+        let (key, count) = match &mut layout.repeating {
+            Some((key, timer)) => (*key, timer.take_due(settings, now)),
+            None => return false,
+        };
+        let key_def = layout.get_key(key);
+        match (count, get_submit_data(&key_def.action)) {
+            (0, _) => {},
+            (count, Some(data)) => submission.handle_repeat(
+                layout.get_key_state_id(key),
+                data,
+                count,
+                time,
+            ),
+            (_, None) => log_print!(
+                logging::Level::Bug,
+                "Repeating key {:?} doesn't submit anything",
+                key_def,
+            ),
+        }
+        true
+    }
+
+    /// Starts tracking the touch for gesture typing.
+    /// `point` is in layout coordinates.
+    pub fn handle_stroke_start(
+        layout: &mut Layout,
+        point: c::Point,
+        key: KeyId,
+    ) {
+        let point = point - &layout.get_current_view_position().0;
+        let arrangement = layout.arrangement.clone();
+        layout.stroke.start(point, key, &arrangement.get_key(key).action);
+    }
+
+    /// Follows the touch.
+    /// Once it leaves the letter where it started, it becomes a gesture,
+    /// and it stops pressing and releasing keys.
+    /// Returns whether the touch is a gesture.
+    pub fn handle_stroke_drag(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        ui: Option<&UIBackend>,
+        time: Timestamp,
+        manager: Option<manager::c::Manager>,
+        point: c::Point,
+    ) -> bool {
+        let view_point = point.clone() - &layout.get_current_view_position().0;
+        layout.stroke.add(view_point);
+        if layout.stroke.is_gesture {
+            return true;
+        }
+
+        let is_leaving = {
+            let key = layout.find_button_by_position(point)
+                .map(|place| place.button.key);
+            layout.stroke.is_leaving_first_key(key)
+        };
+        // The word gets submitted as text
+        if !is_leaving || !submission.is_text_input_active() {
+            return false;
+        }
+        let has_words = {
+            let arrangement = &layout.arrangement;
+            !layout.stroke.get_decoder(&layout.current_view, arrangement)
+                .is_empty()
+        };
+        if !has_words {
+            return false;
+        }
+
+        layout.stroke.is_gesture = true;
+        // The first letter is already submitted
+        release_all_except(layout, submission, ui, time, manager, None);
+        true
+    }
+
+    /// Submits the word drawn by the gesture, if any.
+    /// Returns whether the touch was a gesture.
+    pub fn handle_stroke_end(
+        layout: &mut Layout,
+        submission: &mut Submission,
+    ) -> bool {
+        let was_gesture = layout.stroke.is_gesture;
+        if was_gesture {
+            if let Some((_first, word)) = layout.stroke.decode() {
+                // The first letter got submitted on press
+                let rest: String = word.chars().skip(1).collect();
+                match CString::new(rest) {
+                    Ok(rest) => submission.submit_text(&rest),
+                    Err(e) => log_print!(
+                        logging::Level::Warning,
+                        "Word {} can't be submitted: {}", word, e,
+                    ),
+                }
+            }
+        }
+        layout.stroke.reset();
+        was_gesture
+    }
+
+    /// Releases all pressed keys, except `kept`.
+    pub fn release_all_except(
+        layout: &mut Layout,
+        submission: &mut Submission,
+        ui: Option<&UIBackend>,
+        time: Timestamp,
+        manager: Option<manager::c::Manager>,
+        kept: Option<KeyId>,
+    ) {
+        // Releasing removes the key from the list,
+        // so the list can't be iterated over,
+        // and copying it would allocate.
+        loop {
+            let key = layout.pressed_keys.iter()
+                .find(|key| Some(**key) != kept)
+                .cloned();
+            match key {
+                Some(key) => handle_release_key(
+                    layout,
+                    submission,
+                    ui,
+                    time,
+                    manager,
+                    key,
+                ),
+                None => break,
+            }
+        }
     }
 }
 
@@ -1059,24 +1384,13 @@ mod test {
     use std::ffi::CString;
     use ::keyboard::PressType;
 
-    pub fn make_state() -> Rc<RefCell<::keyboard::KeyState>> {
-        Rc::new(RefCell::new(::keyboard::KeyState {
-            pressed: PressType::Released,
-            keycodes: Vec::new(),
-            action: Action::SetView("default".into()),
-        }))
-    }
-
-    pub fn make_button_with_state(
-        name: String,
-        state: Rc<RefCell<::keyboard::KeyState>>,
-    ) -> Box<Button> {
+    pub fn make_button_with_key(name: String, key: KeyId) -> Box<Button> {
         Box::new(Button {
             name: CString::new(name.clone()).unwrap(),
             size: Size { width: 0f64, height: 0f64 },
             outline_name: CString::new("test").unwrap(),
             label: Label::Text(CString::new(name).unwrap()),
-            state: state,
+            key,
         })
     }
     
@@ -1092,7 +1406,7 @@ mod test {
                         0.0,
                         Box::new(Button {
                             size: Size { width: 10.0, height: 10.0 },
-                            ..*make_button_with_state("foo".into(), make_state())
+                            ..*make_button_with_key("foo".into(), KeyId(0))
                         }),
                     )]
                 },
@@ -1104,7 +1418,7 @@ mod test {
                         0.0,
                         Box::new(Button {
                             size: Size { width: 30.0, height: 10.0 },
-                            ..*make_button_with_state("bar".into(), make_state())
+                            ..*make_button_with_key("bar".into(), KeyId(1))
                         }),
                     )]
                 },
@@ -1127,17 +1441,16 @@ mod test {
                         0.0,
                         Box::new(Button {
                             size: Size { width: 1.0, height: 1.0 },
-                            ..*make_button_with_state("foo".into(), make_state())
+                            ..*make_button_with_key("foo".into(), KeyId(0))
                         }),
                     )]
                 },
             ),
         ]);
-        let layout = Layout {
-            current_view: String::new(),
+        let layout = Arrangement {
             keymap_str: CString::new("").unwrap(),
-            kind: ArrangementKind::Base,
-            pressed_keys: HashSet::new(),
+            keymap_kind: KeymapKind::Own,
+            keys: Vec::new(),
             // Lots of bottom margin
             margins: Margins {
                 top: 0.0,
@@ -1167,4 +1480,303 @@ mod test {
         assert_eq!(transformation.origin_x, 0.5);
         assert_eq!(transformation.origin_y, 0.0);
     }
+
+    /// Counts allocations made by the current thread, when enabled.
+    /// Other tests may be running in parallel, and their allocations
+    /// don't count.
+    mod counting_allocator {
+        use std::alloc::{ GlobalAlloc, Layout, System };
+        use std::cell::Cell;
+
+        struct CountingAllocator;
+
+        #[global_allocator]
+        static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+        thread_local! {
+            static ALLOCATIONS: Cell<Option<u32>> = Cell::new(None);
+        }
+
+        fn count() {
+            // Fails when the thread is being torn down, which is fine
+            let _ = ALLOCATIONS.try_with(|allocations| {
+                if let Some(count) = allocations.get() {
+                    allocations.set(Some(count + 1));
+                }
+            });
+        }
+
+        unsafe impl GlobalAlloc for CountingAllocator {
+            unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+                count();
+                System.alloc(layout)
+            }
+
+            unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+                System.dealloc(ptr, layout)
+            }
+
+            unsafe fn realloc(
+                &self,
+                ptr: *mut u8,
+                layout: Layout,
+                new_size: usize,
+            ) -> *mut u8 {
+                count();
+                System.realloc(ptr, layout, new_size)
+            }
+        }
+
+        /// Returns the number of allocations `f` made
+        pub fn count_allocations<F: FnOnce()>(f: F) -> u32 {
+            ALLOCATIONS.with(|allocations| allocations.set(Some(0)));
+            f();
+            ALLOCATIONS.with(|allocations| {
+                let count = allocations.get().unwrap();
+                allocations.set(None);
+                count
+            })
+        }
+    }
+
+    /// Presses and releases the button under `centre`,
+    /// going through the same steps as the UI
+    fn tap(layout: &mut Layout, submission: &mut Submission, centre: c::Point) {
+        use std::time::Duration;
+
+        let key = seat::handle_touch(layout, centre.clone()).unwrap();
+        seat::handle_stroke_start(layout, centre, key);
+        seat::handle_press_key(layout, submission, Timestamp(0), key);
+        drawing::foreach_changed_button(
+            layout, submission,
+            |_offset, _button, _pressed, _locked| {},
+        );
+        seat::handle_repeat(
+            layout,
+            submission,
+            &repeat::Settings {
+                delay: Duration::from_millis(500),
+                interval: Duration::from_millis(30),
+            },
+            Instant::now() + Duration::from_secs(1),
+            Timestamp(0),
+        );
+        seat::handle_stroke_end(layout, submission);
+        seat::release_all_except(
+            layout,
+            submission,
+            None,
+            Timestamp(0),
+            None,
+            None,
+        );
+        drawing::foreach_changed_button(
+            layout, submission,
+            |_offset, _button, _pressed, _locked| {},
+        );
+        // Like at the end of the main loop iteration
+        submission.flush();
+    }
+
+    /// With `im_active`, text goes to an active input method
+    fn make_submission(im_active: bool) -> Submission {
+        use std::ptr;
+        use ::imservice::IMService;
+        use ::vkeyboard::VirtualKeyboard;
+        use ::vkeyboard::c::ZwpVirtualKeyboardV1;
+
+        let imservice = match im_active {
+            false => None,
+            true => {
+                use ::imservice::c::*;
+                // Never dereferenced, only compared
+                let im = ptr::NonNull::dangling().as_ptr();
+                let mut imservice = IMService::new(im, ptr::null());
+                let imservice_ptr = imservice.as_mut() as *mut IMService;
+                imservice_handle_input_method_activate(imservice_ptr, im);
+                imservice_handle_done(imservice_ptr, im);
+                assert!(imservice.is_active());
+                Some(imservice)
+            },
+        };
+        Submission::new(
+            imservice,
+            VirtualKeyboard(ZwpVirtualKeyboardV1(ptr::null())),
+        )
+    }
+
+    /// The keystroke path must not allocate once the layout is loaded,
+    /// to stay fast and free of jitter.
+    #[test]
+    fn keystrokes_dont_allocate() {
+        use self::counting_allocator::count_allocations;
+
+        for &im_active in &[false, true] {
+            for name in ::resources::get_keyboard_names() {
+                let data = ::data::Layout::from_resource(name).unwrap()
+                    .build(logging::Print {}).0
+                    .unwrap();
+                let mut layout = Layout::new(
+                    Arc::new(data),
+                    ArrangementKind::Base,
+                );
+                let mut submission = make_submission(im_active);
+                let view_names: Vec<String> = layout.arrangement.views.keys()
+                    .cloned()
+                    .collect();
+                for view_name in view_names {
+                    layout.set_view(&view_name).unwrap();
+                    let mut centres = Vec::new();
+                    layout.foreach_visible_button(|offset, button| {
+                        centres.push(offset + c::Point {
+                            x: button.size.width / 2.0,
+                            y: button.size.height / 2.0,
+                        });
+                    });
+                    for centre in centres {
+                        if im_active {
+                            // Grows the buffer for the text of the key
+                            layout.set_view(&view_name).unwrap();
+                            tap(&mut layout, &mut submission, centre.clone());
+                        }
+                        // Pressing keys switches views
+                        layout.set_view(&view_name).unwrap();
+                        let allocations = count_allocations(|| {
+                            tap(&mut layout, &mut submission, centre);
+                        });
+                        assert_eq!(
+                            allocations, 0,
+                            "Keystroke allocated in layout {}, view {}{}",
+                            name, view_name,
+                            match im_active {
+                                true => ", input method active",
+                                false => "",
+                            },
+                        );
+                    }
+                }
+            }
+        }
+    }
+
+    /// Keycodes assigned on demand get reused, once every key has one
+    #[test]
+    fn on_demand_keystrokes_dont_allocate() {
+        use self::counting_allocator::count_allocations;
+        use std::mem;
+
+        let mut data = ::data::Layout::from_resource("us").unwrap()
+            .build(logging::Print {}).0
+            .unwrap();
+        data.keymap_kind = KeymapKind::OnDemand;
+        let mut layout = Layout::new(Arc::new(data), ArrangementKind::Base);
+        let mut submission = make_submission(false);
+        submission.update_keymap(
+            // Not used for keycodes on demand
+            unsafe { mem::zeroed() },
+            KeymapKind::OnDemand,
+            Timestamp(0),
+        );
+        let mut centres = Vec::new();
+        layout.foreach_visible_button(|offset, button| {
+            centres.push(offset + c::Point {
+                x: button.size.width / 2.0,
+                y: button.size.height / 2.0,
+            });
+        });
+        // The first press of each key may change the keymap
+        for centre in centres.iter() {
+            layout.set_view("base").unwrap();
+            tap(&mut layout, &mut submission, centre.clone());
+        }
+        for centre in centres {
+            layout.set_view("base").unwrap();
+            let allocations = count_allocations(|| {
+                tap(&mut layout, &mut submission, centre.clone());
+            });
+            assert_eq!(allocations, 0, "Keystroke allocated at {:?}", centre);
+        }
+    }
+
+    /// Keys sent as keycodes get repeated by the compositor
+    #[test]
+    fn repeats_only_own_keys() {
+        let data = ::data::Layout::from_resource("us").unwrap()
+            .build(logging::Print {}).0
+            .unwrap();
+        let mut layout = Layout::new(Arc::new(data), ArrangementKind::Base);
+        let key = layout.get_current_view().get_rows().next().unwrap().1
+            .buttons[0].1.key;
+        for &im_active in &[false, true] {
+            let mut submission = make_submission(im_active);
+            seat::handle_press_key(
+                &mut layout, &mut submission, Timestamp(0), key,
+            );
+            assert_eq!(layout.repeating.is_some(), im_active);
+            seat::release_all_except(
+                &mut layout, &mut submission, None, Timestamp(0), None, None,
+            );
+        }
+    }
+
+    /// Layouts learn into one model, so that saving one keeps the others
+    #[test]
+    fn layouts_share_touch_model() {
+        let build = |name| {
+            let data = ::data::Layout::from_resource(name).unwrap()
+                .build(logging::Print {}).0
+                .unwrap();
+            Layout::new(Arc::new(data), ArrangementKind::Base)
+        };
+        let mut us = build("us");
+        let mut de = build("de");
+        let model = Rc::new(RefCell::new(spatial::Model::new()));
+        us.set_touch_model(model.clone());
+        de.set_touch_model(model.clone());
+        assert!(Rc::ptr_eq(&us.touch_model, &de.touch_model));
+        let model = model.borrow();
+        let has_all_buttons = |layout: &Layout| {
+            let mut has_all = true;
+            layout.foreach_visible_button(|_offset, button| {
+                has_all &= model.find(&button.name).is_some();
+            });
+            has_all
+        };
+        assert!(has_all_buttons(&us));
+        assert!(has_all_buttons(&de));
+    }
+
+    /// Arrangements get built on other threads, and shared
+    #[test]
+    fn arrangement_is_shareable() {
+        fn assert_send_sync<T: Send + Sync>() {}
+        assert_send_sync::<Arrangement>();
+    }
+
+    #[test]
+    fn reset_forgets_keys() {
+        use std::ptr;
+        use ::vkeyboard::VirtualKeyboard;
+        use ::vkeyboard::c::ZwpVirtualKeyboardV1;
+
+        let data = ::data::Layout::from_resource("us").unwrap()
+            .build(logging::Print {}).0
+            .unwrap();
+        let mut layout = Layout::new(Arc::new(data), ArrangementKind::Base);
+        let mut submission = Submission::new(
+            None,
+            VirtualKeyboard(ZwpVirtualKeyboardV1(ptr::null())),
+        );
+        layout.set_view("upper").unwrap();
+        let key = layout.get_current_view().get_rows().next().unwrap().1
+            .buttons[0].1.key;
+        seat::handle_press_key(&mut layout, &mut submission, Timestamp(0), key);
+        assert_eq!(layout.pressed_keys.len(), 1);
+
+        layout.reset();
+        assert_eq!(layout.current_view, "base");
+        assert!(layout.pressed_keys.is_empty());
+        assert!(layout.repeating.is_none());
+        assert_eq!(layout.get_key_state(key).pressed, PressType::Released);
+    }
 }
@@ -19,9 +19,17 @@ extern crate xkbcommon;
 mod logging;
 
 mod action;
+#[cfg(test)]
+mod c_stubs;
+mod cache;
+mod compiled;
 pub mod data;
 mod drawing;
 pub mod float_ord;
+mod gesture;
+pub mod imrecord;
+#[cfg(any(test, feature = "replay"))]
+pub mod imreplay;
 pub mod imservice;
 mod keyboard;
 mod layout;
@@ -29,12 +37,22 @@ mod locale;
 mod locale_config;
 mod manager;
 mod outputs;
+mod parsing;
 mod popover;
+mod repeat;
 mod resources;
+mod slots;
+mod spatial;
 mod style;
 mod submission;
+mod superset;
 pub mod tests;
+#[cfg(any(test, feature = "benchmarks"))]
+pub mod timing;
+#[cfg(any(test, feature = "benchmarks"))]
+pub mod typist;
 pub mod util;
 mod ui_manager;
 mod vkeyboard;
+mod watcher;
 mod xdg;
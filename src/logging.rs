@@ -69,7 +69,7 @@ pub enum Level {
 }
 
 impl Level {
-    fn as_str(&self) -> &'static str {
+    pub fn as_str(&self) -> &'static str {
         match self {
             Level::Panic => "Panic",
             Level::Bug => "Bug",
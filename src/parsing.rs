@@ -0,0 +1,678 @@
+/*! Parsing layout files, and compiling them.
+ *
+ * Compiling resolves everything that doesn't need the UI:
+ * actions, keycodes, labels, sizes, and the keymap.
+ *
+ * The build script uses this to compile the built-in layouts,
+ * so it must not depend on anything besides
+ * `action`, `compiled`, `keyboard`, and `logging`.
+ */
+
+// TODO: find a nice way to make sure non-positive sizes don't break layouts
+
+use std::collections::{ HashMap, HashSet };
+use std::ffi::CString;
+use std::fmt;
+use std::fs;
+use std::io;
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::vec::Vec;
+
+use xkbcommon::xkb;
+
+use ::action;
+use ::compiled;
+use ::keyboard::{
+    Key,
+    check_keymap, generate_keymap, generate_keycodes, FormattingError,
+    KEYCODE_COUNT,
+};
+use ::logging;
+
+// traits, derives
+use serde::Deserialize;
+use std::io::BufReader;
+use std::iter::FromIterator;
+use ::logging::Warn;
+
+/// The root element describing an entire keyboard
+#[derive(Debug, Deserialize, PartialEq)]
+#[serde(deny_unknown_fields)]
+pub struct Layout {
+    #[serde(default)]
+    margins: Margins,
+    views: HashMap<String, Vec<ButtonIds>>,
+    #[serde(default)] 
+    buttons: HashMap<String, ButtonMeta>,
+    outlines: HashMap<String, Outline>
+}
+
+#[derive(Debug, Clone, Deserialize, PartialEq, Default)]
+#[serde(deny_unknown_fields)]
+struct Margins {
+    top: f64,
+    bottom: f64,
+    side: f64,
+}
+
+/// Buttons are embedded in a single string
+type ButtonIds = String;
+
+/// All info about a single button
+/// Buttons can have multiple instances though.
+#[derive(Debug, Default, Deserialize, PartialEq)]
+#[serde(deny_unknown_fields)]
+struct ButtonMeta {
+    // TODO: structure (action, keysym, text, modifier) as an enum
+    // to detect conflicts and missing values at compile time
+    /// Special action to perform on activation.
+    /// Conflicts with keysym, text, modifier.
+    action: Option<Action>,
+    /// The name of the XKB keysym to emit on activation.
+    /// Conflicts with action, text, modifier.
+    keysym: Option<String>,
+    /// The text to submit on activation. Will be derived from ID if not present
+    /// Conflicts with action, keysym, modifier.
+    text: Option<String>,
+    /// The modifier to apply while the key is locked
+    /// Conflicts with action, keysym, text
+    modifier: Option<Modifier>,
+    /// If not present, will be derived from text or the button ID
+    label: Option<String>,
+    /// Conflicts with label
+    icon: Option<String>,
+    /// The name of the outline. If not present, will be "default"
+    outline: Option<String>,
+}
+
+#[derive(Debug, Deserialize, PartialEq, Clone)]
+#[serde(deny_unknown_fields)]
+enum Action {
+    #[serde(rename="locking")]
+    Locking { lock_view: String, unlock_view: String },
+    #[serde(rename="set_view")]
+    SetView(String),
+    #[serde(rename="show_prefs")]
+    ShowPrefs,
+    /// Remove last character
+    #[serde(rename="erase")]
+    Erase,
+}
+
+#[derive(Debug, Clone, PartialEq, Deserialize)]
+#[serde(deny_unknown_fields)]
+enum Modifier {
+    Control,
+    Shift,
+    Lock,
+    #[serde(alias="Mod1")]
+    Alt,
+    Mod2,
+    Mod3,
+    Mod4,
+    Mod5,
+}
+
+#[derive(Debug, Clone, Deserialize, PartialEq)]
+#[serde(deny_unknown_fields)]
+struct Outline {
+    width: f64,
+    height: f64,
+}
+
+/// Errors encountered loading the layout into yaml
+#[derive(Debug)]
+pub enum Error {
+    Yaml(serde_yaml::Error),
+    Io(io::Error),
+    /// The file was missing.
+    /// It's distinct from Io in order to make it matchable
+    /// without calling io::Error::kind()
+    Missing(io::Error),
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::Yaml(e) => write!(f, "YAML: {}", e),
+            Error::Io(e) => write!(f, "IO: {}", e),
+            Error::Missing(e) => write!(f, "Missing: {}", e),
+        }
+    }
+}
+
+impl From<io::Error> for Error {
+    fn from(e: io::Error) -> Self {
+        let kind = e.kind();
+        match kind {
+            io::ErrorKind::NotFound => Error::Missing(e),
+            _ => Error::Io(e),
+        }
+    }
+}
+
+impl Layout {
+    pub fn from_file(path: PathBuf) -> Result<Layout, Error> {
+        let infile = BufReader::new(
+            fs::OpenOptions::new()
+                .read(true)
+                .open(&path)?
+        );
+        serde_yaml::from_reader(infile).map_err(Error::Yaml)
+    }
+
+    /// Parses the contents of a layout file
+    pub fn from_bytes(data: &[u8]) -> Result<Layout, Error> {
+        serde_yaml::from_reader(data).map_err(Error::Yaml)
+    }
+
+    pub fn compile<H: logging::Handler>(self, mut warning_handler: H)
+        -> (Result<compiled::Layout, FormattingError>, H)
+    {
+        let button_names = self.views.values()
+            .flat_map(|rows| {
+                rows.iter()
+                    .flat_map(|row| row.split_ascii_whitespace())
+            });
+        
+        let button_names: HashSet<&str>
+            = HashSet::from_iter(button_names);
+        // Sorted, so that compiling is reproducible
+        let mut button_names: Vec<&str> = button_names.into_iter().collect();
+        button_names.sort();
+
+        let button_actions: Vec<(&str, ::action::Action)>
+            = button_names.iter().map(|name| {(
+                *name,
+                create_action(
+                    &self.buttons,
+                    name,
+                    self.views.keys().collect(),
+                    &mut warning_handler,
+                )
+            )}).collect();
+
+        let keymap: HashMap<String, u32> = generate_keycodes(
+            button_actions.iter()
+                .filter_map(|(_name, action)| {
+                    match action {
+                        ::action::Action::Submit {
+                            text: _, keys,
+                        } => Some(keys),
+                        _ => None,
+                    }
+                })
+                .flatten()
+                .map(|named_keysym| named_keysym.0.as_str())
+        );
+
+        // Too many keysyms for a keymap,
+        // so keys get keycodes when pressed
+        let on_demand = keymap.len() > KEYCODE_COUNT;
+        if on_demand {
+            warning_handler.handle(
+                logging::Level::Info,
+                &format!(
+                    "{} keysyms don't fit in a keymap, assigning on demand",
+                    keymap.len(),
+                ),
+            );
+        }
+
+        let keys = button_actions.into_iter().map(|(name, action)| {
+            let keycodes = match &action {
+                _ if on_demand => Vec::new(),
+                ::action::Action::Submit { text: _, keys } => {
+                    keys.iter().map(|named_keycode| {
+                        *keymap.get(named_keycode.0.as_str())
+                            .unwrap_or_else(|| panic!(
+                                "keycode {} in key {} missing from keymap",
+                                named_keycode.0,
+                                name,
+                            ))
+                    }).collect()
+                },
+                action::Action::Erase => vec![
+                    *keymap.get("BackSpace")
+                        .expect("BackSpace missing from keymap"),
+                ],
+                _ => Vec::new(),
+            };
+            (
+                name.into(),
+                Key {
+                    keycodes: Arc::new(keycodes),
+                    action,
+                }
+            )
+        });
+
+        let mut keys = HashMap::<String, Key>::from_iter(keys);
+
+        let keymap_str = if on_demand {
+            String::new()
+        } else {
+            // TODO: generate from symbols
+            let keymap_str = match generate_keymap(&keys) {
+                Err(e) => { return (Err(e), warning_handler) },
+                Ok(v) => v,
+            };
+            if let Err(e) = check_keymap(&keymap_str) {
+                return (Err(e), warning_handler);
+            }
+            keymap_str
+        };
+
+        let buttons = button_names.iter().map(|name| {
+            let key = keys.remove(*name)
+                .expect("Key not created");
+            compile_button(
+                &self.buttons,
+                &self.outlines,
+                name,
+                key,
+                &mut warning_handler,
+            )
+        }).collect();
+
+        let indices: HashMap<&str, u32> = HashMap::from_iter(
+            button_names.iter().enumerate()
+                .map(|(i, name)| (*name, i as u32))
+        );
+        let mut views: Vec<_> = self.views.iter()
+            .map(|(name, view)| {
+                let rows = view.iter().map(|row| {
+                    row.split_ascii_whitespace()
+                        .map(|name| indices[name])
+                        .collect()
+                }).collect();
+                (name.clone(), rows)
+            }).collect();
+        views.sort_by(|(a, _), (b, _)| a.cmp(b));
+
+        (
+            Ok(compiled::Layout {
+                // FIXME: use a dedicated field
+                margins: compiled::Margins {
+                    top: self.margins.top,
+                    left: self.margins.side,
+                    bottom: self.margins.bottom,
+                    right: self.margins.side,
+                },
+                keymap_str,
+                buttons,
+                views,
+            }),
+            warning_handler,
+        )
+    }
+}
+
+fn create_action<H: logging::Handler>(
+    button_info: &HashMap<String, ButtonMeta>,
+    name: &str,
+    view_names: Vec<&String>,
+    warning_handler: &mut H,
+) -> ::action::Action {
+    let default_meta = ButtonMeta::default();
+    let symbol_meta = button_info.get(name)
+        .unwrap_or(&default_meta);
+
+    fn keysym_valid(name: &str) -> bool {
+        xkb::keysym_from_name(name, xkb::KEYSYM_NO_FLAGS) != xkb::KEY_NoSymbol
+    }
+    
+    enum SubmitData {
+        Action(Action),
+        Text(String),
+        Keysym(String),
+        Modifier(Modifier),
+    };
+    
+    let submission = match (
+        &symbol_meta.action,
+        &symbol_meta.keysym,
+        &symbol_meta.text,
+        &symbol_meta.modifier,
+    ) {
+        (Some(action), None, None, None) => SubmitData::Action(action.clone()),
+        (None, Some(keysym), None, None) => SubmitData::Keysym(keysym.clone()),
+        (None, None, Some(text), None) => SubmitData::Text(text.clone()),
+        (None, None, None, Some(modifier)) => {
+            SubmitData::Modifier(modifier.clone())
+        },
+        (None, None, None, None) => SubmitData::Text(name.into()),
+        _ => {
+            warning_handler.handle(
+                logging::Level::Warning,
+                &format!(
+                    "Button {} has more than one of (action, keysym, text, modifier)",
+                    name,
+                ),
+            );
+            SubmitData::Text("".into())
+        },
+    };
+
+    fn filter_view_name<H: logging::Handler>(
+        button_name: &str,
+        view_name: String,
+        view_names: &Vec<&String>,
+        warning_handler: &mut H,
+    ) -> String {
+        if view_names.contains(&&view_name) {
+            view_name
+        } else {
+            warning_handler.handle(
+                logging::Level::Warning,
+                &format!("Button {} switches to missing view {}",
+                    button_name,
+                    view_name,
+                ),
+            );
+            "base".into()
+        }
+    }
+
+    match submission {
+        SubmitData::Action(
+            Action::SetView(view_name)
+        ) => ::action::Action::SetView(
+            filter_view_name(
+                name, view_name.clone(), &view_names,
+                warning_handler,
+            )
+        ),
+        SubmitData::Action(Action::Locking {
+            lock_view, unlock_view
+        }) => ::action::Action::LockView {
+            lock: filter_view_name(
+                name,
+                lock_view.clone(),
+                &view_names,
+                warning_handler,
+            ),
+            unlock: filter_view_name(
+                name,
+                unlock_view.clone(),
+                &view_names,
+                warning_handler,
+            ),
+        },
+        SubmitData::Action(
+            Action::ShowPrefs
+        ) => ::action::Action::ShowPreferences,
+        SubmitData::Action(Action::Erase) => action::Action::Erase,
+        SubmitData::Keysym(keysym) => ::action::Action::Submit {
+            text: None,
+            keys: vec!(::action::KeySym(
+                match keysym_valid(keysym.as_str()) {
+                    true => keysym.clone(),
+                    false => {
+                        warning_handler.handle(
+                            logging::Level::Warning,
+                            &format!(
+                                "Keysym name invalid: {}",
+                                keysym,
+                            ),
+                        );
+                        "space".into() // placeholder
+                    },
+                }
+            )),
+        },
+        SubmitData::Text(text) => ::action::Action::Submit {
+            text: CString::new(text.clone()).or_warn(
+                warning_handler,
+                logging::Problem::Warning,
+                &format!("Text {} contains problems", text),
+            ),
+            keys: text.chars().map(|codepoint| {
+                let codepoint_string = codepoint.to_string();
+                ::action::KeySym(match keysym_valid(codepoint_string.as_str()) {
+                    true => codepoint_string,
+                    false => format!("U{:04X}", codepoint as u32),
+                })
+            }).collect(),
+        },
+        SubmitData::Modifier(modifier) => match modifier {
+            Modifier::Control => action::Action::ApplyModifier(
+                action::Modifier::Control,
+            ),
+            Modifier::Alt => action::Action::ApplyModifier(
+                action::Modifier::Alt,
+            ),
+            Modifier::Mod4 => action::Action::ApplyModifier(
+                action::Modifier::Mod4,
+            ),
+            Modifier::Shift => action::Action::ApplyModifier(
+                action::Modifier::Shift,
+            ),
+            unsupported_modifier => {
+                warning_handler.handle(
+                    logging::Level::Bug,
+                    &format!(
+                        "Modifier {:?} unsupported", unsupported_modifier,
+                    ),
+                );
+                action::Action::Submit {
+                    text: None,
+                    keys: Vec::new(),
+                }
+            },
+        },
+    }
+}
+
+/// TODO: Since this will receive user-provided data,
+/// all .expect() on them should be turned into soft fails
+fn compile_button<H: logging::Handler>(
+    button_info: &HashMap<String, ButtonMeta>,
+    outlines: &HashMap<String, Outline>,
+    name: &str,
+    key: Key,
+    warning_handler: &mut H,
+) -> compiled::Button {
+    // Names become CStrings in the UI
+    CString::new(name).expect("Bad name");
+    // don't remove, because multiple buttons with the same name are allowed
+    let default_meta = ButtonMeta::default();
+    let button_meta = button_info.get(name)
+        .unwrap_or(&default_meta);
+
+    let label = if let Some(label) = &button_meta.label {
+        CString::new(label.as_str()).expect("Bad label");
+        compiled::Label::Text(label.clone())
+    } else if let Some(icon) = &button_meta.icon {
+        CString::new(icon.as_str()).expect("Bad icon");
+        compiled::Label::IconName(icon.clone())
+    } else if let Some(text) = &button_meta.text {
+        compiled::Label::Text(
+            CString::new(text.as_str())
+                .or_warn(
+                    warning_handler,
+                    logging::Problem::Warning,
+                    &format!("Text {} is invalid", text),
+                )
+                .map(|_| text.clone())
+                .unwrap_or_else(String::new)
+        )
+    } else {
+        compiled::Label::Text(name.into())
+    };
+
+    let outline_name = match &button_meta.outline {
+        Some(outline) => {
+            if outlines.contains_key(outline) {
+                outline.clone()
+            } else {
+                warning_handler.handle(
+                    logging::Level::Warning,
+                    &format!("Outline named {} does not exist! Using default for button {}", outline, name)
+                );
+                "default".into()
+            }
+        }
+        None => "default".into(),
+    };
+    CString::new(outline_name.as_str()).expect("Bad outline");
+
+    let outline = outlines.get(&outline_name)
+        .map(|outline| (*outline).clone())
+        .or_warn(
+            warning_handler,
+            logging::Problem::Warning,
+            "No default outline defined! Using 1x1!",
+        ).unwrap_or(Outline { width: 1f64, height: 1f64 });
+
+    compiled::Button {
+        name: name.into(),
+        label,
+        outline_name,
+        // TODO: do layout before creating buttons
+        width: outline.width,
+        height: outline.height,
+        keycodes: (*key.keycodes).clone(),
+        action: key.action,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    
+    use std::error::Error as ErrorTrait;
+    use ::logging::ProblemPanic;
+
+    const THIS_FILE: &str = file!();
+
+    fn path_from_root(file: &'static str) -> PathBuf {
+        PathBuf::from(THIS_FILE)
+            .parent().unwrap()
+            .parent().unwrap()
+            .join(file)
+    }
+
+    #[test]
+    fn test_parse_path() {
+        assert_eq!(
+            Layout::from_file(path_from_root("tests/layout.yaml")).unwrap(),
+            Layout {
+                margins: Margins { top: 0f64, bottom: 0f64, side: 0f64 },
+                views: hashmap!(
+                    "base".into() => vec!("test".into()),
+                ),
+                buttons: hashmap!{
+                    "test".into() => ButtonMeta {
+                        icon: None,
+                        keysym: None,
+                        action: None,
+                        text: None,
+                        modifier: None,
+                        label: Some("test".into()),
+                        outline: None,
+                    }
+                },
+                outlines: hashmap!{
+                    "default".into() => Outline { width: 0f64, height: 0f64 }, 
+                },
+            }
+        );
+    }
+
+    /// Check if the default protection works
+    #[test]
+    fn test_empty_views() {
+        let out = Layout::from_file(path_from_root("tests/layout2.yaml"));
+        match out {
+            Ok(_) => assert!(false, "Data mistakenly accepted"),
+            Err(e) => {
+                let mut handled = false;
+                if let Error::Yaml(ye) = &e {
+                    handled = ye.description() == "missing field `views`";
+                };
+                if !handled {
+                    println!("Unexpected error {:?}", e);
+                    assert!(false)
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_extra_field() {
+        let out = Layout::from_file(path_from_root("tests/layout3.yaml"));
+        match out {
+            Ok(_) => assert!(false, "Data mistakenly accepted"),
+            Err(e) => {
+                let mut handled = false;
+                if let Error::Yaml(ye) = &e {
+                    handled = ye.description()
+                        .starts_with("unknown field `bad_field`");
+                };
+                if !handled {
+                    println!("Unexpected error {:?}", e);
+                    assert!(false)
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn unicode_keysym() {
+        let keysym = xkb::keysym_from_name(
+            format!("U{:X}", "å".chars().next().unwrap() as u32).as_str(),
+            xkb::KEYSYM_NO_FLAGS,
+        );
+        let keysym = xkb::keysym_to_utf8(keysym);
+        assert_eq!(keysym, "å\0");
+    }
+
+    #[test]
+    fn test_key_unicode() {
+        assert_eq!(
+            create_action(
+                &hashmap!{
+                    ".".into() => ButtonMeta {
+                        icon: None,
+                        keysym: None,
+                        text: None,
+                        action: None,
+                        modifier: None,
+                        label: Some("test".into()),
+                        outline: None,
+                    }
+                },
+                ".",
+                Vec::new(),
+                &mut ProblemPanic,
+            ),
+            ::action::Action::Submit {
+                text: Some(CString::new(".").unwrap()),
+                keys: vec!(::action::KeySym("U002E".into())),
+            },
+        );
+    }
+
+    /// Too many keysyms for a keymap
+    #[test]
+    fn on_demand_keycodes() {
+        let names: Vec<String> = (0..300).map(|i| format!("k{}", i)).collect();
+        let mut source = format!(
+            "views:\n    base:\n        - \"{}\"\nbuttons:\n",
+            names.join(" "),
+        );
+        for (i, name) in names.iter().enumerate() {
+            source.push_str(&format!(
+                "    {}: {{ keysym: \"U{:04X}\" }}\n", name, 0x100 + i,
+            ));
+        }
+        source.push_str("outlines:\n    default: { width: 1, height: 1 }\n");
+        let out = Layout::from_bytes(source.as_bytes()).unwrap()
+            .compile(ProblemPanic).0
+            .unwrap();
+        assert_eq!(out.keymap_str, "");
+        assert!(out.buttons.iter().all(|button| button.keycodes.is_empty()));
+    }
+}
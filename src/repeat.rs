@@ -0,0 +1,76 @@
+/*! Repeating keys while they are held down.
+ *
+ * Only the timing is here.
+ * The key being held is tracked by the layout,
+ * and submission decides how to send the repeats.
+ */
+
+use std::time::{ Duration, Instant };
+
+/// Mirrors org.gnome.desktop.peripherals.keyboard
+#[derive(Clone, Debug)]
+pub struct Settings {
+    /// Time from press until the first repeat
+    pub delay: Duration,
+    /// Time between repeats
+    pub interval: Duration,
+}
+
+fn as_micros(duration: Duration) -> u64 {
+    duration.as_secs() * 1_000_000 + duration.subsec_micros() as u64
+}
+
+/// Counts the repeats of a held key
+#[derive(Clone, Debug)]
+pub struct Timer {
+    pressed: Instant,
+    /// Repeats already taken
+    taken: u64,
+}
+
+impl Timer {
+    pub fn new(pressed: Instant) -> Timer {
+        Timer { pressed, taken: 0 }
+    }
+
+    /// Returns the number of repeats that became due since the last call.
+    /// Calling it once per frame batches all repeats within the frame.
+    pub fn take_due(&mut self, settings: &Settings, now: Instant) -> u32 {
+        if now < self.pressed + settings.delay {
+            return 0;
+        }
+        let repeating = as_micros(now - self.pressed - settings.delay);
+        // A zero interval would mean infinitely many repeats
+        let interval = match as_micros(settings.interval) {
+            0 => 1,
+            i => i,
+        };
+        let due = 1 + repeating / interval;
+        let new = due - self.taken;
+        self.taken = due;
+        new as u32
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn ms(millis: u64) -> Duration {
+        Duration::from_millis(millis)
+    }
+
+    #[test]
+    fn timing() {
+        let settings = Settings { delay: ms(500), interval: ms(30) };
+        let start = Instant::now();
+        let mut timer = Timer::new(start);
+        assert_eq!(timer.take_due(&settings, start), 0);
+        assert_eq!(timer.take_due(&settings, start + ms(499)), 0);
+        assert_eq!(timer.take_due(&settings, start + ms(500)), 1);
+        assert_eq!(timer.take_due(&settings, start + ms(510)), 0);
+        assert_eq!(timer.take_due(&settings, start + ms(530)), 1);
+        // A slow frame
+        assert_eq!(timer.take_due(&settings, start + ms(650)), 4);
+    }
+}
@@ -10,6 +10,9 @@ use std::iter::FromIterator;
 // TODO: keep a list of what is a language layout,
 // and what a convenience layout. "_wide" is not a layout,
 // neither is "number"
+/// The sources of the built-in layouts.
+/// Only tests and layout tools need them, squeekboard uses the compiled ones.
+#[cfg(any(test, feature = "builtin_yaml"))]
 const KEYBOARDS: &[(*const str, *const str)] = &[
     // layouts: us must be left as first, as it is the,
     // fallback layout. The others should be alphabetical.
@@ -38,6 +41,11 @@ const KEYBOARDS: &[(*const str, *const str)] = &[
     ("emoji", include_str!("../data/keyboards/emoji.yaml")),
 ];
 
+/// The same keyboards, compiled by the build script
+pub const COMPILED_KEYBOARDS: &[u8]
+    = include_bytes!(concat!(env!("OUT_DIR"), "/keyboards.bin"));
+
+#[cfg(any(test, feature = "builtin_yaml"))]
 pub fn get_keyboard(needle: &str) -> Option<&'static str> {
     // Need to dereference in unsafe code
     // comparing *const str to &str will compare pointers
@@ -52,6 +60,14 @@ pub fn get_keyboard(needle: &str) -> Option<&'static str> {
         })
 }
 
+/// Names of the built-in layouts, in alphabetical order
+#[cfg(any(test, feature = "benchmarks"))]
+pub fn get_keyboard_names() -> Vec<&'static str> {
+    // The bundle is made by the build script, so it's not corrupt
+    ::compiled::get_bundle_names(COMPILED_KEYBOARDS)
+        .expect("Bad compiled layouts")
+}
+
 const OVERLAY_NAMES: &[*const str] = &[
     "emoji",
     "terminal",
@@ -0,0 +1,186 @@
+/*! Keycodes given to keysyms when they are needed.
+ *
+ * A layout with more keysyms than a keymap has keycodes
+ * can't be sent to the compositor whole.
+ * Instead, its keys get keycodes from a pool of slots when pressed.
+ * A press needing keysyms without a slot changes the keymap,
+ * with all the missing keysyms of the key added at once.
+ * When the pool is full, the slot used least recently gets reused,
+ * unless a key still held down needs it.
+ */
+
+use std::collections::HashMap;
+
+use ::keyboard::{ write_keymap, KeyCode, FIRST_KEYCODE, KEYCODE_COUNT };
+
+struct Slot {
+    keysym: String,
+    /// The value of the clock when the slot was last used
+    last_used: u64,
+}
+
+pub struct Slots {
+    /// Indexed by keycode - FIRST_KEYCODE
+    slots: Vec<Slot>,
+    codes: HashMap<String, KeyCode>,
+    /// Advances on every use
+    clock: u64,
+    capacity: usize,
+}
+
+impl Slots {
+    pub fn new() -> Slots {
+        Slots::with_capacity(KEYCODE_COUNT)
+    }
+
+    fn with_capacity(capacity: usize) -> Slots {
+        Slots {
+            slots: Vec::new(),
+            codes: HashMap::new(),
+            clock: 0,
+            capacity: capacity.min(KEYCODE_COUNT),
+        }
+    }
+
+    fn get_slot(&mut self, keycode: KeyCode) -> &mut Slot {
+        &mut self.slots[(keycode - FIRST_KEYCODE) as usize]
+    }
+
+    /// Puts keycodes for the keysyms in `keycodes`,
+    /// and returns whether the keymap changed to make room for them.
+    /// The keycodes in `held` are not reused.
+    /// Returns None if there's not enough room.
+    /// Doesn't allocate unless the keymap changes.
+    pub fn assign<'a, I>(
+        &mut self,
+        keysyms: I,
+        held: &[KeyCode],
+        keycodes: &mut Vec<KeyCode>,
+    ) -> Option<bool>
+        where I: Iterator<Item=&'a str> + Clone
+    {
+        keycodes.clear();
+        self.clock += 1;
+        let clock = self.clock;
+        let mut missing = Vec::new();
+        for keysym in keysyms.clone() {
+            match self.codes.get(keysym).cloned() {
+                Some(keycode) => self.get_slot(keycode).last_used = clock,
+                None => missing.push(keysym),
+            }
+        }
+        missing.sort();
+        missing.dedup();
+
+        // Slots for this key are marked with the current clock,
+        // so they don't get reused for the same key
+        let is_free = |(i, slot): &(usize, &Slot)| {
+            slot.last_used < clock
+                && !held.contains(&(FIRST_KEYCODE + *i as KeyCode))
+        };
+        let free_count = self.capacity - self.slots.len()
+            + self.slots.iter().enumerate().filter(is_free).count();
+        if missing.len() > free_count {
+            return None;
+        }
+
+        for keysym in missing.iter() {
+            let index = if self.slots.len() < self.capacity {
+                self.slots.push(Slot { keysym: String::new(), last_used: 0 });
+                self.slots.len() - 1
+            } else {
+                let (index, _slot) = self.slots.iter().enumerate()
+                    .filter(is_free)
+                    .min_by_key(|(_i, slot)| slot.last_used)
+                    .expect("Counted free slots are gone");
+                self.codes.remove(&self.slots[index].keysym);
+                index
+            };
+            self.slots[index] = Slot {
+                keysym: (*keysym).into(),
+                last_used: clock,
+            };
+            self.codes.insert(
+                (*keysym).into(),
+                FIRST_KEYCODE + index as KeyCode,
+            );
+        }
+
+        let codes = &self.codes;
+        keycodes.extend(keysyms.map(|keysym| codes[keysym]));
+        Some(missing.len() > 0)
+    }
+
+    /// Writes a keymap where each slot's keycode submits its keysym,
+    /// replacing the contents of `buf`.
+    /// The text ends with a null byte, like the compositor wants it.
+    pub fn write_keymap(&self, buf: &mut Vec<u8>) {
+        buf.clear();
+        write_keymap(
+            buf,
+            self.slots.iter()
+                .enumerate()
+                .map(|(i, slot)| {
+                    (FIRST_KEYCODE + i as KeyCode, slot.keysym.as_str())
+                }),
+        ).expect("Writing to memory failed");
+        buf.push(0);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    use ::keyboard::check_keymap;
+
+    fn assign(slots: &mut Slots, keysyms: &[&str], held: &[KeyCode])
+        -> Option<(Vec<KeyCode>, bool)>
+    {
+        let mut keycodes = Vec::new();
+        slots.assign(keysyms.iter().cloned(), held, &mut keycodes)
+            .map(|changed| (keycodes, changed))
+    }
+
+    fn get_keymap_str(slots: &Slots) -> String {
+        let mut buf = Vec::new();
+        slots.write_keymap(&mut buf);
+        assert_eq!(buf.pop(), Some(0));
+        String::from_utf8(buf).unwrap()
+    }
+
+    #[test]
+    fn reuses_least_recent() {
+        let mut slots = Slots::with_capacity(3);
+        assert_eq!(
+            assign(&mut slots, &["a", "b"], &[]),
+            Some((vec![9, 10], true)),
+        );
+        assert_eq!(assign(&mut slots, &["c"], &[]), Some((vec![11], true)));
+        assert_eq!(assign(&mut slots, &["a"], &[]), Some((vec![9], false)));
+        // "b" is the least recently used
+        assert_eq!(assign(&mut slots, &["d"], &[]), Some((vec![10], true)));
+        // "c" is held, so "a" goes
+        assert_eq!(assign(&mut slots, &["e"], &[11]), Some((vec![9], true)));
+        check_keymap(&get_keymap_str(&slots)).unwrap();
+        assert!(get_keymap_str(&slots).contains("<e> = 9;"));
+    }
+
+    #[test]
+    fn full() {
+        let mut slots = Slots::with_capacity(2);
+        assert_eq!(assign(&mut slots, &["a", "b", "c"], &[]), None);
+        assert_eq!(assign(&mut slots, &["a"], &[]), Some((vec![9], true)));
+        assert_eq!(
+            assign(&mut slots, &["b", "c"], &[]),
+            Some((vec![10, 9], true)),
+        );
+        // Held keys keep their keycodes
+        assert_eq!(assign(&mut slots, &["d"], &[9, 10]), None);
+        // One keycode is enough for a repeated keysym
+        assert_eq!(
+            assign(&mut slots, &["c", "c"], &[]),
+            Some((vec![9, 9], false)),
+        );
+    }
+}
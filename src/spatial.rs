@@ -0,0 +1,460 @@
+/*! Learning where the user touches each key.
+ *
+ * Fingers rarely land on key centres,
+ * and each user misses them in their own, consistent way:
+ * a bit low, or towards the thumb.
+ * Every key gets a 2D Gaussian of where it gets touched,
+ * learned from keystrokes the user accepted,
+ * meaning that the next key pressed was not Erase.
+ *
+ * Touches are measured from the key centre, in units of the key size.
+ * Keys are identified by name,
+ * so what's learned on one layout carries over to similar ones.
+ *
+ * Hit testing starts from the key under the finger,
+ * and lets the keys nearby compete with it.
+ * The key most likely to have been aimed at wins.
+ * Only keys with enough learned touches can win
+ * over the key under the finger,
+ * so an untrained model acts like plain geometry.
+ *
+ * The model is stored in the data directory, `squeekboard/touch_model`,
+ * with one key per line.
+ * All layouts share the one loaded model, the same way they share the file,
+ * so that saving one layout doesn't undo what another learned.
+ */
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::ffi::{ CStr, CString };
+use std::fs;
+use std::io;
+use std::path::PathBuf;
+use std::rc::Rc;
+
+use ::layout::Size;
+use ::layout::c::Point;
+use ::logging;
+use ::xdg;
+
+// traits
+use std::io::{ BufRead, Write };
+
+/// Touches a key needs to take over touches from its neighbours
+const MIN_SAMPLES: u32 = 20;
+
+/// Older touches fade out after this many,
+/// so that the model follows changes in the user's habits
+const WINDOW: u32 = 200;
+
+/// Spread of touches on an untrained key, in key sizes
+const PRIOR_DEVIATION: f64 = 0.3;
+
+/// Keeps a key from becoming a needle after a run of identical touches
+const MIN_VARIANCE: f64 = 0.05 * 0.05;
+
+/// Keys further away from the touch than this don't compete, in key sizes
+const REACH: f64 = 1.0;
+
+/// New touches before the model is worth saving while in use
+const SAVE_INTERVAL: u32 = 100;
+
+/// Axis-aligned, because rows and columns are what keys are placed along
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct Gaussian {
+    mean: (f64, f64),
+    variance: (f64, f64),
+    /// Touches learned, up to WINDOW
+    count: u32,
+}
+
+impl Gaussian {
+    fn prior() -> Gaussian {
+        let variance = PRIOR_DEVIATION * PRIOR_DEVIATION;
+        Gaussian {
+            mean: (0.0, 0.0),
+            variance: (variance, variance),
+            count: 0,
+        }
+    }
+
+    fn is_trained(&self) -> bool {
+        self.count >= MIN_SAMPLES
+    }
+
+    /// Exponentially weighted after WINDOW touches
+    fn add(&mut self, x: f64, y: f64) {
+        if self.count < WINDOW {
+            self.count += 1;
+        }
+        let weight = 1.0 / self.count as f64;
+        let update = |mean: &mut f64, variance: &mut f64, value: f64| {
+            let delta = value - *mean;
+            *mean += weight * delta;
+            *variance = (1.0 - weight) * (*variance + weight * delta * delta);
+        };
+        update(&mut self.mean.0, &mut self.variance.0, x);
+        update(&mut self.mean.1, &mut self.variance.1, y);
+    }
+
+    /// Log of the density, without the constant term
+    fn log_likelihood(&self, x: f64, y: f64) -> f64 {
+        let (vx, vy) = (
+            self.variance.0.max(MIN_VARIANCE),
+            self.variance.1.max(MIN_VARIANCE),
+        );
+        let (dx, dy) = (x - self.mean.0, y - self.mean.1);
+        -0.5 * (dx * dx / vx + dy * dy / vy + (vx * vy).ln())
+    }
+}
+
+/// Refers to a key in the model
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct KeyId(usize);
+
+pub struct Model {
+    keys: Vec<(CString, Gaussian)>,
+    ids: HashMap<CString, KeyId>,
+    /// The last touch, waiting to get accepted
+    pending: Option<(KeyId, (f64, f64))>,
+    /// Touches learned since the last save
+    unsaved: u32,
+    /// Where to save. Nowhere if None
+    path: Option<PathBuf>,
+}
+
+/// A model used by several layouts
+pub type Shared = Rc<RefCell<Model>>;
+
+thread_local! {
+    /// The stored model, loaded on first use.
+    /// Only the main thread handles touches.
+    static STORED: RefCell<Option<Shared>> = RefCell::new(None);
+}
+
+/// Returns the model from the data directory.
+/// Every call on the thread returns the same one.
+pub fn get_stored() -> Shared {
+    STORED.with(|stored| {
+        stored.borrow_mut()
+            .get_or_insert_with(|| {
+                let mut model = Model::new();
+                model.load_stored();
+                Rc::new(RefCell::new(model))
+            })
+            .clone()
+    })
+}
+
+/// Returns the position relative to the centre of the key, in key sizes
+pub fn get_relative(point: &Point, key_offset: &Point, size: &Size)
+    -> (f64, f64)
+{
+    (
+        (point.x - key_offset.x) / size.width - 0.5,
+        (point.y - key_offset.y) / size.height - 0.5,
+    )
+}
+
+impl Model {
+    /// Creates an empty model which is never saved
+    pub fn new() -> Model {
+        Model {
+            keys: Vec::new(),
+            ids: HashMap::new(),
+            pending: None,
+            unsaved: 0,
+            path: None,
+        }
+    }
+
+    /// Makes sure the key can be learned without allocating later
+    pub fn add_key(&mut self, name: &CStr) -> KeyId {
+        if let Some(id) = self.ids.get(name) {
+            return *id;
+        }
+        let id = KeyId(self.keys.len());
+        self.keys.push((name.to_owned(), Gaussian::prior()));
+        self.ids.insert(name.to_owned(), id);
+        id
+    }
+
+    pub fn find(&self, name: &CStr) -> Option<KeyId> {
+        self.ids.get(name).cloned()
+    }
+
+    /// Returns the learned model, if enough was learned
+    fn get_trained(&self, name: &CStr) -> Option<&Gaussian> {
+        self.find(name)
+            .map(|KeyId(i)| &self.keys[i].1)
+            .filter(|gaussian| gaussian.is_trained())
+    }
+
+    /// Log likelihood that a touch at the point was aimed at the key.
+    /// Comparable across keys of different sizes.
+    fn score(&self, name: &CStr, point: &Point, key_offset: &Point, size: &Size)
+        -> f64
+    {
+        let prior = Gaussian::prior();
+        let gaussian = self.get_trained(name).unwrap_or(&prior);
+        let (x, y) = get_relative(point, key_offset, size);
+        // The density is spread over the area of the key
+        gaussian.log_likelihood(x, y) - (size.width * size.height).ln()
+    }
+
+    /// Picks the key the touch was aimed at.
+    /// `candidates` are the keys around the point,
+    /// as (name, offset, size, whether it's under the point, payload).
+    /// Returns the payload of the winner.
+    pub fn resolve<'a, T, I>(&self, point: &Point, candidates: I) -> Option<T>
+        where I: Iterator<Item=(&'a CStr, Point, &'a Size, bool, T)>
+    {
+        let mut best: Option<(f64, T)> = None;
+        for (name, offset, size, is_under, payload) in candidates {
+            let (x, y) = get_relative(point, &offset, size);
+            let is_near = x.abs() < REACH && y.abs() < REACH;
+            if !(is_under || (is_near && self.get_trained(name).is_some())) {
+                continue;
+            }
+            let score = self.score(name, point, &offset, size);
+            let is_better = match &best {
+                Some((best_score, _)) => score > *best_score,
+                None => true,
+            };
+            if is_better {
+                best = Some((score, payload));
+            }
+        }
+        best.map(|(_score, payload)| payload)
+    }
+
+    /// Remembers the touch, to learn from it when the next one comes.
+    /// A touch on Erase rejects the previous touch,
+    /// and isn't learned itself.
+    pub fn handle_touch(
+        &mut self,
+        key: Option<KeyId>,
+        position: (f64, f64),
+        is_erase: bool,
+    ) {
+        let previous = self.pending.take();
+        if is_erase {
+            return;
+        }
+        if let Some((KeyId(i), (x, y))) = previous {
+            self.keys[i].1.add(x, y);
+            // Saving is left for later, away from handling touches
+            self.unsaved += 1;
+        }
+        self.pending = key.map(|key| (key, position));
+    }
+
+    /// Reads the model from the data directory.
+    /// Learned touches will be saved back there.
+    fn load_stored(&mut self) {
+        self.pending = None;
+        self.unsaved = 0;
+        self.path = xdg::data_path("squeekboard/touch_model");
+        let path = match &self.path {
+            Some(path) => path.clone(),
+            None => return,
+        };
+        match self.read(&path) {
+            Ok(()) => {},
+            Err(ref e) if e.kind() == io::ErrorKind::NotFound => {},
+            Err(e) => log_print!(
+                logging::Level::Warning,
+                "Can't read touch model {:?}: {}", path, e,
+            ),
+        }
+    }
+
+    fn read(&mut self, path: &PathBuf) -> io::Result<()> {
+        let file = io::BufReader::new(fs::File::open(path)?);
+        for line in file.lines() {
+            let line = line?;
+            if line.starts_with('#') || line.trim().is_empty() {
+                continue;
+            }
+            match parse_line(&line) {
+                Some((name, gaussian)) => {
+                    let KeyId(i) = self.add_key(&name);
+                    self.keys[i].1 = gaussian;
+                },
+                None => log_print!(
+                    logging::Level::Warning,
+                    "Bad line in touch model, skipping: {}", line,
+                ),
+            }
+        }
+        Ok(())
+    }
+
+    /// Saves the model if it learned enough to be worth the write.
+    /// Meant for when the keyboard is idle.
+    pub fn save_if_due(&mut self) {
+        if self.unsaved >= SAVE_INTERVAL {
+            self.save();
+        }
+    }
+
+    /// Saves the model, if it has a place to go and learned anything
+    pub fn save(&mut self) {
+        let path = match &self.path {
+            Some(path) if self.unsaved > 0 => path,
+            _ => return,
+        };
+        match self.write(path) {
+            Ok(()) => self.unsaved = 0,
+            Err(e) => log_print!(
+                logging::Level::Warning,
+                "Can't save touch model {:?}: {}", path, e,
+            ),
+        }
+    }
+
+    fn write(&self, path: &PathBuf) -> io::Result<()> {
+        if let Some(dir) = path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+        // Written to the side and moved, so that a crash can't corrupt it
+        let temporary = path.with_extension("new");
+        {
+            let mut file = io::BufWriter::new(fs::File::create(&temporary)?);
+            writeln!(file, "# name mean_x mean_y variance_x variance_y count")?;
+            for (name, gaussian) in &self.keys {
+                // Nothing to save
+                if gaussian.count == 0 {
+                    continue;
+                }
+                writeln!(
+                    file,
+                    "{} {:.4} {:.4} {:.4} {:.4} {}",
+                    name.to_string_lossy(),
+                    gaussian.mean.0, gaussian.mean.1,
+                    gaussian.variance.0, gaussian.variance.1,
+                    gaussian.count,
+                )?;
+            }
+            file.flush()?;
+        }
+        fs::rename(&temporary, path)
+    }
+}
+
+fn parse_line(line: &str) -> Option<(CString, Gaussian)> {
+    let mut fields = line.split_whitespace();
+    let name = CString::new(fields.next()?).ok()?;
+    let mut number = || fields.next().and_then(|f| f.parse::<f64>().ok());
+    let mean = (number()?, number()?);
+    let variance = (number()?, number()?);
+    let count = number()?;
+    let is_valid = variance.0 >= 0.0 && variance.1 >= 0.0
+        && count >= 0.0 && mean.0.is_finite() && mean.1.is_finite();
+    if !is_valid {
+        return None;
+    }
+    Some((name, Gaussian {
+        mean,
+        variance,
+        count: (count as u32).min(WINDOW),
+    }))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn name(s: &str) -> CString {
+        CString::new(s).unwrap()
+    }
+
+    #[test]
+    fn learning() {
+        let mut gaussian = Gaussian::prior();
+        for i in 0..MIN_SAMPLES {
+            gaussian.add(0.1, if i % 2 == 0 { 0.3 } else { 0.5 });
+        }
+        assert!(gaussian.is_trained());
+        assert!((gaussian.mean.0 - 0.1).abs() < 0.0001);
+        assert!((gaussian.mean.1 - 0.4).abs() < 0.0001);
+        assert!(gaussian.variance.0.abs() < 0.0001);
+        assert!((gaussian.variance.1 - 0.01).abs() < 0.0001);
+    }
+
+    #[test]
+    fn erase_rejects() {
+        let mut model = Model::new();
+        let a = model.add_key(&name("a"));
+        let erase = model.add_key(&name("BackSpace"));
+        model.handle_touch(Some(a), (0.4, 0.4), false);
+        model.handle_touch(Some(erase), (0.0, 0.0), true);
+        model.handle_touch(Some(a), (0.1, 0.1), false);
+        model.handle_touch(None, (0.0, 0.0), false);
+        assert_eq!(model.keys[0].1.count, 1);
+        assert_eq!(model.keys[0].1.mean, (0.1, 0.1));
+        assert_eq!(model.keys[1].1.count, 0);
+    }
+
+    #[test]
+    fn resolve_trained() {
+        let size = Size { width: 10.0, height: 10.0 };
+        let upper = Point { x: 0.0, y: 0.0 };
+        let lower = Point { x: 0.0, y: 10.0 };
+        let touch = Point { x: 5.0, y: 12.0 };
+        let candidates = || vec![
+            (name("q"), upper.clone(), false),
+            (name("a"), lower.clone(), true),
+        ];
+        let resolve = |model: &Model| model.resolve(
+            &touch,
+            candidates().iter().enumerate().map(|(i, (n, o, under))| {
+                (n.as_c_str(), o.clone(), &size, *under, i)
+            }),
+        );
+
+        let mut model = Model::new();
+        let q = model.add_key(&name("q"));
+        model.add_key(&name("a"));
+        // Untrained, geometry wins
+        assert_eq!(resolve(&model), Some(1));
+        // The user touches "q" low
+        for _ in 0..MIN_SAMPLES + 1 {
+            model.handle_touch(Some(q), (0.0, 0.6), false);
+        }
+        assert_eq!(resolve(&model), Some(0));
+    }
+
+    #[test]
+    fn saves_when_due() {
+        let dir = std::env::temp_dir()
+            .join(format!("squeekboard-spatial-{}", std::process::id()));
+        let path = dir.join("touch_model");
+        let mut model = Model::new();
+        model.path = Some(path.clone());
+        let a = model.add_key(&name("a"));
+        for _ in 0..SAVE_INTERVAL + 1 {
+            model.handle_touch(Some(a), (0.0, 0.0), false);
+        }
+        // Touches only learn, never write
+        assert!(!path.exists());
+        model.save_if_due();
+        assert!(path.exists());
+        assert_eq!(model.unsaved, 0);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn parse() {
+        assert_eq!(
+            parse_line("a 0.1 -0.2 0.01 0.02 30"),
+            Some((name("a"), Gaussian {
+                mean: (0.1, -0.2),
+                variance: (0.01, 0.02),
+                count: 30,
+            })),
+        );
+        assert_eq!(parse_line("a 0.1 -0.2 -0.01 0.02 30"), None);
+        assert_eq!(parse_line("a 0.1"), None);
+    }
+}
@@ -4,6 +4,7 @@
 #include "input-method-unstable-v2-client-protocol.h"
 #include "virtual-keyboard-unstable-v1-client-protocol.h"
 #include "eek/eek-types.h"
+#include "src/layout.h"
 
 struct submission;
 
@@ -14,6 +15,8 @@ struct submission* get_submission(struct zwp_input_method_manager_v2 *immanager,
 
 // Defined in Rust
 struct submission* submission_new(struct zwp_input_method_v2 *im, struct zwp_virtual_keyboard_v1 *vk, EekboardContextService *state);
+void submission_flush(struct submission *self);
 void submission_set_ui(struct submission *self, ServerContextService *ui_context);
-void submission_set_keyboard(struct submission *self, LevelKeyboard *keyboard, uint32_t time);
+void submission_set_keyboard(struct submission *self, LevelKeyboard *keyboard,
+                             const struct squeek_layout *layout, uint32_t time);
 #endif
@@ -17,19 +17,20 @@
  * and those events SHOULD NOT cause any lost events.
  * */
 
-use std::collections::HashSet;
 use std::ffi::CString;
+use std::sync::Arc;
 use ::action::Modifier;
+use ::imrecord::Event;
 use ::imservice;
 use ::imservice::IMService;
-use ::keyboard::{ KeyCode, KeyStateId, Modifiers, PressType };
+use ::keyboard::{ Key, KeyCode, KeyStateId, Modifiers, PressType };
+use ::layout::KeymapKind;
 use ::layout::c::LevelKeyboard;
+use ::logging;
+use ::slots::Slots;
 use ::util::vec_remove;
 use ::vkeyboard::VirtualKeyboard;
 
-// traits
-use std::iter::FromIterator;
-
 /// Gathers stuff defined in C or called by C
 pub mod c {
     use super::*;
@@ -37,6 +38,7 @@ pub mod c {
     use std::os::raw::c_void;
 
     use ::imservice::c::InputMethod;
+    use ::layout::Layout;
     use ::vkeyboard::c::ZwpVirtualKeyboardV1;
 
     // The following defined in C
@@ -63,12 +65,7 @@ pub mod c {
         };
         // TODO: add vkeyboard too
         Box::<Submission>::into_raw(Box::new(
-            Submission {
-                imservice,
-                modifiers_active: Vec::new(),
-                virtual_keyboard: VirtualKeyboard(vk),
-                pressed: Vec::new(),
-            }
+            Submission::new(imservice, VirtualKeyboard(vk))
         ))
     }
 
@@ -89,18 +86,35 @@ pub mod c {
         };
     }
 
+    /// Sends submitted text. Call when a batch of input is handled.
+    #[no_mangle]
+    pub extern "C"
+    fn submission_flush(submission: *mut Submission) {
+        if submission.is_null() {
+            panic!("Null submission pointer");
+        }
+        let submission: &mut Submission = unsafe { &mut *submission };
+        submission.flush();
+    }
+
     #[no_mangle]
     pub extern "C"
     fn submission_set_keyboard(
         submission: *mut Submission,
         keyboard: LevelKeyboard,
+        layout: *const Layout,
         time: u32,
     ) {
         if submission.is_null() {
             panic!("Null submission pointer");
         }
         let submission: &mut Submission = unsafe { &mut *submission };
-        submission.update_keymap(keyboard, Timestamp(time));
+        let layout = unsafe { &*layout };
+        submission.update_keymap(
+            keyboard,
+            layout.arrangement.keymap_kind,
+            Timestamp(time),
+        );
     }
 }
 
@@ -110,7 +124,7 @@ pub struct Timestamp(pub u32);
 #[derive(Clone)]
 enum SubmittedAction {
     /// A collection of keycodes that were pressed
-    VirtualKeyboard(Vec<KeyCode>),
+    VirtualKeyboard(Arc<Vec<KeyCode>>),
     IMService,
 }
 
@@ -119,6 +133,16 @@ pub struct Submission {
     virtual_keyboard: VirtualKeyboard,
     modifiers_active: Vec<(KeyStateId, Modifier)>,
     pressed: Vec<(KeyStateId, SubmittedAction)>,
+    /// What the compositor's keymap is, None before the first one
+    keymap_sent: Option<KeymapKind>,
+    /// Keycodes for layouts which get them on demand
+    slots: Slots,
+    // Buffers for on-demand keycodes, kept to avoid allocating
+    /// Keycodes of held keys
+    held: Vec<KeyCode>,
+    /// Keycode lists of released keys, not shared with anything
+    spare_keycodes: Vec<Arc<Vec<KeyCode>>>,
+    keymap: Vec<u8>,
 }
 
 pub enum SubmitData<'a> {
@@ -128,15 +152,44 @@ pub enum SubmitData<'a> {
 }
 
 impl Submission {
+    pub fn new(
+        imservice: Option<Box<IMService>>,
+        virtual_keyboard: VirtualKeyboard,
+    ) -> Submission {
+        // Preallocated, so that pressing keys doesn't need to allocate
+        Submission {
+            imservice,
+            modifiers_active: Vec::with_capacity(4),
+            virtual_keyboard,
+            pressed: Vec::with_capacity(10),
+            keymap_sent: None,
+            slots: Slots::new(),
+            held: Vec::with_capacity(10),
+            spare_keycodes: Vec::with_capacity(10),
+            keymap: Vec::new(),
+        }
+    }
+
     /// Sends a submit text event if possible;
-    /// otherwise sends key press and makes a note of it
+    /// otherwise sends key press and makes a note of it.
+    /// Returns whether holding the key needs `handle_repeat`.
     pub fn handle_press(
         &mut self,
         key_id: KeyStateId,
         data: SubmitData,
-        keycodes: &Vec<KeyCode>,
+        key: &Key,
         time: Timestamp,
-    ) {
+    ) -> bool {
+        match (&mut self.imservice, &data) {
+            (Some(imservice), SubmitData::Text(text)) => imservice.record(|| {
+                Event::PressText(text.to_string_lossy().into_owned())
+            }),
+            (Some(imservice), SubmitData::Erase) => {
+                imservice.record(|| Event::PressErase)
+            },
+            _ => {},
+        }
+
         let mods_are_on = !self.modifiers_active.is_empty();
 
         let was_committed_as_text = match (&mut self.imservice, mods_are_on) {
@@ -152,11 +205,15 @@ impl Submission {
                     },
                     SubmitData::Erase => {
                         /* Delete_surrounding_text takes byte offsets,
-                         * so cannot work without get_surrounding_text.
-                         * This is a bug in the protocol.
+                         * so it needs the surrounding text.
+                         * Without it, the keycodes take over.
                          */
-                        // imservice.delete_surrounding_text(1, 0),
-                        Outcome::NotSubmitted
+                        match imservice.get_erase_len() {
+                            Some(len) => Outcome::Submitted(
+                                imservice.delete_surrounding_text(len, 0)
+                            ),
+                            None => Outcome::NotSubmitted,
+                        }
                     },
                     SubmitData::Keycodes => Outcome::NotSubmitted,
                 };
@@ -177,19 +234,86 @@ impl Submission {
         let submit_action = match was_committed_as_text {
             true => SubmittedAction::IMService,
             false => {
+                self.flush();
+                let keycodes = match self.keymap_sent {
+                    Some(KeymapKind::OnDemand) => self.assign_keycodes(key),
+                    _ => key.keycodes.clone(),
+                };
                 self.virtual_keyboard.switch(
-                    keycodes,
+                    &keycodes,
                     PressType::Pressed,
                     time,
                 );
-                SubmittedAction::VirtualKeyboard(keycodes.clone())
+                SubmittedAction::VirtualKeyboard(keycodes)
             },
         };
 
+        // The receiving side repeats held keycodes by itself
+        let repeats = match &submit_action {
+            SubmittedAction::IMService => true,
+            SubmittedAction::VirtualKeyboard(keycodes) => keycodes.len() > 1,
+        };
+
         self.modifiers_active.truncate(0);
         self.pressed.push((key_id, submit_action));
+        repeats
     }
     
+    /// Sends the text submitted so far.
+    /// Text gets queued, so that text submitted in quick succession
+    /// goes out as one commit.
+    /// Virtual keyboard events must not overtake it.
+    pub fn flush(&mut self) {
+        if let Some(imservice) = &mut self.imservice {
+            imservice.flush();
+        }
+    }
+
+    /// Gives the key keycodes from the slots,
+    /// sending a new keymap if they changed.
+    fn assign_keycodes(&mut self, key: &Key) -> Arc<Vec<KeyCode>> {
+        self.held.clear();
+        for (_id, action) in self.pressed.iter() {
+            if let SubmittedAction::VirtualKeyboard(keycodes) = action {
+                self.held.extend(keycodes.iter().cloned());
+            }
+        }
+        let mut keycodes = self.spare_keycodes.pop()
+            .unwrap_or_else(|| Arc::new(Vec::new()));
+        let changed = self.slots.assign(
+            key.iter_keysyms(),
+            &self.held,
+            Arc::get_mut(&mut keycodes).expect("Spare keycodes are shared"),
+        );
+        match changed {
+            Some(true) => {
+                self.send_slots_keymap();
+                // The new keymap may have reset them
+                if !self.modifiers_active.is_empty() {
+                    self.update_modifiers();
+                }
+            },
+            Some(false) => {},
+            None => log_print!(
+                logging::Level::Warning,
+                "No keycodes left for {:?}, dropping", key.action,
+            ),
+        }
+        keycodes
+    }
+
+    fn send_slots_keymap(&mut self) {
+        self.slots.write_keymap(&mut self.keymap);
+        self.virtual_keyboard.set_keymap(&self.keymap);
+    }
+
+    /// Keeps the keycodes for reuse, if nothing else holds them
+    fn recycle_keycodes(&mut self, mut keycodes: Arc<Vec<KeyCode>>) {
+        if Arc::get_mut(&mut keycodes).is_some() {
+            self.spare_keycodes.push(keycodes);
+        }
+    }
+
     pub fn handle_release(&mut self, key_id: KeyStateId, time: Timestamp) {
         let index = self.pressed.iter().position(|(id, _)| *id == key_id);
         if let Some(index) = index {
@@ -200,16 +324,117 @@ impl Submission {
                 // no matter if the imservice got activated,
                 // keys must be released
                 SubmittedAction::VirtualKeyboard(keycodes) => {
+                    self.flush();
                     self.virtual_keyboard.switch(
                         &keycodes,
                         PressType::Released,
                         time,
-                    )
+                    );
+                    self.recycle_keycodes(keycodes);
                 },
             }
         };
     }
     
+    /// Submits a held key again, `count` times.
+    /// Keys held on the virtual keyboard are already repeated
+    /// by the receiving side, like physical keys.
+    /// The exception are keys made of multiple keycodes,
+    /// which were released immediately.
+    pub fn handle_repeat(
+        &mut self,
+        key_id: KeyStateId,
+        data: SubmitData,
+        count: u32,
+        time: Timestamp,
+    ) {
+        let action = self.pressed.iter()
+            .find(|(id, _action)| *id == key_id)
+            .map(|(_id, action)| action);
+        match (action, &mut self.imservice, data) {
+            (
+                Some(SubmittedAction::IMService),
+                Some(imservice),
+                SubmitData::Text(text),
+            ) => {
+                // All repeats within one commit
+                let result = (0..count).fold(
+                    Ok(()),
+                    |result, _| result.and_then(|()| {
+                        imservice.commit_string(text)
+                    }),
+                );
+                match result.and_then(|()| imservice.commit()) {
+                    Ok(()) => {},
+                    // The text field went away, the repeats have no target
+                    Err(imservice::SubmitError::NotActive) => {},
+                }
+            },
+            (
+                Some(SubmittedAction::IMService),
+                Some(imservice),
+                SubmitData::Erase,
+            ) => {
+                let mut result = Ok(());
+                for _ in 0..count {
+                    // Stops at the start of the known text
+                    match imservice.get_erase_len() {
+                        Some(len) => {
+                            result = imservice.delete_surrounding_text(len, 0);
+                            if result.is_err() {
+                                break;
+                            }
+                        },
+                        None => break,
+                    }
+                }
+                match result.and_then(|()| imservice.commit()) {
+                    Ok(()) => {},
+                    Err(imservice::SubmitError::NotActive) => {},
+                }
+            },
+            (Some(SubmittedAction::VirtualKeyboard(keycodes)), imservice, _) => {
+                if keycodes.len() > 1 {
+                    if let Some(imservice) = imservice {
+                        imservice.flush();
+                    }
+                    for _ in 0..count {
+                        self.virtual_keyboard.switch(
+                            keycodes,
+                            PressType::Pressed,
+                            time,
+                        );
+                    }
+                }
+            },
+            _ => {},
+        }
+    }
+
+    /// Submits text which doesn't come from any key.
+    /// Only the input method can do it.
+    pub fn submit_text(&mut self, text: &CString) {
+        if let Some(imservice) = &mut self.imservice {
+            let result = imservice.commit_string(text)
+                .and_then(|()| imservice.commit());
+            if let Err(imservice::SubmitError::NotActive) = result {
+                log_print!(
+                    logging::Level::Surprise,
+                    "Text field went away, dropping {:?}", text,
+                );
+            }
+        }
+    }
+
+    /// Whether text can be submitted as is
+    pub fn is_text_input_active(&self) -> bool {
+        self.modifiers_active.is_empty()
+            && match &self.imservice {
+                Some(imservice) => imservice.is_active(),
+                None => false,
+            }
+    }
+
     pub fn handle_add_modifier(
         &mut self,
         key_id: KeyStateId,
@@ -237,6 +462,7 @@ impl Submission {
                 Modifier::Shift => Modifiers::SHIFT,
             })
             .fold(Modifiers::empty(), |m, n| m | n);
+        self.flush();
         self.virtual_keyboard.set_modifiers_state(raw_modifiers);
     }
 
@@ -246,12 +472,6 @@ impl Submission {
             .is_some()
     }
 
-    pub fn get_active_modifiers(&self) -> HashSet<Modifier> {
-        HashSet::from_iter(
-            self.modifiers_active.iter().map(|(_id, m)| m.clone())
-        )
-    }
-
     fn clear_all_modifiers(&mut self) {
         // Looks like an optimization,
         // but preemptive cleaning is needed before setting a new keymap,
@@ -260,6 +480,7 @@ impl Submission {
             return;
         }
         self.modifiers_active = Vec::new();
+        self.flush();
         self.virtual_keyboard.set_modifiers_state(Modifiers::empty())
     }
 
@@ -286,9 +507,35 @@ impl Submission {
     /// Alternatively, modifiers could be restored on the new keymap.
     /// That approach might be difficult
     /// due to modifiers meaning different things in different keymaps.
-    pub fn update_keymap(&mut self, keyboard: LevelKeyboard, time: Timestamp) {
+    ///
+    /// When the keymap is a shared one, and the compositor already has
+    /// the same or a later generation, sending it is skipped.
+    /// The same goes for the keymap of keycodes assigned on demand.
+    /// Clearing still happens,
+    /// because the buttons holding modifiers belong to the old layout.
+    pub fn update_keymap(
+        &mut self,
+        keyboard: LevelKeyboard,
+        kind: KeymapKind,
+        time: Timestamp,
+    ) {
         self.clear_all_modifiers();
         self.release_all_virtual_keys(time);
-        self.virtual_keyboard.update_keymap(keyboard);
+        let covered = match (kind, self.keymap_sent) {
+            (
+                KeymapKind::Shared(new),
+                Some(KeymapKind::Shared(sent)),
+            ) => new <= sent,
+            (KeymapKind::OnDemand, Some(KeymapKind::OnDemand)) => true,
+            _ => false,
+        };
+        if !covered {
+            self.flush();
+            match kind {
+                KeymapKind::OnDemand => self.send_slots_keymap(),
+                _ => self.virtual_keyboard.update_keymap(keyboard),
+            }
+            self.keymap_sent = Some(kind);
+        }
     }
 }
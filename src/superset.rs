@@ -0,0 +1,231 @@
+/*! A keymap shared by the layouts in use.
+ *
+ * Each layout compiles its own keymap, and sending a different one
+ * to the compositor makes the compositor and every client parse it again.
+ * Instead, the keysyms of all layouts loaded so far get collected
+ * into one keymap, in which a keysym keeps its keycode forever.
+ * Every keymap covers the keysyms of all the keymaps before it,
+ * so switching layouts needs a new keymap only when a new keysym appears.
+ *
+ * The layouts from the input source list and the overlays
+ * get prepared ahead of time, so that happens mostly at startup.
+ *
+ * There are only 247 keycodes to give out.
+ * A layout which doesn't fit keeps its own keymap,
+ * and a layout too big for any keymap gets keycodes on demand instead.
+ */
+
+use std::collections::{ BTreeMap, HashMap };
+use std::ffi::CString;
+use std::sync::{ Arc, Mutex };
+
+use ::keyboard::{ format_keymap, KeyCode, FIRST_KEYCODE, KEYCODE_COUNT };
+use ::layout::{ Arrangement, KeymapKind };
+use ::logging;
+
+pub mod c {
+    use super::*;
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_keymap_superset_new() -> *mut Superset {
+        Box::into_raw(Box::new(Superset::new()))
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_keymap_superset_free(superset: *mut Superset) {
+        drop(unsafe { Box::from_raw(superset) });
+    }
+}
+
+/// Tells keymaps of the same superset apart.
+/// A later generation contains all the keycodes of an earlier one.
+#[derive(Debug, Clone, Copy, PartialEq, PartialOrd)]
+pub struct Generation(u32);
+
+struct Keysyms {
+    /// Indexed by keycode - FIRST_KEYCODE
+    names: Vec<String>,
+    codes: HashMap<String, KeyCode>,
+    keymap_str: CString,
+    generation: Generation,
+}
+
+impl Keysyms {
+    fn update_keymap(&mut self) {
+        let keysyms: BTreeMap<KeyCode, &str> = self.names.iter()
+            .enumerate()
+            .map(|(i, name)| (FIRST_KEYCODE + i as KeyCode, name.as_str()))
+            .collect();
+        let keymap_str = format_keymap(&keysyms)
+            .expect("Failed to format shared keymap");
+        self.keymap_str = CString::new(keymap_str)
+            .expect("Keymap contains a null byte");
+    }
+}
+
+/// Keysyms seen so far. Shared by the threads preparing layouts.
+pub struct Superset {
+    keysyms: Mutex<Keysyms>,
+}
+
+impl Superset {
+    pub fn new() -> Superset {
+        let mut keysyms = Keysyms {
+            names: Vec::new(),
+            codes: HashMap::new(),
+            keymap_str: CString::new("").unwrap(),
+            generation: Generation(0),
+        };
+        keysyms.update_keymap();
+        Superset { keysyms: Mutex::new(keysyms) }
+    }
+
+    /// Moves the keys of the arrangement to the shared keymap,
+    /// adding the keysyms it doesn't have yet.
+    /// Leaves the arrangement alone if they don't fit.
+    pub fn adopt(&self, arrangement: &mut Arrangement) {
+        if let KeymapKind::OnDemand = arrangement.keymap_kind {
+            return;
+        }
+        let mut keysyms = self.keysyms.lock().unwrap();
+        let mut missing: Vec<&str> = arrangement.keys.iter()
+            .flat_map(|key| key.get_keysyms())
+            .filter(|name| !keysyms.codes.contains_key(*name))
+            .collect();
+        // Sorted like when compiling, for the same keymap in every session
+        missing.sort();
+        missing.dedup();
+
+        if keysyms.names.len() + missing.len() > KEYCODE_COUNT {
+            log_print!(
+                logging::Level::Info,
+                "Shared keymap can't fit {} more keysyms, \
+                layout keeps its own keymap",
+                missing.len(),
+            );
+            return;
+        }
+
+        if missing.len() > 0 {
+            for name in missing {
+                let code = FIRST_KEYCODE + keysyms.names.len() as KeyCode;
+                keysyms.names.push(name.into());
+                keysyms.codes.insert(name.into(), code);
+            }
+            keysyms.update_keymap();
+            keysyms.generation = Generation(keysyms.generation.0 + 1);
+        }
+
+        for key in arrangement.keys.iter_mut() {
+            let keycodes = key.get_keysyms().into_iter()
+                .map(|name| keysyms.codes[name])
+                .collect();
+            key.keycodes = Arc::new(keycodes);
+        }
+        arrangement.keymap_str = keysyms.keymap_str.clone();
+        arrangement.keymap_kind = KeymapKind::Shared(keysyms.generation);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    use xkbcommon::xkb;
+
+    use ::action::{ Action, KeySym };
+    use ::data;
+    use ::keyboard::{ check_keymap, Key };
+    use ::layout::Margins;
+
+    fn load(name: &str) -> Arrangement {
+        data::load_builtin(name).unwrap()
+    }
+
+    /// Returns the keysyms submitted by each key according to the keymap
+    fn resolve(arrangement: &Arrangement) -> Vec<Vec<xkb::Keysym>> {
+        let keymap_str = arrangement.keymap_str.to_str().unwrap();
+        check_keymap(keymap_str).unwrap();
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let keymap = xkb::Keymap::new_from_string(
+            &context,
+            keymap_str.into(),
+            xkb::KEYMAP_FORMAT_TEXT_V1,
+            xkb::KEYMAP_COMPILE_NO_FLAGS,
+        ).unwrap();
+        let state = xkb::State::new(&keymap);
+        arrangement.keys.iter()
+            .map(|key| key.keycodes.iter()
+                .map(|keycode| state.key_get_one_sym(*keycode))
+                .collect()
+            )
+            .collect()
+    }
+
+    #[test]
+    fn grows() {
+        let superset = Superset::new();
+        let mut us = load("us");
+        let us_keysyms = resolve(&us);
+        superset.adopt(&mut us);
+        assert_eq!(resolve(&us), us_keysyms);
+        let first = us.keymap_kind;
+
+        let mut de = load("de");
+        let de_keysyms = resolve(&de);
+        superset.adopt(&mut de);
+        assert_eq!(resolve(&de), de_keysyms);
+        let second = de.keymap_kind;
+        match (first, second) {
+            (KeymapKind::Shared(first), KeymapKind::Shared(second)) => {
+                assert!(second > first)
+            },
+            other => panic!("Keymaps not shared: {:?}", other),
+        }
+
+        // The later keymap still works for the earlier layout
+        let us_keycodes: Vec<_> = us.keys.iter()
+            .map(|key| key.keycodes.clone())
+            .collect();
+        us.keymap_str = de.keymap_str.clone();
+        assert_eq!(resolve(&us), us_keysyms);
+
+        // Nothing new, so nothing changes
+        let mut us_again = load("us");
+        superset.adopt(&mut us_again);
+        assert_eq!(us_again.keymap_kind, second);
+        assert_eq!(
+            us_again.keys.iter().map(|key| key.keycodes.clone())
+                .collect::<Vec<_>>(),
+            us_keycodes,
+        );
+    }
+
+    #[test]
+    fn overflow() {
+        let make = |count| Arrangement {
+            views: HashMap::new(),
+            keymap_str: CString::new("own").unwrap(),
+            keymap_kind: KeymapKind::Own,
+            margins: Margins { top: 0.0, bottom: 0.0, left: 0.0, right: 0.0 },
+            keys: (0..count).map(|i| Key {
+                keycodes: Arc::new(vec![FIRST_KEYCODE + i as KeyCode]),
+                action: Action::Submit {
+                    text: None,
+                    keys: vec![KeySym(format!("U{:04X}", 0x100 + i))],
+                },
+            }).collect(),
+        };
+        let superset = Superset::new();
+        let mut fits = make(200);
+        superset.adopt(&mut fits);
+        assert_eq!(fits.keymap_kind, KeymapKind::Shared(Generation(1)));
+
+        let mut too_big = make(300);
+        superset.adopt(&mut too_big);
+        assert_eq!(too_big.keymap_kind, KeymapKind::Own);
+        assert_eq!(too_big.keymap_str, CString::new("own").unwrap());
+    }
+}
@@ -1,74 +1,146 @@
 /*! Testing functionality */
 
+use std::any::Any;
+use std::panic;
+use std::path::PathBuf;
+use std::sync::{ Arc, Mutex };
+use std::thread;
+use std::time::{ Duration, Instant };
+
 use ::data::Layout;
+use ::layout::KeymapKind;
 use ::logging;
 use xkbcommon::xkb;
 
 
-pub struct CountAndPrint(u32);
+#[cfg(target_os = "linux")]
+mod c {
+    use std::os::raw::{ c_int, c_long };
+
+    // The same in glibc and musl
+    pub const _SC_NPROCESSORS_ONLN: c_int = 84;
+
+    extern "C" {
+        // from libc
+        pub fn sysconf(name: c_int) -> c_long;
+    }
+}
+
+/// Keeps problems to be shown together with the layout they're about
+struct Collect {
+    problems: u32,
+    messages: Vec<String>,
+}
 
-impl logging::Handler for CountAndPrint {
-    fn handle(&mut self, level: logging::Level, warning: &str) {
+impl logging::Handler for Collect {
+    fn handle(&mut self, level: logging::Level, message: &str) {
         use logging::Level::*;
         match level {
             Panic | Bug | Error | Warning | Surprise => {
-                self.0 += 1;
+                self.problems += 1;
             },
             _ => {}
         }
-        logging::Print{}.handle(level, warning)
+        self.messages.push(format!("{}: {}", level.as_str(), message));
     }
 }
 
-impl CountAndPrint {
-    fn new() -> CountAndPrint {
-        CountAndPrint(0)
+impl Collect {
+    fn new() -> Collect {
+        Collect { problems: 0, messages: Vec::new() }
     }
 }
 
-pub fn check_builtin_layout(name: &str) {
-    check_layout(Layout::from_resource(name).expect("Invalid layout data"))
+/// A layout to check
+#[derive(Clone, Debug)]
+pub enum Input {
+    /// Needs the sources of built-in layouts
+    #[cfg(any(test, feature = "builtin_yaml"))]
+    Builtin(String),
+    File(PathBuf),
 }
 
-pub fn check_layout_file(path: &str) {
-    check_layout(Layout::from_file(path.into()).expect("Invalid layout file"))
+impl Input {
+    fn get_name(&self) -> String {
+        match self {
+            #[cfg(any(test, feature = "builtin_yaml"))]
+            Input::Builtin(name) => name.clone(),
+            Input::File(path) => path.display().to_string(),
+        }
+    }
 }
 
-fn check_layout(layout: Layout) {
-    let handler = CountAndPrint::new();
-    let (layout, handler) = layout.build(handler);
+#[derive(Clone, Debug)]
+pub struct Times {
+    pub parse: Duration,
+    pub build: Duration,
+    /// Compiling and checking
+    pub keymap: Duration,
+}
 
-    if handler.0 > 0 {
-        println!("{} problems while parsing layout", handler.0)
-    }
+/// The outcome of checking a single layout
+pub struct Report {
+    pub name: String,
+    /// None if the layout is unusable
+    pub times: Option<Times>,
+    /// Problems found, and reasons for failure
+    pub messages: Vec<String>,
+    pub passed: bool,
+}
+
+fn check(input: &Input, handler: &mut Collect) -> Result<Times, String> {
+    let start = Instant::now();
+    let layout = match input {
+        #[cfg(any(test, feature = "builtin_yaml"))]
+        Input::Builtin(name) => Layout::from_resource(name)
+            .map_err(|e| format!("Invalid layout data: {}", e))?,
+        Input::File(path) => Layout::from_file(path.clone())
+            .map_err(|e| format!("Invalid layout file: {}", e))?,
+    };
+    let parsed = Instant::now();
 
-    let layout = layout.expect("layout broken");
+    let (layout, h) = layout.build(Collect::new());
+    handler.problems += h.problems;
+    handler.messages.extend(h.messages);
+    let layout = layout.map_err(|e| format!("Layout broken: {}", e))?;
+    let built = Instant::now();
+
+    if let KeymapKind::OnDemand = layout.keymap_kind {
+        // No keymap, and keysyms were checked when parsing
+        return Ok(Times {
+            parse: parsed - start,
+            build: built - parsed,
+            keymap: Duration::from_secs(0),
+        });
+    }
 
     let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
-    
+
     let keymap_str = layout.keymap_str
         .clone()
         .into_string().expect("Failed to decode keymap string");
-    
+
     let keymap = xkb::Keymap::new_from_string(
         &context,
         keymap_str.clone(),
         xkb::KEYMAP_FORMAT_TEXT_V1,
         xkb::KEYMAP_COMPILE_NO_FLAGS,
-    ).expect("Failed to create keymap");
+    ).ok_or_else(|| format!("Failed to create keymap:\n{}", keymap_str))?;
 
     let state = xkb::State::new(&keymap);
-    
+
     // "Press" each button with keysyms
     for (_pos, view) in layout.views.values() {
-        for (_y, row) in &view.get_rows() {
+        for (_y, row) in view.get_rows() {
             for (_x, button) in &row.buttons {
-                let keystate = button.state.borrow();
-                for keycode in &keystate.keycodes {
+                let key = layout.get_key(button.key);
+                for keycode in key.keycodes.iter() {
                     match state.key_get_one_sym(*keycode) {
                         xkb::KEY_NoSymbol => {
-                            eprintln!("{}", keymap_str);
-                            panic!("Keysym {} on key {:?} can't be resolved", keycode, button.name);
+                            return Err(format!(
+                                "Keysym {} on key {:?} can't be resolved\n{}",
+                                keycode, button.name, keymap_str,
+                            ));
                         },
                         _ => {},
                     }
@@ -77,7 +149,162 @@ fn check_layout(layout: Layout) {
         }
     }
 
-    if handler.0 > 0 {
+    Ok(Times {
+        parse: parsed - start,
+        build: built - parsed,
+        keymap: built.elapsed(),
+    })
+}
+
+fn get_panic_message(payload: Box<dyn Any + Send>) -> String {
+    match payload.downcast::<String>() {
+        Ok(message) => *message,
+        Err(payload) => match payload.downcast::<&str>() {
+            Ok(message) => String::from(*message),
+            Err(_) => "Unknown panic".into(),
+        },
+    }
+}
+
+pub fn check_layout(input: &Input) -> Report {
+    let mut handler = Collect::new();
+    // A bug in one layout shouldn't take down the checks of others
+    let result = panic::catch_unwind(panic::AssertUnwindSafe(|| {
+        check(input, &mut handler)
+    }));
+    let result = match result {
+        Ok(result) => result,
+        Err(payload) => Err(format!("Panicked: {}", get_panic_message(payload))),
+    };
+    let mut messages = handler.messages;
+    let times = match result {
+        Ok(times) => Some(times),
+        Err(e) => {
+            messages.push(e);
+            None
+        },
+    };
+    Report {
+        name: input.get_name(),
+        passed: times.is_some() && handler.problems == 0,
+        times,
+        messages,
+    }
+}
+
+#[cfg(target_os = "linux")]
+pub fn get_processor_count() -> usize {
+    match unsafe { c::sysconf(c::_SC_NPROCESSORS_ONLN) } {
+        count if count > 0 => count as usize,
+        _ => 1,
+    }
+}
+
+/// Elsewhere, the constant is not known, so layouts get checked one by one
+#[cfg(not(target_os = "linux"))]
+pub fn get_processor_count() -> usize {
+    1
+}
+
+/// Checks layouts using `jobs` threads.
+/// Returns reports in the order of inputs.
+pub fn check_layouts(inputs: Vec<Input>, jobs: usize) -> Vec<Report> {
+    let count = inputs.len();
+    let queue = Arc::new(Mutex::new(inputs.into_iter().enumerate()));
+    let workers: Vec<_> = (0..jobs.max(1).min(count))
+        .map(|_| {
+            let queue = queue.clone();
+            thread::spawn(move || {
+                let mut reports = Vec::new();
+                loop {
+                    // The lock is released before checking
+                    let next = queue.lock().unwrap().next();
+                    match next {
+                        Some((i, input)) => {
+                            reports.push((i, check_layout(&input)))
+                        },
+                        None => break,
+                    }
+                }
+                reports
+            })
+        })
+        .collect();
+
+    let mut reports: Vec<_> = workers.into_iter()
+        .flat_map(|worker| worker.join().expect("Worker failed"))
+        .collect();
+    reports.sort_by_key(|(i, _report)| *i);
+    reports.into_iter().map(|(_i, report)| report).collect()
+}
+
+fn as_millis(duration: &Duration) -> f64 {
+    duration.as_secs() as f64 * 1000.0
+        + duration.subsec_nanos() as f64 / 1_000_000.0
+}
+
+/// Prints reports, one line per layout, followed by problems.
+/// Returns whether all layouts passed.
+pub fn print_reports(reports: &[Report]) -> bool {
+    for report in reports {
+        let status = if report.passed { "OK" } else { "FAIL" };
+        match &report.times {
+            Some(t) => println!(
+                "{}\t{}\tparse {:.3} ms\tbuild {:.3} ms\tkeymap {:.3} ms",
+                status, report.name,
+                as_millis(&t.parse), as_millis(&t.build), as_millis(&t.keymap),
+            ),
+            None => println!("{}\t{}", status, report.name),
+        }
+        for message in &report.messages {
+            println!("\t{}", message);
+        }
+    }
+    let failed = reports.iter().filter(|r| !r.passed).count();
+    if failed == 0 {
+        println!("Test result: OK");
+    } else {
+        println!(
+            "Test result: {} of {} layouts failed",
+            failed, reports.len(),
+        );
+    }
+    failed == 0
+}
+
+#[cfg(any(test, feature = "builtin_yaml"))]
+pub fn check_builtin_layout(name: &str) {
+    let report = check_layout(&Input::Builtin(name.into()));
+    if !print_reports(&[report]) {
+        panic!("Layout contains mistakes");
+    }
+}
+
+pub fn check_layout_file(path: &str) {
+    let report = check_layout(&Input::File(path.into()));
+    if !print_reports(&[report]) {
         panic!("Layout contains mistakes");
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn batch() {
+        let reports = check_layouts(
+            vec![
+                Input::Builtin("us".into()),
+                Input::Builtin("nonexistent".into()),
+                Input::Builtin("de".into()),
+            ],
+            2,
+        );
+        assert_eq!(
+            reports.iter().map(|r| (r.name.as_str(), r.passed))
+                .collect::<Vec<_>>(),
+            vec![("us", true), ("nonexistent", false), ("de", true)],
+        );
+    }
+}
@@ -0,0 +1,310 @@
+/*! Timing the stages of loading a layout, for benchmarking.
+ *
+ * Each stage gets timed separately, many times over,
+ * and the minimum and the median are reported.
+ * The minimum is the most stable across runs,
+ * the median shows what a typical load costs.
+ *
+ * The stages are:
+ * - parse: reading the YAML source
+ * - compile: creating actions, keycodes, and the keymap text,
+ *   and checking the keymap
+ * - build: putting together the UI structures, including positions
+ * - load: what loading a built-in layout costs at runtime,
+ *   which is reading the compiled form and building
+ * - keymap: compiling the keymap with xkbcommon,
+ *   which the compositor does when it gets a new keymap
+ *
+ * To see how the costs grow with the size of a layout,
+ * synthetic layouts of any size can be generated and timed,
+ * including the work done for each touch and each redraw.
+ */
+
+use std::fmt::Write;
+use std::sync::Arc;
+use std::time::{ Duration, Instant };
+
+use xkbcommon::xkb;
+
+use ::data;
+use ::data::LoadError;
+use ::layout;
+use ::layout::c::Point;
+use ::logging;
+use ::resources;
+
+pub const STAGES: &[&str] = &["parse", "compile", "build", "load", "keymap"];
+
+/// Stages timed on synthetic layouts.
+/// - load: from YAML to UI structures
+/// - hit: finding the button under a touch, per touch
+/// - draw: visiting every visible button, like a redraw does
+/// - keymap: compiling the keymap with xkbcommon
+pub const SCALING_STAGES: &[&str] = &["load", "hit", "draw", "keymap"];
+
+/// Buttons in a full row of a synthetic layout
+const ROW_LENGTH: usize = 10;
+
+/// Keysyms submitted by synthetic buttons.
+/// There are fewer keysyms than buttons in a large layout,
+/// because the keymap holds at most 247 keycodes.
+const SYNTHETIC_KEYSYMS: &[&str] = &[
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+    "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z",
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9",
+];
+
+/// Warnings get reported by the layout tests, not here
+struct Quiet;
+
+impl logging::Handler for Quiet {
+    fn handle(&mut self, _level: logging::Level, _message: &str) {}
+}
+
+fn as_nanos(duration: Duration) -> u64 {
+    duration.as_secs() * 1_000_000_000 + duration.subsec_nanos() as u64
+}
+
+#[derive(Debug, Clone)]
+pub struct Timing {
+    pub stage: &'static str,
+    pub iterations: usize,
+    pub min_ns: u64,
+    pub median_ns: u64,
+}
+
+impl Timing {
+    pub fn new(stage: &'static str, mut samples: Vec<u64>) -> Timing {
+        samples.sort();
+        Timing {
+            stage,
+            iterations: samples.len(),
+            min_ns: samples.first().cloned().unwrap_or(0),
+            median_ns: samples.get(samples.len() / 2).cloned().unwrap_or(0),
+        }
+    }
+}
+
+pub fn get_builtin_names() -> Vec<&'static str> {
+    resources::get_keyboard_names()
+}
+
+/// Times each stage of loading the built-in layout.
+/// Needs the YAML sources to time parsing.
+/// Returns timings in the order of STAGES.
+#[cfg(any(test, feature = "builtin_yaml"))]
+pub fn time_stages(name: &str, iterations: usize)
+    -> Result<Vec<Timing>, LoadError>
+{
+    let mut samples = vec![Vec::with_capacity(iterations); STAGES.len()];
+    let mut keymap_str = String::new();
+    // The first round warms up caches, and doesn't count
+    for i in 0..(iterations + 1) {
+        let start = Instant::now();
+        let layout = data::Layout::from_resource(name)?;
+        let parsed = Instant::now();
+        let compiled = layout.compile(Quiet).0
+            .map_err(LoadError::BadKeyMap)?;
+        let compiled_at = Instant::now();
+        if i == 0 {
+            keymap_str = compiled.keymap_str.clone();
+        }
+        let data = data::build_layout_data(compiled);
+        let built = Instant::now();
+        drop(data);
+
+        let load_start = Instant::now();
+        let data = data::load_builtin(name)?;
+        let loaded = Instant::now();
+        drop(data);
+
+        let keymap_start = Instant::now();
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let keymap = xkb::Keymap::new_from_string(
+            &context,
+            keymap_str.clone(),
+            xkb::KEYMAP_FORMAT_TEXT_V1,
+            xkb::KEYMAP_COMPILE_NO_FLAGS,
+        ).expect("Failed to create keymap");
+        let keymap_done = Instant::now();
+        drop(keymap);
+
+        if i > 0 {
+            let times = [
+                parsed - start,
+                compiled_at - parsed,
+                built - compiled_at,
+                loaded - load_start,
+                keymap_done - keymap_start,
+            ];
+            for (stage, time) in samples.iter_mut().zip(times.iter()) {
+                stage.push(as_nanos(*time));
+            }
+        }
+    }
+    Ok(STAGES.iter().zip(samples.into_iter())
+        .map(|(stage, samples)| Timing::new(stage, samples))
+        .collect())
+}
+
+fn get_view_name(index: usize) -> String {
+    match index {
+        0 => "base".into(),
+        i => format!("view{}", i),
+    }
+}
+
+/// Generates the source of a layout with `views` views,
+/// each holding `buttons` buttons, all of them distinct.
+/// Every view has a button leading to the next one.
+pub fn generate_layout(views: usize, buttons: usize) -> String {
+    let views = views.max(1);
+    let buttons = buttons.max(1);
+    let mut out = String::new();
+    // Writing to a String doesn't fail
+    writeln!(out, "---").unwrap();
+    writeln!(out, "outlines:").unwrap();
+    writeln!(out, "    default: {{ width: 35, height: 52 }}").unwrap();
+    writeln!(out, "views:").unwrap();
+    for v in 0..views {
+        writeln!(out, "    {}:", get_view_name(v)).unwrap();
+        // The last row is shorter, and holds the view switcher
+        for row_start in (0..(buttons + 1)).step_by(ROW_LENGTH) {
+            let row_end = (row_start + ROW_LENGTH).min(buttons);
+            let mut row: Vec<String> = (row_start..row_end)
+                .map(|b| format!("b{}_{}", v, b))
+                .collect();
+            if row_end == buttons {
+                row.push(format!("next{}", v));
+            }
+            writeln!(out, "        - \"{}\"", row.join(" ")).unwrap();
+        }
+    }
+    writeln!(out, "buttons:").unwrap();
+    for v in 0..views {
+        writeln!(
+            out,
+            "    next{}: {{ action: {{ set_view: \"{}\" }} }}",
+            v, get_view_name((v + 1) % views),
+        ).unwrap();
+        for b in 0..buttons {
+            writeln!(
+                out,
+                "    b{}_{}: {{ keysym: \"{}\" }}",
+                v, b, SYNTHETIC_KEYSYMS[b % SYNTHETIC_KEYSYMS.len()],
+            ).unwrap();
+        }
+    }
+    out
+}
+
+/// Times a synthetic layout with `views` views of `buttons` buttons.
+/// Returns timings in the order of SCALING_STAGES.
+pub fn time_scaling(views: usize, buttons: usize, iterations: usize)
+    -> Result<Vec<Timing>, LoadError>
+{
+    let source = generate_layout(views, buttons);
+    let mut samples
+        = vec![Vec::with_capacity(iterations); SCALING_STAGES.len()];
+    for i in 0..(iterations + 1) {
+        let start = Instant::now();
+        let parsed = data::Layout::from_bytes(source.as_bytes())
+            .map_err(LoadError::BadData)?;
+        let data = parsed.build(Quiet).0
+            .map_err(LoadError::BadKeyMap)?;
+        let loaded = Instant::now();
+        let keymap_str = data.keymap_str.clone()
+            .into_string().expect("Bad keymap string");
+        let layout = layout::Layout::new(
+            Arc::new(data),
+            layout::ArrangementKind::Base,
+        );
+
+        // Touching the middle of each button
+        let mut points = Vec::new();
+        layout.foreach_visible_button(|offset, button| {
+            points.push(offset + Point {
+                x: button.size.width / 2.0,
+                y: button.size.height / 2.0,
+            });
+        });
+        let hit_start = Instant::now();
+        let found = points.iter()
+            .filter_map(|point| layout.find_button_by_touch(point.clone()))
+            .count();
+        let hit_done = Instant::now();
+        assert_eq!(found, points.len(), "Touch missed a button");
+
+        let draw_start = Instant::now();
+        let mut area = 0.0;
+        layout.foreach_visible_button(|_offset, button| {
+            area += button.size.width * button.size.height;
+        });
+        let draw_done = Instant::now();
+        assert!(area > 0.0);
+
+        let keymap_start = Instant::now();
+        let context = xkb::Context::new(xkb::CONTEXT_NO_FLAGS);
+        let keymap = xkb::Keymap::new_from_string(
+            &context,
+            keymap_str,
+            xkb::KEYMAP_FORMAT_TEXT_V1,
+            xkb::KEYMAP_COMPILE_NO_FLAGS,
+        ).expect("Failed to create keymap");
+        let keymap_done = Instant::now();
+        drop(keymap);
+
+        if i > 0 {
+            let times = [
+                as_nanos(loaded - start),
+                as_nanos(hit_done - hit_start) / points.len().max(1) as u64,
+                as_nanos(draw_done - draw_start),
+                as_nanos(keymap_done - keymap_start),
+            ];
+            for (stage, time) in samples.iter_mut().zip(times.iter()) {
+                stage.push(*time);
+            }
+        }
+    }
+    Ok(SCALING_STAGES.iter().zip(samples.into_iter())
+        .map(|(stage, samples)| Timing::new(stage, samples))
+        .collect())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn all_stages() {
+        let timings = time_stages("us", 3).unwrap();
+        assert_eq!(
+            timings.iter().map(|t| t.stage).collect::<Vec<_>>(),
+            STAGES.to_vec(),
+        );
+        for timing in timings {
+            assert_eq!(timing.iterations, 3);
+            assert!(timing.min_ns > 0);
+            assert!(timing.min_ns <= timing.median_ns);
+        }
+    }
+
+    #[test]
+    fn synthetic() {
+        let source = generate_layout(3, 25);
+        let layout = data::Layout::from_bytes(source.as_bytes()).unwrap();
+        let data = layout.build(Quiet).0.unwrap();
+        assert_eq!(data.views.len(), 3);
+        let (_offset, view) = &data.views["view2"];
+        let buttons: usize = view.get_rows()
+            .map(|(_offset, row)| row.buttons.len())
+            .sum();
+        assert_eq!(buttons, 26);
+
+        let timings = time_scaling(2, 300, 1).unwrap();
+        assert_eq!(
+            timings.iter().map(|t| t.stage).collect::<Vec<_>>(),
+            SCALING_STAGES.to_vec(),
+        );
+    }
+}
@@ -0,0 +1,346 @@
+/*! A synthetic typist, for benchmarking.
+ *
+ * The typist takes a text and types it out on a layout,
+ * switching views when a character is not on the current one.
+ * Every touch lands somewhere around the centre of the intended key,
+ * scattered according to a normal distribution.
+ * The typist may also be drifting consistently to one side,
+ * which the layout learns to expect.
+ *
+ * Touches go through the same hit testing and key handling
+ * as the ones coming from the screen,
+ * so the results tell both how fast the keystroke path is,
+ * and how forgiving the layout is to imprecise fingers.
+ */
+
+use std::collections::{ HashMap, HashSet, VecDeque };
+use std::f64::consts::PI;
+use std::sync::Arc;
+use std::time::{ Duration, Instant };
+
+use ::action::Action;
+use ::data;
+use ::data::LoadError;
+use ::keyboard::KeyId;
+use ::layout;
+use ::layout::{ ArrangementKind, Layout, Size };
+use ::layout::c::Point;
+use ::layout::seat;
+use ::submission::{ Submission, Timestamp };
+use ::vkeyboard::VirtualKeyboard;
+use ::vkeyboard::c::ZwpVirtualKeyboardV1;
+
+/// Deterministic source of noise: xorshift64*.
+/// Good enough for scattering touches, and reproducible across runs.
+struct Rng(u64);
+
+impl Rng {
+    fn new(seed: u64) -> Rng {
+        // The state must never be 0
+        Rng(seed ^ 0x9e3779b97f4a7c15)
+    }
+
+    fn next_u64(&mut self) -> u64 {
+        let mut x = self.0;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        self.0 = x;
+        x.wrapping_mul(0x2545f4914f6cdd1d)
+    }
+
+    /// Uniform in (0, 1]
+    fn next_f64(&mut self) -> f64 {
+        ((self.next_u64() >> 11) as f64 + 1.0) / (1u64 << 53) as f64
+    }
+
+    /// Standard normal distribution, using the Box-Muller transform
+    fn next_gaussian(&mut self) -> f64 {
+        let radius = (-2.0 * self.next_f64().ln()).sqrt();
+        radius * (2.0 * PI * self.next_f64()).cos()
+    }
+}
+
+/// Where the typist aims to put the finger
+struct Target {
+    view: String,
+    /// Centre of the button in layout coordinates
+    centre: Point,
+    size: Size,
+    key: KeyId,
+    action: Action,
+}
+
+impl Target {
+    /// The view that's current after tapping the key in the view `current`
+    fn next_view(&self, current: &str) -> Option<String> {
+        match &self.action {
+            Action::SetView(view) => Some(view.clone()),
+            Action::LockView { lock, unlock } => Some(
+                if lock == current { unlock.clone() } else { lock.clone() }
+            ),
+            _ => None,
+        }
+    }
+
+    fn submits(&self, c: char) -> bool {
+        match &self.action {
+            Action::Submit { text: Some(text), keys: _ } => {
+                text.as_bytes() == c.encode_utf8(&mut [0; 4]).as_bytes()
+            },
+            // Some keys only submit keysyms
+            Action::Submit { text: None, keys } => match c {
+                '\n' => keys.len() == 1 && keys[0].0 == "Return",
+                '\t' => keys.len() == 1 && keys[0].0 == "Tab",
+                _ => false,
+            },
+            _ => false,
+        }
+    }
+}
+
+fn find_targets(layout: &Layout) -> Vec<Target> {
+    let mut targets = Vec::new();
+    for (name, (view_offset, view)) in &layout.arrangement.views {
+        for (row_offset, row) in view.get_rows() {
+            for (x_offset, button) in &row.buttons {
+                let offset = view_offset.clone()
+                    + row_offset.clone()
+                    + Point { x: *x_offset, y: 0.0 };
+                targets.push(Target {
+                    view: name.clone(),
+                    centre: offset + Point {
+                        x: button.size.width / 2.0,
+                        y: button.size.height / 2.0,
+                    },
+                    size: button.size.clone(),
+                    key: button.key,
+                    action: layout.get_key(button.key).action.clone(),
+                });
+            }
+        }
+    }
+    targets
+}
+
+/// Finds the shortest sequence of taps which submits `c`,
+/// starting from the view `view`.
+/// Returns indices into `targets`.
+fn plan(targets: &[Target], view: &str, c: char) -> Option<Vec<usize>> {
+    let mut visited = HashSet::new();
+    visited.insert(view.to_owned());
+    let mut queue = VecDeque::new();
+    queue.push_back((view.to_owned(), Vec::new()));
+
+    while let Some((view, path)) = queue.pop_front() {
+        let in_view = || targets.iter().enumerate()
+            .filter(|(_i, target)| target.view == view);
+
+        let found = in_view().find(|(_i, target)| target.submits(c));
+        if let Some((i, _target)) = found {
+            let mut path = path;
+            path.push(i);
+            return Some(path);
+        }
+
+        for (i, target) in in_view() {
+            if let Some(next) = target.next_view(&view) {
+                if visited.insert(next.clone()) {
+                    let mut path = path.clone();
+                    path.push(i);
+                    queue.push_back((next, path));
+                }
+            }
+        }
+    }
+    None
+}
+
+#[derive(Debug, Default)]
+pub struct Report {
+    /// All touches, including the ones needed to switch views
+    pub keystrokes: u32,
+    /// Touches that didn't land on the intended key
+    pub mishits: u32,
+    /// Characters that can't be typed on the layout
+    pub unreachable: u32,
+    /// Time spent handling touches, not including the typist's own work
+    pub elapsed: Duration,
+}
+
+impl Report {
+    pub fn keystrokes_per_second(&self) -> f64 {
+        let elapsed = self.elapsed.as_secs() as f64
+            + self.elapsed.subsec_nanos() as f64 * 1e-9;
+        self.keystrokes as f64 / elapsed
+    }
+
+    pub fn mishit_rate(&self) -> f64 {
+        self.mishits as f64 / self.keystrokes as f64
+    }
+}
+
+pub struct Typist {
+    layout: Layout,
+    submission: Submission,
+    targets: Vec<Target>,
+    /// Plans for each (view, character), computed on first use
+    plans: HashMap<(String, char), Option<Vec<usize>>>,
+    /// Standard deviation of touches, as a fraction of the key size
+    scatter: f64,
+    /// Where the typist hits relative to the key centre, in key sizes
+    drift: Point,
+    rng: Rng,
+    time: u32,
+}
+
+impl Typist {
+    /// Loads a built-in layout.
+    /// Submission happens through the virtual keyboard only.
+    pub fn new(name: &str, scatter: f64, seed: u64)
+        -> Result<Typist, LoadError>
+    {
+        let arrangement = Arc::new(data::load_builtin(name)?);
+        let layout = layout::Layout::new(arrangement, ArrangementKind::Base);
+        let submission = Submission::new(
+            None,
+            VirtualKeyboard(ZwpVirtualKeyboardV1(::std::ptr::null())),
+        );
+        Ok(Typist {
+            targets: find_targets(&layout),
+            layout,
+            submission,
+            plans: HashMap::new(),
+            scatter,
+            drift: Point { x: 0.0, y: 0.0 },
+            rng: Rng::new(seed),
+            time: 0,
+        })
+    }
+
+    pub fn set_drift(&mut self, drift: Point) {
+        self.drift = drift;
+    }
+
+    pub fn type_text(&mut self, text: &str) -> Report {
+        let mut report = Report::default();
+        for c in text.chars() {
+            let plan = {
+                let targets = &self.targets;
+                let view = self.layout.current_view.clone();
+                self.plans.entry((view.clone(), c))
+                    .or_insert_with(|| plan(targets, &view, c))
+                    .clone()
+            };
+            match plan {
+                Some(plan) => for i in plan {
+                    // After a miss, the rest of the plan is likely wrong.
+                    // Move on to the next character instead.
+                    if !self.tap(i, &mut report) {
+                        break;
+                    }
+                },
+                None => report.unreachable += 1,
+            }
+        }
+        report
+    }
+
+    /// Returns whether the intended key was hit
+    fn tap(&mut self, target: usize, report: &mut Report) -> bool {
+        let (point, intended) = {
+            let target = &self.targets[target];
+            let (width, height) = (target.size.width, target.size.height);
+            let x = self.drift.x + self.scatter * self.rng.next_gaussian();
+            let y = self.drift.y + self.scatter * self.rng.next_gaussian();
+            (
+                Point {
+                    x: target.centre.x + x * width,
+                    y: target.centre.y + y * height,
+                },
+                target.key,
+            )
+        };
+
+        let start = Instant::now();
+        let hit = seat::handle_touch(&mut self.layout, point);
+        if let Some(key) = hit {
+            seat::handle_press_key(
+                &mut self.layout,
+                &mut self.submission,
+                Timestamp(self.time),
+                key,
+            );
+            seat::handle_release_key(
+                &mut self.layout,
+                &mut self.submission,
+                None,
+                Timestamp(self.time + 1),
+                None,
+                key,
+            );
+        }
+        report.elapsed += start.elapsed();
+
+        self.time += 100;
+        report.keystrokes += 1;
+        let hit = match hit {
+            Some(key) => key == intended,
+            None => false,
+        };
+        if !hit {
+            report.mishits += 1;
+        }
+        hit
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn precise_typing() {
+        let mut typist = Typist::new("us", 0.0, 0).unwrap();
+        let report = typist.type_text("Hello, World!\n");
+        assert_eq!(report.unreachable, 0);
+        assert_eq!(report.mishits, 0);
+        // Shift before each capital, a switch to numbers before "," and "!",
+        // and a switch back to letters before "W"
+        assert_eq!(report.keystrokes, 14 + 2 + 2 + 1);
+    }
+
+    #[test]
+    fn unreachable() {
+        let mut typist = Typist::new("us", 0.0, 0).unwrap();
+        let report = typist.type_text("ą");
+        assert_eq!(report.unreachable, 1);
+        assert_eq!(report.keystrokes, 0);
+    }
+
+    #[test]
+    fn scatter_is_reproducible() {
+        let text = "the quick brown fox jumps over the lazy dog";
+        let mishits = |seed| {
+            Typist::new("us", 0.5, seed).unwrap()
+                .type_text(text)
+                .mishits
+        };
+        assert_eq!(mishits(1), mishits(1));
+        assert!(mishits(1) > 0);
+    }
+
+    #[test]
+    fn drift_gets_learned() {
+        let text = "the quick brown fox jumps over the lazy dog\n";
+        let mut typist = Typist::new("us", 0.15, 0).unwrap();
+        typist.set_drift(Point { x: 0.0, y: 0.4 });
+        let untrained = typist.type_text(text).mishits;
+        for _ in 0..10 {
+            typist.type_text(text);
+        }
+        let trained = typist.type_text(text).mishits;
+        assert!(untrained > 5);
+        assert!(trained < untrained / 2);
+    }
+}
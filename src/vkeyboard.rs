@@ -1,5 +1,7 @@
 /*! Managing the events belonging to virtual-keyboard interface. */
 
+use std::os::raw::c_char;
+
 use ::keyboard::{ KeyCode, Modifiers, PressType };
 use ::layout::c::LevelKeyboard;
 use ::submission::Timestamp;
@@ -7,11 +9,11 @@ use ::submission::Timestamp;
 /// Gathers stuff defined in C or called by C
 pub mod c {
     use super::*;
-    use std::os::raw::c_void;
+    use std::os::raw::{ c_char, c_void };
 
     #[repr(transparent)]
     #[derive(Clone, Copy)]
-    pub struct ZwpVirtualKeyboardV1(*const c_void);
+    pub struct ZwpVirtualKeyboardV1(pub *const c_void);
 
     #[no_mangle]
     extern "C" {
@@ -26,6 +28,12 @@ pub mod c {
             virtual_keyboard: ZwpVirtualKeyboardV1,
             keyboard: LevelKeyboard,
         );
+
+        pub fn eek_virtual_keyboard_send_keymap(
+            virtual_keyboard: ZwpVirtualKeyboardV1,
+            keymap: *const c_char,
+            len: usize,
+        );
         
         pub fn eek_virtual_keyboard_set_modifiers(
             virtual_keyboard: ZwpVirtualKeyboardV1,
@@ -85,4 +93,17 @@ impl VirtualKeyboard {
             c::eek_virtual_keyboard_update_keymap(self.0, keyboard);
         }
     }
+
+    /// Sends a keymap which doesn't belong to any keyboard.
+    /// The text must end with a null byte.
+    pub fn set_keymap(&self, keymap: &[u8]) {
+        assert_eq!(keymap.last(), Some(&0), "Keymap not terminated");
+        unsafe {
+            c::eek_virtual_keyboard_send_keymap(
+                self.0,
+                keymap.as_ptr() as *const c_char,
+                keymap.len(),
+            );
+        }
+    }
 }
@@ -0,0 +1,242 @@
+/*! Keeping track of the user's layout files.
+ *
+ * Most layouts don't have a user's version,
+ * so most lookups in the user's directory are for missing files.
+ * Instead of asking the filesystem each time,
+ * the watcher keeps an index of the files in the directory,
+ * and updates it when inotify reports a change.
+ *
+ * When the directory can't be watched, for example because it doesn't exist,
+ * the index knows nothing, and lookups go to the filesystem like before.
+ */
+
+use std::collections::HashMap;
+use std::ffi::{ CString, OsString };
+use std::fs;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::RawFd;
+use std::path::{ Path, PathBuf };
+use std::sync::Mutex;
+use std::time::SystemTime;
+
+use ::logging;
+
+// traits
+use ::logging::Warn;
+
+pub mod c {
+    use super::*;
+    use std::os::raw::{ c_char, c_int, c_void };
+
+    extern "C" {
+        // from libc
+        pub fn inotify_init1(flags: c_int) -> c_int;
+        pub fn inotify_add_watch(fd: c_int, path: *const c_char, mask: u32)
+            -> c_int;
+        pub fn read(fd: c_int, buf: *mut c_void, count: usize) -> isize;
+        pub fn close(fd: c_int) -> c_int;
+    }
+
+    pub const IN_NONBLOCK: c_int = 0o4000;
+    pub const IN_CLOEXEC: c_int = 0o2000000;
+
+    pub const IN_CLOSE_WRITE: u32 = 0x8;
+    pub const IN_MOVED_FROM: u32 = 0x40;
+    pub const IN_MOVED_TO: u32 = 0x80;
+    pub const IN_CREATE: u32 = 0x100;
+    pub const IN_DELETE: u32 = 0x200;
+    pub const IN_DELETE_SELF: u32 = 0x400;
+    pub const IN_MOVE_SELF: u32 = 0x800;
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_watcher_new() -> *mut Watcher {
+        Box::into_raw(Box::new(Watcher::new(::data::get_keyboards_path())))
+    }
+
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_watcher_free(watcher: *mut Watcher) {
+        drop(unsafe { Box::from_raw(watcher) });
+    }
+
+    /// Returns the file descriptor to poll, or -1 if not watching
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_watcher_get_fd(watcher: *const Watcher) -> c_int {
+        let watcher = unsafe { &*watcher };
+        watcher.fd.unwrap_or(-1)
+    }
+
+    /// Returns whether any layout file changed
+    #[no_mangle]
+    pub extern "C"
+    fn squeek_layout_watcher_dispatch(watcher: *const Watcher) -> u32 {
+        let watcher = unsafe { &*watcher };
+        watcher.dispatch() as u32
+    }
+}
+
+/// File names, with modification times
+type Index = HashMap<OsString, SystemTime>;
+
+fn scan(dir: &Path) -> io::Result<Index> {
+    let mut index = HashMap::new();
+    for entry in fs::read_dir(dir)? {
+        let entry = entry?;
+        let modified = entry.metadata()?.modified()?;
+        index.insert(entry.file_name(), modified);
+    }
+    Ok(index)
+}
+
+pub struct Watcher {
+    dir: PathBuf,
+    /// inotify instance, None if not watching
+    fd: Option<RawFd>,
+    /// Shared with the threads loading layouts
+    index: Mutex<Index>,
+}
+
+impl Watcher {
+    pub fn new(dir: Option<PathBuf>) -> Watcher {
+        let dir = match dir {
+            Some(dir) => dir,
+            None => return Watcher {
+                dir: PathBuf::new(),
+                fd: None,
+                index: Mutex::new(HashMap::new()),
+            },
+        };
+        let fd = Watcher::watch(&dir)
+            .map_err(|e| log_print!(
+                logging::Level::Debug,
+                "Not watching layouts in {:?}: {}", dir, e,
+            ))
+            .ok();
+        // Scanning after the watch is set up,
+        // so that no change gets missed
+        let index = fd.and_then(|fd| {
+            let index = scan(&dir).or_print(
+                logging::Problem::Surprise,
+                &format!("Can't list layouts in {:?}", dir),
+            );
+            if index.is_none() {
+                unsafe { c::close(fd) };
+            }
+            index
+        });
+        Watcher {
+            fd: index.as_ref().and(fd),
+            index: Mutex::new(index.unwrap_or_else(HashMap::new)),
+            dir,
+        }
+    }
+
+    fn watch(dir: &Path) -> io::Result<RawFd> {
+        let path = CString::new(dir.as_os_str().as_bytes())
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))?;
+        let fd = unsafe { c::inotify_init1(c::IN_NONBLOCK | c::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let mask = c::IN_CLOSE_WRITE | c::IN_MOVED_FROM | c::IN_MOVED_TO
+            | c::IN_CREATE | c::IN_DELETE
+            | c::IN_DELETE_SELF | c::IN_MOVE_SELF;
+        if unsafe { c::inotify_add_watch(fd, path.as_ptr(), mask) } < 0 {
+            let e = io::Error::last_os_error();
+            unsafe { c::close(fd) };
+            return Err(e);
+        }
+        Ok(fd)
+    }
+
+    /// Returns whether the file exists,
+    /// or None if the watcher doesn't know.
+    pub fn contains(&self, path: &Path) -> Option<bool> {
+        if self.fd.is_none() || path.parent() != Some(&self.dir) {
+            return None;
+        }
+        let name = path.file_name()?;
+        let index = self.index.lock().unwrap();
+        Some(index.contains_key(name))
+    }
+
+    /// Reads pending events, and updates the index.
+    /// Returns whether any file changed.
+    pub fn dispatch(&self) -> bool {
+        let fd = match self.fd {
+            Some(fd) => fd,
+            None => return false,
+        };
+        // The events only say that something happened.
+        // Listing the directory again is simpler than following them,
+        // and changes are rare.
+        let mut buf = [0u8; 4096];
+        let mut got_events = false;
+        loop {
+            let len = unsafe {
+                c::read(fd, buf.as_mut_ptr() as *mut _, buf.len())
+            };
+            if len <= 0 {
+                break;
+            }
+            got_events = true;
+        }
+        if !got_events {
+            return false;
+        }
+        // When the directory is gone, so are the files in it
+        let new_index = scan(&self.dir).unwrap_or_else(|_| HashMap::new());
+        let mut index = self.index.lock().unwrap();
+        let changed = *index != new_index;
+        *index = new_index;
+        changed
+    }
+}
+
+impl Drop for Watcher {
+    fn drop(&mut self) {
+        if let Some(fd) = self.fd {
+            unsafe { c::close(fd) };
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::env;
+    use std::process;
+
+    #[test]
+    fn follows_changes() {
+        let dir = env::temp_dir()
+            .join(format!("squeekboard-watcher-{}", process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let watcher = Watcher::new(Some(dir.clone()));
+        let file = dir.join("us.yaml");
+        assert_eq!(watcher.contains(&file), Some(false));
+        assert_eq!(watcher.dispatch(), false);
+
+        fs::write(&file, "views: {}").unwrap();
+        assert_eq!(watcher.dispatch(), true);
+        assert_eq!(watcher.contains(&file), Some(true));
+        // Not in the watched directory
+        assert_eq!(watcher.contains(&env::temp_dir().join("us.yaml")), None);
+
+        fs::remove_file(&file).unwrap();
+        assert_eq!(watcher.dispatch(), true);
+        assert_eq!(watcher.contains(&file), Some(false));
+        fs::remove_dir(&dir).unwrap();
+    }
+
+    #[test]
+    fn missing_dir() {
+        let dir = env::temp_dir().join("squeekboard-watcher-missing");
+        let watcher = Watcher::new(Some(dir.clone()));
+        assert_eq!(watcher.contains(&dir.join("us.yaml")), None);
+        assert_eq!(watcher.dispatch(), false);
+    }
+}
@@ -1,3 +1,5 @@
+#include <unistd.h>
+
 #include "eek/eek-keyboard.h"
 
 #include "wayland.h"
@@ -20,6 +22,16 @@ void eek_virtual_keyboard_update_keymap(struct zwp_virtual_keyboard_v1 *zwp_virt
         keyboard->keymap_fd, keyboard->keymap_len);
 }
 
+/// Sends a keymap which doesn't belong to any keyboard.
+/// `len` includes the terminating null byte.
+/// The file gets copied when sending, so it's closed right away.
+void eek_virtual_keyboard_send_keymap(struct zwp_virtual_keyboard_v1 *zwp_virtual_keyboard_v1, const char *keymap, size_t len) {
+    int fd = eek_keymap_fd_new(keymap, len);
+    zwp_virtual_keyboard_v1_keymap(zwp_virtual_keyboard_v1,
+        WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, len);
+    close(fd);
+}
+
 void
 eek_virtual_keyboard_set_modifiers(struct zwp_virtual_keyboard_v1 *zwp_virtual_keyboard_v1, uint32_t mods_depressed) {
     zwp_virtual_keyboard_v1_modifiers(zwp_virtual_keyboard_v1,
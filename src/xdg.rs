@@ -53,6 +53,12 @@ fn data_dir() -> Option<PathBuf> {
         .or_else(|| home_dir().map(|h| h.join(".local/share")))
 }
 
+fn cache_dir() -> Option<PathBuf> {
+    env::var_os("XDG_CACHE_HOME")
+        .and_then(is_absolute_path)
+        .or_else(|| home_dir().map(|h| h.join(".cache")))
+}
+
 /// Returns the path to the directory within the data dir
 pub fn data_path<P>(path: P) -> Option<PathBuf>
     where P: AsRef<Path>
@@ -61,3 +67,12 @@ pub fn data_path<P>(path: P) -> Option<PathBuf>
         dir.join(path.as_ref())
     })
 }
+
+/// Returns the path to the directory within the cache dir
+pub fn cache_path<P>(path: P) -> Option<PathBuf>
+    where P: AsRef<Path>
+{
+    cache_dir().map(|dir| {
+        dir.join(path.as_ref())
+    })
+}